@@ -6,6 +6,8 @@ extern "C" {
 #endif  // __cplusplus
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /////////////////////////////////
 // Export Definitions & Macros //
@@ -41,7 +43,16 @@ typedef enum neurosdk_error {
 	NeuroSDK_UnknownCommand,
 	NeuroSDK_InvalidMessage,
 	NeuroSDK_CommandNotAvailable,
-	NeuroSDK_SendFailed
+	NeuroSDK_SendFailed,
+	// The server stopped answering heartbeats and the connection was closed.
+	// Without `reconnect_min_ms` the context stays disconnected and every poll
+	// returns this; create a new context to connect again. With it, this is
+	// returned once and the context reconnects on its own.
+	NeuroSDK_PeerTimeout,
+	NeuroSDK_DataPathNotFound,
+	NeuroSDK_DataTypeMismatch,
+	NeuroSDK_FileError,
+	NeuroSDK_MessageTooLarge
 } neurosdk_error_e;
 
 // Severity Levels
@@ -64,7 +75,35 @@ typedef enum neurosdk_priority {
 typedef enum neurosdk_context_create_flags {
 	NeuroSDK_ContextCreateFlags_None = 0,
 	NeuroSDK_ContextCreateFlags_DebugPrints = (1 << 0),
-	NeuroSDK_ContextCreateFlags_ValidationLayers = (1 << 1)
+	NeuroSDK_ContextCreateFlags_ValidationLayers = (1 << 1),
+	// Replace unsent actions/force messages with newer ones and merge
+	// consecutive silent context messages queued within `coalesce_window_ms`.
+	NeuroSDK_ContextCreateFlags_CoalesceMessages = (1 << 2),
+	// Drain outbound messages by priority instead of in plain FIFO order. Each
+	// wakeup sends, in order: startup, action results, action
+	// (un)registrations, forces and finally context messages. Messages of the
+	// same lane always go out in the order they were sent, and registrations
+	// still precede any force queued after them.
+	NeuroSDK_ContextCreateFlags_PriorityLanes = (1 << 3),
+	// Skip context and actions/force messages identical to the last one of the
+	// same kind sent less than `dedup_window_ms` ago.
+	NeuroSDK_ContextCreateFlags_DeduplicateMessages = (1 << 4),
+	// Parse the data of inbound actions once into `parsed_data`, readable with
+	// the neurosdk_action_data_get_* functions.
+	NeuroSDK_ContextCreateFlags_ParseActionData = (1 << 5),
+	// Compile the JSON schema of every registered action once and check the
+	// data of inbound actions against it. Mismatches are delivered with
+	// `validation_error` set.
+	NeuroSDK_ContextCreateFlags_ValidateActions = (1 << 6),
+	// Like ValidateActions, but answer mismatching actions with a failed
+	// action:result instead of delivering them.
+	NeuroSDK_ContextCreateFlags_RejectInvalidActions = (1 << 7),
+	// Feed a replayed recording as fast as it is polled instead of at the
+	// recorded pace.
+	NeuroSDK_ContextCreateFlags_ReplayMaxSpeed = (1 << 8),
+	// Record timed spans of polling, parsing, sending, lock waits and action
+	// handlers plus queue depths, for neurosdk_context_dump_trace().
+	NeuroSDK_ContextCreateFlags_Trace = (1 << 9)
 } neurosdk_context_create_flags_e;
 
 #define NEUROSDK_CONTEXT_CREATE_FLAGS_DEBUG  \
@@ -85,10 +124,20 @@ typedef enum neurosdk_message_kind {
 	NeuroSDK_MessageKind_Action
 } neurosdk_message_kind_e;
 
+#define NEUROSDK_MESSAGE_KIND_COUNT (NeuroSDK_MessageKind_Action + 1)
+
 // Callbacks
 typedef void (*neurosdk_callback_log_t)(neurosdk_severity_e severity,
                                         char *message,
                                         void *user_data);
+typedef void *(*neurosdk_callback_alloc_t)(size_t size, void *user_data);
+typedef void *(*neurosdk_callback_realloc_t)(void *ptr,
+                                             size_t old_size,
+                                             size_t new_size,
+                                             void *user_data);
+typedef void (*neurosdk_callback_free_t)(void *ptr,
+                                         size_t size,
+                                         void *user_data);
 
 /////////////////////
 // Data Structures //
@@ -136,11 +185,20 @@ typedef struct neurosdk_message_action_result {
 	char *message;
 } neurosdk_message_action_result_t;
 
+// Parsed Action Data (opaque)
+typedef struct neurosdk_action_data neurosdk_action_data_t;
+
 // Action Message
 typedef struct neurosdk_message_action {
 	char *id;
 	char *name;
 	char *data;
+	// Only set with NeuroSDK_ContextCreateFlags_ParseActionData and valid JSON
+	// data. Owned by the message.
+	neurosdk_action_data_t *parsed_data;
+	// Only set with NeuroSDK_ContextCreateFlags_ValidateActions when the data
+	// does not match the registered schema. Owned by the message.
+	char *validation_error;
 } neurosdk_message_action_t;
 
 // General Message Structure
@@ -154,8 +212,41 @@ typedef struct neurosdk_message {
 		neurosdk_message_action_result_t action_result;
 		neurosdk_message_action_t action;
 	} value;
+	// Inbound messages only. When the frame was received, in microseconds of
+	// neurosdk_time_us(), and its number in the order frames arrived, from 1.
+	// A gap in the numbers means frames were dropped or failed to parse.
+	uint64_t received_us;
+	uint64_t sequence;
 } neurosdk_message_t;
 
+// Action Handler
+// Runs on a worker thread. Returns the success of the action and may write a
+// NUL-terminated result message of at most NEUROSDK_RESULT_MESSAGE_MAX bytes,
+// including the terminator, into `message`. An empty message is sent as null.
+#define NEUROSDK_RESULT_MESSAGE_MAX 1024
+
+typedef bool (*neurosdk_callback_action_t)(
+    neurosdk_message_action_t const *action,
+    char *message,
+    void *user_data);
+
+// Outbound Rate Limit
+typedef struct neurosdk_rate_limit {
+	double messages_per_second;  // 0 disables limiting for the kind
+	int burst;                   // Bucket size, at least 1
+} neurosdk_rate_limit_t;
+
+// Memory Allocator
+// Used for every allocation the context makes, including JSON trees and
+// mongoose buffers. Leave `alloc` NULL to use the C runtime. `realloc` is
+// optional and emulated with alloc and free when NULL.
+typedef struct neurosdk_allocator {
+	neurosdk_callback_alloc_t alloc;
+	neurosdk_callback_realloc_t realloc;
+	neurosdk_callback_free_t free;
+	void *user_data;
+} neurosdk_allocator_t;
+
 // Context Creation Descriptor
 typedef struct neurosdk_context_create_desc {
 	char const *url;
@@ -164,8 +255,138 @@ typedef struct neurosdk_context_create_desc {
 	void *user_data;
 	neurosdk_context_create_flags_e flags;
 	neurosdk_callback_log_t callback_log;
+	int coalesce_window_ms;  // 0 uses the default (100ms)
+	int dedup_window_ms;     // 0 uses the default (1000ms)
+	// Messages over the limit wait in the outbound queue instead of failing.
+	neurosdk_rate_limit_t rate_limits[NEUROSDK_MESSAGE_KIND_COUNT];
+	int max_pending_messages;  // 0 uses the default (256)
+	int heartbeat_interval_ms;  // 0 disables websocket pings
+	int heartbeat_max_missed;   // 0 uses the default (3)
+	neurosdk_allocator_t allocator;
+	// Threads running action handlers, see neurosdk_context_set_handler(). 0
+	// disables the pool.
+	int worker_threads;
+	// Appends every text frame sent and received, with its time, to this file.
+	// The format is described in neurosdk.c above record_frame().
+	char const *record_path;
+	// Plays the received frames of a recording back instead of connecting.
+	// `url` is not needed. Sends are accepted but go nowhere except into a new
+	// recording.
+	char const *replay_path;
+	// With NeuroSDK_ContextCreateFlags_Trace, the trace is also written here
+	// when the context is destroyed.
+	char const *trace_path;
+	// TLS for wss:// URLs, as PEM text. With `tls_ca` the server certificate
+	// and host name are verified, without it any certificate is accepted.
+	// `tls_cert` and `tls_key` (an EC key) identify the client when the
+	// server asks for it. Every connection, reconnects included, makes a full
+	// handshake: mongoose's built-in TLS 1.3 has no session tickets or PSK, so
+	// sessions are not resumed.
+	char const *tls_ca;
+	char const *tls_cert;
+	char const *tls_key;
+	// Inbound limits, together a ceiling on what one server can make the
+	// context hold. A frame over `max_frame_size` is refused as soon as its
+	// header arrives and the connection is closed, since the rest of it cannot
+	// be skipped. Mongoose never buffers more than MG_MAX_RECV_SIZE, so larger
+	// values have no effect.
+	size_t max_frame_size;     // 0 uses the default (MG_MAX_RECV_SIZE, 3MB)
+	size_t max_inbound_bytes;  // Received, not yet polled. 0 uses 16MB
+	size_t max_action_data;    // Length of an action's 'data', 0 for no limit
+	// Warns about actions waiting longer for their result, see
+	// neurosdk_context_action_profiles(). 0 disables the warnings.
+	int slow_action_ms;
+	// Reconnects after the connection is lost, waiting `reconnect_min_ms`
+	// before the first attempt and twice as long before each next one, up to
+	// `reconnect_max_ms`. Polls make the attempts. Sends are queued meanwhile,
+	// and on the new connection startup, if it was sent, and the registered
+	// actions are sent again before them. Messages already written to the old
+	// socket are lost. 0 leaves a lost connection lost.
+	int reconnect_min_ms;
+	int reconnect_max_ms;  // 0 uses the default (30000ms)
 } neurosdk_context_create_desc_t;
 
+// Context Statistics
+typedef struct neurosdk_context_stats {
+	uint64_t coalesced_forces;
+	uint64_t coalesced_contexts;
+	uint64_t dedup_hits;
+	uint64_t throttled_messages;
+	uint64_t rejected_actions;
+	uint64_t handled_actions;
+	uint64_t oversized_messages;  // Dropped by one of the inbound limits
+	uint64_t bytes_in_use;  // Allocated through the context's allocator
+	uint64_t peak_bytes_in_use;
+	// Allocations made so far and not yet freed. Their difference across an
+	// operation is its allocation cost, a rising live count over a long
+	// session is a leak.
+	uint64_t allocations;
+	uint64_t live_allocations;
+	int pending_messages;
+	uint64_t reconnects;  // Connections opened again after one was lost
+	// Handler results that could not be queued, e.g. with the queue full. The
+	// server never hears back about those actions.
+	uint64_t dropped_results;
+} neurosdk_context_stats_t;
+
+// Heartbeat Round-Trip Times
+#define NEUROSDK_RTT_BUCKET_COUNT 24
+
+typedef struct neurosdk_rtt_stats {
+	uint64_t pings_sent;
+	uint64_t pongs_received;
+	int missed_pongs;  // Consecutive pings without a pong
+	// Summary of the last (up to 64) samples, in microseconds.
+	int samples;
+	uint32_t last_us;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint32_t mean_us;
+	uint32_t p50_us;
+	uint32_t p90_us;
+	uint32_t p99_us;
+	// Bucket i counts samples in [2^i, 2^(i+1)) microseconds, the last bucket
+	// also holds everything slower.
+	uint32_t buckets[NEUROSDK_RTT_BUCKET_COUNT];
+} neurosdk_rtt_stats_t;
+
+// Latency Summary
+// Same as the samples part of neurosdk_rtt_stats_t.
+typedef struct neurosdk_latency {
+	int samples;
+	uint32_t last_us;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint32_t mean_us;
+	uint32_t p50_us;
+	uint32_t p90_us;
+	uint32_t p99_us;
+	uint32_t buckets[NEUROSDK_RTT_BUCKET_COUNT];
+} neurosdk_latency_t;
+
+// Action Response Times
+typedef struct neurosdk_response_stats {
+	// From receiving an action to poll returning it. Actions run by a handler
+	// are not counted.
+	neurosdk_latency_t queued;
+	// From receiving an action to sending its action:result.
+	neurosdk_latency_t response;
+	// Results sent for ids that were not received, were already answered or
+	// were forgotten because too many actions went unanswered.
+	uint64_t unmatched_results;
+} neurosdk_response_stats_t;
+
+// Response Times per Action Name
+typedef struct neurosdk_action_profile {
+	char const *name;  // Owned by the context
+	uint64_t results;
+	// Waited longer than `slow_action_ms`, counted once each, answered or not.
+	uint64_t slow;
+	// Given up on: more than 256 actions were waiting for their results.
+	uint64_t orphaned;
+	neurosdk_latency_t latency;  // From receiving an action to its result
+} neurosdk_action_profile_t;
+
 //////////////////////
 // Public Functions //
 //////////////////////
@@ -177,25 +398,143 @@ NEUROSDK_EXPORT char const *neurosdk_git_hash(void);
 // Error Handling
 NEUROSDK_EXPORT char const *neurosdk_error_string(neurosdk_error_e err);
 
+// Time
+// Microseconds of the monotonic clock used for message timestamps and traces.
+NEUROSDK_EXPORT uint64_t neurosdk_time_us(void);
+
 // Message Management
+// Polled messages are allocated by their context and must be destroyed before
+// it.
 NEUROSDK_EXPORT neurosdk_error_e
 neurosdk_message_destroy(neurosdk_message_t *msg);
 
+// Parsed Action Data
+// Paths select nested values with '.' for object keys and '[n]' for array
+// elements, e.g. "targets[2].name". A NULL or empty path selects the root.
+// Strings point into the message and live until it is destroyed.
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_int(neurosdk_message_action_t const *action,
+                             char const *path,
+                             OUT int64_t *value);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_double(neurosdk_message_action_t const *action,
+                                char const *path,
+                                OUT double *value);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_bool(neurosdk_message_action_t const *action,
+                              char const *path,
+                              OUT bool *value);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_str(neurosdk_message_action_t const *action,
+                             char const *path,
+                             OUT char const **value,
+                             OUT size_t *len);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_array(neurosdk_message_action_t const *action,
+                               char const *path,
+                               OUT size_t *len);
+
 // Context Management
 NEUROSDK_EXPORT neurosdk_error_e
 neurosdk_context_create(neurosdk_context_t *ctx,
                         neurosdk_context_create_desc_t *desc);
 NEUROSDK_EXPORT neurosdk_error_e
 neurosdk_context_destroy(neurosdk_context_t *ctx);
+// Destroys the context after sending what is still queued, waiting at most
+// `timeout_ms` for the queue and a websocket close to go out. Queued action
+// handlers run first and are not bound by the timeout. `dropped`, when not
+// NULL, receives the number of messages that could not be sent in time.
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_shutdown(neurosdk_context_t *ctx,
+                          int timeout_ms,
+                          OUT int *dropped);
 NEUROSDK_EXPORT bool neurosdk_context_connected(neurosdk_context_t *ctx);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_stats(neurosdk_context_t *ctx,
+                       OUT neurosdk_context_stats_t *stats);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_rtt(neurosdk_context_t *ctx, OUT neurosdk_rtt_stats_t *stats);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_response_times(neurosdk_context_t *ctx,
+                                OUT neurosdk_response_stats_t *stats);
+// Fills up to `cap` profiles, one per action name received so far, and sets
+// `count` to the number there are. Names stay valid until the context is
+// destroyed; at most 256 names are tracked.
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_action_profiles(neurosdk_context_t *ctx,
+                                 OUT neurosdk_action_profile_t *profiles,
+                                 int cap,
+                                 OUT int *count);
+
+// Action Handlers
+// Actions named `name` are no longer returned by poll but run on the worker
+// pool, which sends their action:result when the handler returns. A NULL
+// handler removes it again. Handlers may run concurrently and must be thread
+// safe. Requires `worker_threads` to be set.
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_set_handler(neurosdk_context_t *ctx,
+                             char const *name,
+                             neurosdk_callback_action_t handler,
+                             void *user_data);
+
+// Tracing
+// Writes the spans and counters recorded so far as Chrome trace-event JSON,
+// which Perfetto and chrome://tracing load. Timestamps are microseconds of
+// the monotonic clock (CLOCK_MONOTONIC, QueryPerformanceCounter on Windows).
+// Each thread keeps its first 65536 events, later ones are dropped.
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_dump_trace(neurosdk_context_t *ctx, char const *path);
 
 // Communication Functions
+// Threading: poll and destroy must be called from one thread at a time, the
+// polling thread. The send functions, stats queries and
+// neurosdk_context_connected() are safe from any number of threads. Sends on
+// the polling thread flush right away; sends elsewhere are queued and flushed
+// by the next poll, which they wake up if it is waiting.
 NEUROSDK_EXPORT neurosdk_error_e
 neurosdk_context_poll(neurosdk_context_t *ctx,
                       OUT neurosdk_message_t **messages,
                       OUT int *count);
+// Like neurosdk_context_poll(), but parses at most `max_messages` received
+// frames and stops once `max_us` microseconds have passed, counting the wait
+// for the socket. At least one frame is parsed when any is waiting. Leftover
+// frames are kept for the next call, which then does not wait. 0 disables a
+// budget.
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_poll_budget(neurosdk_context_t *ctx,
+                             int max_messages,
+                             uint32_t max_us,
+                             OUT neurosdk_message_t **messages,
+                             OUT int *count);
 NEUROSDK_EXPORT neurosdk_error_e neurosdk_context_send(neurosdk_context_t *ctx,
                                                        neurosdk_message_t *msg);
+// Same as sending NeuroSDK_MessageKind_ActionsRegister, which also goes
+// through here, for any number of actions. They are split into
+// actions/register frames of at most 64KB, each built and queued in turn, so
+// no single allocation or frame holds the whole set. All frames must fit in
+// the free room of the outbound queue (max_pending_messages) at once;
+// otherwise nothing is queued and NeuroSDK_MessageQueueFull is returned. If
+// queueing fails partway for another reason, the actions already queued stay
+// registered.
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_register_actions(neurosdk_context_t *ctx,
+                                  neurosdk_action_t const *actions,
+                                  size_t count);
+// Length-delimited variants of the hot messages. The strings do not need to be
+// NUL-terminated and are never copied before being escaped; a NULL result
+// message is sent as null.
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_send_context(neurosdk_context_t *ctx,
+                              char const *message,
+                              size_t message_len,
+                              bool silent);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_send_action_result(neurosdk_context_t *ctx,
+                                    char const *id,
+                                    size_t id_len,
+                                    bool success,
+                                    char const *message,
+                                    size_t message_len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,1279 @@
+#ifndef NEURO_SDK_HPP
+#define NEURO_SDK_HPP
+
+#include <neurosdk.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace neurosdk {
+
+////////////////////
+// Error Handling //
+////////////////////
+
+class Error : public std::runtime_error {
+ public:
+	explicit Error(neurosdk_error_e code)
+	    : std::runtime_error(neurosdk_error_string(code)), code_(code) { }
+
+	neurosdk_error_e code() const noexcept { return code_; }
+
+ private:
+	neurosdk_error_e code_;
+};
+
+inline void check(neurosdk_error_e err) {
+	if (err != NeuroSDK_None) {
+		throw Error(err);
+	}
+}
+
+///////////
+// Tasks //
+///////////
+
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+struct FinalAwaiter {
+	bool await_ready() const noexcept { return false; }
+	template <typename Promise>
+	std::coroutine_handle<> await_suspend(
+	    std::coroutine_handle<Promise> h) noexcept {
+		if (auto continuation = h.promise().continuation) {
+			return continuation;
+		}
+		return std::noop_coroutine();
+	}
+	void await_resume() const noexcept { }
+};
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	FinalAwaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+}  // namespace detail
+
+// Lazily started coroutine. Awaiting it runs it to completion on the awaiting
+// thread and yields its result.
+template <typename T>
+class Task {
+ public:
+	struct promise_type : detail::PromiseBase {
+		std::optional<T> value;
+
+		Task get_return_object() noexcept {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		void return_value(T v) { value.emplace(std::move(v)); }
+	};
+
+	Task(Task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) { }
+	Task &operator=(Task &&other) noexcept {
+		if (this != &other) {
+			if (h_) {
+				h_.destroy();
+			}
+			h_ = std::exchange(other.h_, nullptr);
+		}
+		return *this;
+	}
+	Task(Task const &) = delete;
+	Task &operator=(Task const &) = delete;
+	~Task() {
+		if (h_) {
+			h_.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(
+	    std::coroutine_handle<> continuation) noexcept {
+		h_.promise().continuation = continuation;
+		return h_;
+	}
+	T await_resume() {
+		if (h_.promise().error) {
+			std::rethrow_exception(h_.promise().error);
+		}
+		return std::move(*h_.promise().value);
+	}
+
+ private:
+	explicit Task(std::coroutine_handle<promise_type> h) : h_(h) { }
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+template <>
+class Task<void> {
+ public:
+	struct promise_type : detail::PromiseBase {
+		Task get_return_object() noexcept {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		void return_void() const noexcept { }
+	};
+
+	Task(Task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) { }
+	Task &operator=(Task &&other) noexcept {
+		if (this != &other) {
+			if (h_) {
+				h_.destroy();
+			}
+			h_ = std::exchange(other.h_, nullptr);
+		}
+		return *this;
+	}
+	Task(Task const &) = delete;
+	Task &operator=(Task const &) = delete;
+	~Task() {
+		if (h_) {
+			h_.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(
+	    std::coroutine_handle<> continuation) noexcept {
+		h_.promise().continuation = continuation;
+		return h_;
+	}
+	void await_resume() {
+		if (h_.promise().error) {
+			std::rethrow_exception(h_.promise().error);
+		}
+	}
+
+ private:
+	explicit Task(std::coroutine_handle<promise_type> h) : h_(h) { }
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+//////////////
+// Messages //
+//////////////
+
+struct Action {
+	std::string id;
+	std::string name;
+	std::optional<std::string> data;
+};
+
+struct Force {
+	std::optional<std::string> state;
+	std::string query;
+	std::vector<std::string> action_names;
+	bool ephemeral_context = false;
+	neurosdk_priority_e priority = NeuroSDK_Priority_Low;
+};
+
+// Non-owning view of an inbound action. The views point into buffers owned by
+// the MessageBatch the action came from.
+class ActionView {
+ public:
+	explicit ActionView(neurosdk_message_action_t const &action)
+	    : action_(&action) { }
+	explicit ActionView(neurosdk_message_t const &msg)
+	    : action_(&msg.value.action),
+	      received_us_(msg.received_us),
+	      sequence_(msg.sequence) { }
+
+	std::string_view id() const noexcept { return action_->id; }
+	std::string_view name() const noexcept { return action_->name; }
+	// See neurosdk_message_t, 0 when viewing a bare action.
+	uint64_t received_us() const noexcept { return received_us_; }
+	uint64_t sequence() const noexcept { return sequence_; }
+	std::optional<std::string_view> data() const noexcept {
+		if (!action_->data) {
+			return std::nullopt;
+		}
+		return std::string_view(action_->data);
+	}
+
+	// Set when the context validates actions and the data did not match the
+	// registered schema.
+	std::optional<std::string_view> validation_error() const noexcept {
+		if (!action_->validation_error) {
+			return std::nullopt;
+		}
+		return std::string_view(action_->validation_error);
+	}
+
+	// Lookups into the parsed data, empty unless the context was created with
+	// NeuroSDK_ContextCreateFlags_ParseActionData.
+	std::optional<int64_t> data_int(char const *path) const noexcept {
+		int64_t value = 0;
+		if (neurosdk_action_data_get_int(action_, path, &value)) {
+			return std::nullopt;
+		}
+		return value;
+	}
+	std::optional<double> data_double(char const *path) const noexcept {
+		double value = 0;
+		if (neurosdk_action_data_get_double(action_, path, &value)) {
+			return std::nullopt;
+		}
+		return value;
+	}
+	std::optional<bool> data_bool(char const *path) const noexcept {
+		bool value = false;
+		if (neurosdk_action_data_get_bool(action_, path, &value)) {
+			return std::nullopt;
+		}
+		return value;
+	}
+	std::optional<std::string_view> data_string(char const *path) const noexcept {
+		char const *value = nullptr;
+		size_t len = 0;
+		if (neurosdk_action_data_get_str(action_, path, &value, &len)) {
+			return std::nullopt;
+		}
+		return std::string_view(value, len);
+	}
+	std::optional<size_t> data_array_size(char const *path) const noexcept {
+		size_t len = 0;
+		if (neurosdk_action_data_get_array(action_, path, &len)) {
+			return std::nullopt;
+		}
+		return len;
+	}
+
+	Action to_owned() const {
+		std::optional<std::string> owned_data;
+		if (action_->data) {
+			owned_data.emplace(action_->data);
+		}
+		return {std::string(id()), std::string(name()), std::move(owned_data)};
+	}
+
+ private:
+	neurosdk_message_action_t const *action_;
+	uint64_t received_us_ = 0;
+	uint64_t sequence_ = 0;
+};
+
+// Move-only batch of inbound messages returned by Context::poll(). The
+// messages are destroyed together with the batch.
+class MessageBatch {
+ public:
+	class iterator {
+	 public:
+		using value_type = ActionView;
+		using difference_type = std::ptrdiff_t;
+
+		iterator() = default;
+		explicit iterator(neurosdk_message_t const *msg) : msg_(msg) { }
+
+		ActionView operator*() const { return ActionView(*msg_); }
+		iterator &operator++() {
+			msg_++;
+			return *this;
+		}
+		iterator operator++(int) {
+			iterator it = *this;
+			msg_++;
+			return it;
+		}
+		bool operator==(iterator const &other) const = default;
+
+	 private:
+		neurosdk_message_t const *msg_ = nullptr;
+	};
+
+	MessageBatch() = default;
+	MessageBatch(neurosdk_message_t const *messages, int count)
+	    : messages_(messages, messages + count) { }
+	MessageBatch(MessageBatch &&) noexcept = default;
+	MessageBatch &operator=(MessageBatch &&other) noexcept {
+		if (this != &other) {
+			destroy();
+			messages_ = std::move(other.messages_);
+			other.messages_.clear();
+		}
+		return *this;
+	}
+	MessageBatch(MessageBatch const &) = delete;
+	MessageBatch &operator=(MessageBatch const &) = delete;
+	~MessageBatch() { destroy(); }
+
+	size_t size() const noexcept { return messages_.size(); }
+	bool empty() const noexcept { return messages_.empty(); }
+	ActionView operator[](size_t i) const { return ActionView(messages_[i]); }
+	iterator begin() const { return iterator(messages_.data()); }
+	iterator end() const { return iterator(messages_.data() + messages_.size()); }
+
+ private:
+	void destroy() {
+		for (neurosdk_message_t &msg : messages_) {
+			neurosdk_message_destroy(&msg);
+		}
+	}
+
+	std::vector<neurosdk_message_t> messages_;
+};
+
+////////////////////
+// Action Schemas //
+////////////////////
+
+// Actions are declared as plain structs that describe their fields at compile
+// time, for example:
+//
+//   struct Move {
+//     int cell;
+//
+//     static constexpr char name[] = "move";
+//     static constexpr char description[] = "Place your mark on a cell.";
+//     static constexpr auto fields() {
+//       return std::tuple{neurosdk::field<&Move::cell>("cell",
+//                                                      neurosdk::range(0, 8))};
+//     }
+//   };
+//
+// ActionSchema<Move>::json is then a constant expression holding the JSON
+// schema, and decode<Move>() reads an action's data straight into the struct.
+// Supported field types are bool, integers, floating point numbers,
+// std::string and std::string_view (which only accepts strings without escape
+// sequences, as it points into the input).
+
+struct Range {
+	int64_t min;
+	int64_t max;
+};
+
+constexpr Range range(int64_t min, int64_t max) {
+	return {min, max};
+}
+
+template <size_t N>
+struct OneOf {
+	std::array<std::string_view, N> values;
+};
+
+template <typename... Values>
+constexpr OneOf<sizeof...(Values)> one_of(Values... values) {
+	return {{std::string_view(values)...}};
+}
+
+struct NoConstraint { };
+
+namespace detail {
+
+template <typename M>
+struct member_traits;
+
+template <typename C, typename T>
+struct member_traits<T C::*> {
+	using type = T;
+};
+
+}  // namespace detail
+
+template <auto Member, typename Constraint>
+struct Field {
+	using type = typename detail::member_traits<decltype(Member)>::type;
+	static constexpr auto member = Member;
+
+	std::string_view key;
+	Constraint constraint;
+};
+
+template <auto Member>
+constexpr Field<Member, NoConstraint> field(std::string_view key) {
+	return {key, {}};
+}
+
+template <auto Member, typename Constraint>
+constexpr Field<Member, Constraint> field(std::string_view key,
+                                          Constraint constraint) {
+	return {key, constraint};
+}
+
+namespace detail {
+
+template <typename T>
+inline constexpr bool is_string_v =
+    std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>;
+
+template <typename T>
+constexpr std::string_view json_type() {
+	if constexpr (std::is_same_v<T, bool>) {
+		return "boolean";
+	} else if constexpr (std::is_integral_v<T>) {
+		return "integer";
+	} else if constexpr (std::is_floating_point_v<T>) {
+		return "number";
+	} else {
+		static_assert(is_string_v<T>, "Unsupported action field type.");
+		return "string";
+	}
+}
+
+// Counts the characters a schema needs.
+struct Counter {
+	size_t len = 0;
+
+	constexpr void put(char) { len++; }
+	constexpr void put(std::string_view s) { len += s.size(); }
+};
+
+struct Writer {
+	char *out;
+
+	constexpr void put(char c) { *out++ = c; }
+	constexpr void put(std::string_view s) {
+		for (char c : s) {
+			*out++ = c;
+		}
+	}
+};
+
+template <typename W>
+constexpr void put_int(W &w, int64_t value) {
+	char digits[20] = {};
+	int n = 0;
+	uint64_t v = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+	do {
+		digits[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v);
+	if (value < 0) {
+		w.put('-');
+	}
+	while (n) {
+		w.put(digits[--n]);
+	}
+}
+
+template <typename W>
+constexpr void put_string(W &w, std::string_view s) {
+	constexpr char hex[] = "0123456789abcdef";
+	w.put('"');
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			w.put('\\');
+			w.put(c);
+		} else if ((unsigned char)c < 0x20) {
+			w.put("\\u00");
+			w.put(hex[(unsigned char)c >> 4]);
+			w.put(hex[(unsigned char)c & 15]);
+		} else {
+			w.put(c);
+		}
+	}
+	w.put('"');
+}
+
+template <typename W>
+constexpr void put_constraint(W &, NoConstraint const &) { }
+
+template <typename W>
+constexpr void put_constraint(W &w, Range const &r) {
+	w.put(",\"minimum\":");
+	put_int(w, r.min);
+	w.put(",\"maximum\":");
+	put_int(w, r.max);
+}
+
+template <typename W, size_t N>
+constexpr void put_constraint(W &w, OneOf<N> const &e) {
+	w.put(",\"enum\":[");
+	for (size_t i = 0; i < N; i++) {
+		if (i) {
+			w.put(',');
+		}
+		put_string(w, e.values[i]);
+	}
+	w.put(']');
+}
+
+template <typename A, typename W>
+constexpr W write_schema(W w) {
+	constexpr auto fields = A::fields();
+	bool first = true;
+	auto put_property = [&](auto const &f) {
+		using T = typename std::decay_t<decltype(f)>::type;
+		if (!first) {
+			w.put(',');
+		}
+		first = false;
+		put_string(w, f.key);
+		w.put(":{\"type\":\"");
+		w.put(json_type<T>());
+		w.put('"');
+		put_constraint(w, f.constraint);
+		w.put('}');
+	};
+	auto put_required = [&](auto const &f) {
+		if (!first) {
+			w.put(',');
+		}
+		first = false;
+		put_string(w, f.key);
+	};
+
+	w.put("{\"type\":\"object\",\"properties\":{");
+	std::apply([&](auto const &...f) { (put_property(f), ...); }, fields);
+	w.put("},\"required\":[");
+	first = true;
+	std::apply([&](auto const &...f) { (put_required(f), ...); }, fields);
+	w.put("]}");
+	return w;
+}
+
+}  // namespace detail
+
+template <typename A>
+struct ActionSchema {
+	static constexpr size_t length =
+	    detail::write_schema<A>(detail::Counter{}).len;
+	static constexpr std::array<char, length + 1> storage = [] {
+		std::array<char, length + 1> buf{};
+		detail::write_schema<A>(detail::Writer{buf.data()});
+		return buf;
+	}();
+	static constexpr std::string_view json{storage.data(), length};
+};
+
+namespace detail {
+
+// Minimal JSON reader used to decode action data into a declared struct.
+class Reader {
+ public:
+	explicit Reader(std::string_view s) : s_(s) { }
+
+	bool done() {
+		skip_ws();
+		return i_ == s_.size();
+	}
+	bool consume(char c) {
+		skip_ws();
+		if (i_ < s_.size() && s_[i_] == c) {
+			i_++;
+			return true;
+		}
+		return false;
+	}
+
+	// Reads a string without unescaping it. `escaped` tells whether it contains
+	// escape sequences.
+	bool raw_string(std::string_view &out, bool &escaped) {
+		if (!consume('"')) {
+			return false;
+		}
+		size_t start = i_;
+		escaped = false;
+		while (i_ < s_.size() && s_[i_] != '"') {
+			if (s_[i_] == '\\') {
+				escaped = true;
+				i_++;
+			}
+			i_++;
+		}
+		if (i_ >= s_.size()) {
+			return false;
+		}
+		out = s_.substr(start, i_ - start);
+		i_++;
+		return true;
+	}
+
+	bool read(bool &out) {
+		skip_ws();
+		if (s_.substr(i_, 4) == "true") {
+			i_ += 4;
+			out = true;
+			return true;
+		}
+		if (s_.substr(i_, 5) == "false") {
+			i_ += 5;
+			out = false;
+			return true;
+		}
+		return false;
+	}
+
+	template <typename T>
+	    requires std::is_integral_v<T>
+	bool read(T &out) {
+		skip_ws();
+		bool negative = consume('-');
+		size_t start = i_;
+		uint64_t v = 0;
+		while (i_ < s_.size() && s_[i_] >= '0' && s_[i_] <= '9') {
+			uint64_t d = (uint64_t)(s_[i_++] - '0');
+			if (v > (std::numeric_limits<uint64_t>::max() - d) / 10) {
+				return false;
+			}
+			v = v * 10 + d;
+		}
+		if (i_ == start) {
+			return false;
+		}
+		// The magnitude is checked against the range of T before converting, so
+		// neither the cast nor the negation can overflow.
+		if (!negative) {
+			if (v > (uint64_t)std::numeric_limits<T>::max()) {
+				return false;
+			}
+			out = (T)v;
+			return true;
+		}
+		if (v > 0 - (uint64_t)std::numeric_limits<T>::min()) {
+			return false;
+		}
+		out = v ? (T)(-(int64_t)(v - 1) - 1) : T(0);
+		return true;
+	}
+
+	template <typename T>
+	    requires std::is_floating_point_v<T>
+	bool read(T &out) {
+		skip_ws();
+		size_t start = i_;
+		while (i_ < s_.size() && is_number_char(s_[i_])) {
+			i_++;
+		}
+		if (i_ == start) {
+			return false;
+		}
+		double value = 0;
+		auto [end, ec] = std::from_chars(s_.data() + start, s_.data() + i_, value);
+		if (ec != std::errc() || end != s_.data() + i_) {
+			return false;
+		}
+		out = (T)value;
+		return true;
+	}
+
+	bool read(std::string_view &out) {
+		bool escaped;
+		return raw_string(out, escaped) && !escaped;
+	}
+
+	bool read(std::string &out) {
+		std::string_view raw;
+		bool escaped;
+		if (!raw_string(raw, escaped)) {
+			return false;
+		}
+		if (!escaped) {
+			out.assign(raw);
+			return true;
+		}
+		return unescape(raw, out);
+	}
+
+	// Skips over any JSON value.
+	bool skip() {
+		skip_ws();
+		if (i_ >= s_.size()) {
+			return false;
+		}
+		char c = s_[i_];
+		if (c == '"') {
+			std::string_view raw;
+			bool escaped;
+			return raw_string(raw, escaped);
+		}
+		if (c == '{' || c == '[') {
+			char close = c == '{' ? '}' : ']';
+			i_++;
+			if (consume(close)) {
+				return true;
+			}
+			do {
+				if (c == '{') {
+					std::string_view key;
+					bool escaped;
+					if (!raw_string(key, escaped) || !consume(':')) {
+						return false;
+					}
+				}
+				if (!skip()) {
+					return false;
+				}
+			} while (consume(','));
+			return consume(close);
+		}
+		size_t start = i_;
+		while (i_ < s_.size() && (is_number_char(s_[i_]) ||
+		                          (s_[i_] >= 'a' && s_[i_] <= 'z'))) {
+			i_++;
+		}
+		return i_ != start;
+	}
+
+ private:
+	static bool is_number_char(char c) {
+		return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+		       c == 'e' || c == 'E';
+	}
+
+	void skip_ws() {
+		while (i_ < s_.size() && (s_[i_] == ' ' || s_[i_] == '\t' ||
+		                          s_[i_] == '\n' || s_[i_] == '\r')) {
+			i_++;
+		}
+	}
+
+	static bool unescape(std::string_view raw, std::string &out) {
+		out.clear();
+		out.reserve(raw.size());
+		for (size_t i = 0; i < raw.size(); i++) {
+			if (raw[i] != '\\') {
+				out.push_back(raw[i]);
+				continue;
+			}
+			if (++i >= raw.size()) {
+				return false;
+			}
+			switch (raw[i]) {
+				case 'n':
+					out.push_back('\n');
+					break;
+				case 't':
+					out.push_back('\t');
+					break;
+				case 'r':
+					out.push_back('\r');
+					break;
+				case 'b':
+					out.push_back('\b');
+					break;
+				case 'f':
+					out.push_back('\f');
+					break;
+				case 'u': {
+					unsigned cp = 0;
+					if (i + 4 >= raw.size() ||
+					    std::from_chars(raw.data() + i + 1, raw.data() + i + 5, cp, 16)
+					            .ptr != raw.data() + i + 5) {
+						return false;
+					}
+					i += 4;
+					if (cp < 0x80) {
+						out.push_back((char)cp);
+					} else if (cp < 0x800) {
+						out.push_back((char)(0xC0 | (cp >> 6)));
+						out.push_back((char)(0x80 | (cp & 0x3F)));
+					} else {
+						out.push_back((char)(0xE0 | (cp >> 12)));
+						out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+						out.push_back((char)(0x80 | (cp & 0x3F)));
+					}
+				} break;
+				default:
+					out.push_back(raw[i]);
+			}
+		}
+		return true;
+	}
+
+	std::string_view s_;
+	size_t i_ = 0;
+};
+
+template <typename T>
+bool satisfies(T const &, NoConstraint const &) {
+	return true;
+}
+
+template <typename T>
+bool satisfies(T const &value, Range const &r) {
+	if constexpr (std::is_floating_point_v<T>) {
+		return value >= (double)r.min && value <= (double)r.max;
+	} else if constexpr (std::is_signed_v<T>) {
+		return (int64_t)value >= r.min && (int64_t)value <= r.max;
+	} else {
+		return r.max >= 0 && (uint64_t)value <= (uint64_t)r.max &&
+		       (r.min <= 0 || (uint64_t)value >= (uint64_t)r.min);
+	}
+}
+
+template <typename T, size_t N>
+bool satisfies(T const &value, OneOf<N> const &e) {
+	return std::find(e.values.begin(), e.values.end(), std::string_view(value)) !=
+	       e.values.end();
+}
+
+}  // namespace detail
+
+// Decodes an action's JSON data into `out`. Fails on malformed JSON, missing
+// fields, type mismatches and values outside the declared constraints; unknown
+// keys are skipped.
+template <typename A>
+bool decode(std::string_view data, A &out) {
+	constexpr auto fields = A::fields();
+	constexpr size_t field_count = std::tuple_size_v<decltype(fields)>;
+	static_assert(field_count <= 64, "Actions are limited to 64 fields.");
+
+	detail::Reader reader(data);
+	uint64_t seen = 0;
+	if (!reader.consume('{')) {
+		return false;
+	}
+	if (!reader.consume('}')) {
+		do {
+			std::string_view key;
+			bool escaped;
+			if (!reader.raw_string(key, escaped) || !reader.consume(':')) {
+				return false;
+			}
+			bool matched = false, ok = true;
+			size_t index = 0;
+			auto read_field = [&](auto const &f) {
+				if (matched || f.key != key) {
+					index++;
+					return;
+				}
+				matched = true;
+				seen |= 1ull << index;
+				ok = reader.read(out.*f.member) &&
+				     detail::satisfies(out.*f.member, f.constraint);
+			};
+			std::apply([&](auto const &...f) { (read_field(f), ...); }, fields);
+			if (!ok || (!matched && !reader.skip())) {
+				return false;
+			}
+		} while (reader.consume(','));
+		if (!reader.consume('}')) {
+			return false;
+		}
+	}
+	uint64_t all = field_count == 64 ? ~0ull : (1ull << field_count) - 1;
+	return reader.done() && seen == all;
+}
+
+template <typename A>
+std::optional<A> decode(std::string_view data) {
+	A out{};
+	if (!decode(data, out)) {
+		return std::nullopt;
+	}
+	return out;
+}
+
+/////////////
+// Context //
+/////////////
+
+class Executor;
+
+// Move-only owner of a NeuroSDK context. A context is driven by one thread at a
+// time: either by calling poll()/pump() directly or by handing it to an
+// Executor. send(), context() and result() may be called from any thread. The
+// string_view overloads pass their data to the SDK without copying it.
+class Context {
+ public:
+	class ForceAwaitable;
+
+	explicit Context(neurosdk_context_create_desc_t desc) {
+		check(neurosdk_context_create(&ctx_, &desc));
+	}
+	Context(Context &&other) noexcept
+	    : ctx_(std::exchange(other.ctx_, nullptr)),
+	      waiting_(std::move(other.waiting_)),
+	      unhandled_(std::move(other.unhandled_)),
+	      on_unhandled_(std::move(other.on_unhandled_)),
+	      worker_(other.worker_) { }
+	Context &operator=(Context &&other) noexcept {
+		if (this != &other) {
+			reset();
+			ctx_ = std::exchange(other.ctx_, nullptr);
+			waiting_ = std::move(other.waiting_);
+			unhandled_ = std::move(other.unhandled_);
+			on_unhandled_ = std::move(other.on_unhandled_);
+			worker_ = other.worker_;
+		}
+		return *this;
+	}
+	Context(Context const &) = delete;
+	Context &operator=(Context const &) = delete;
+	~Context() { reset(); }
+
+	neurosdk_context_t handle() const noexcept { return ctx_; }
+	bool connected() { return neurosdk_context_connected(&ctx_); }
+
+	// Sends what is still queued within `timeout`, then destroys the context.
+	// Call it from the thread driving the context. Returns the number of
+	// messages dropped.
+	int shutdown(std::chrono::milliseconds timeout) {
+		int dropped = 0;
+		if (ctx_) {
+			check(neurosdk_context_shutdown(&ctx_, (int)timeout.count(), &dropped));
+		}
+		return dropped;
+	}
+
+	void send(neurosdk_message_t &msg) {
+		check(neurosdk_context_send(&ctx_, &msg));
+	}
+
+	void startup() {
+		neurosdk_message_t msg{};
+		msg.kind = NeuroSDK_MessageKind_Startup;
+		send(msg);
+	}
+
+	void context(std::string_view message, bool silent) {
+		check(neurosdk_context_send_context(&ctx_, message.data(), message.size(),
+		                                    silent));
+	}
+
+	void result(std::string_view id,
+	            bool success,
+	            std::optional<std::string_view> message = std::nullopt) {
+		check(neurosdk_context_send_action_result(
+		    &ctx_, id.data(), id.size(), success,
+		    message ? message->data() : nullptr, message ? message->size() : 0));
+	}
+
+	MessageBatch poll() {
+		neurosdk_message_t *messages = nullptr;
+		int count = 0;
+		check(neurosdk_context_poll(&ctx_, &messages, &count));
+		return MessageBatch(messages, count);
+	}
+
+	// Bounded poll, see neurosdk_context_poll_budget().
+	MessageBatch poll(int max_messages, std::chrono::microseconds max_time) {
+		neurosdk_message_t *messages = nullptr;
+		int count = 0;
+		check(neurosdk_context_poll_budget(&ctx_, max_messages,
+		                                   (uint32_t)max_time.count(), &messages,
+		                                   &count));
+		return MessageBatch(messages, count);
+	}
+
+	// Registers actions declared with compile-time schemas.
+	template <typename... Actions>
+	void register_actions() {
+		neurosdk_action_t actions[] = {neurosdk_action_t{
+		    const_cast<char *>(Actions::name),
+		    const_cast<char *>(Actions::description),
+		    const_cast<char *>(ActionSchema<Actions>::storage.data()),
+		}...};
+		neurosdk_message_t msg{};
+		msg.kind = NeuroSDK_MessageKind_ActionsRegister;
+		msg.value.actions_register.actions = actions;
+		msg.value.actions_register.actions_len = (int)sizeof...(Actions);
+		send(msg);
+	}
+
+	// Registers actions built at runtime, see
+	// neurosdk_context_register_actions().
+	void register_actions(std::span<neurosdk_action_t const> actions) {
+		check(neurosdk_context_register_actions(&ctx_, actions.data(),
+		                                        actions.size()));
+	}
+
+	// Sends the force when awaited and resumes once an action named in it
+	// arrives. The caller still owes the server an action result for it.
+	ForceAwaitable force(Force f);
+
+	// Polls the context once and resumes the forces whose action arrived.
+	// Actions no force is waiting for go to the on_unhandled() handler, or are
+	// kept for take_unhandled() if there is none. If polling fails, every
+	// outstanding force is resumed with the error.
+	void pump() {
+		pump_with([this] { return poll(); });
+	}
+
+	// Passes actions no force is waiting for to `handler` instead of copying
+	// them for take_unhandled(). The view is only valid during the call.
+	void on_unhandled(std::function<void(ActionView)> handler) {
+		on_unhandled_ = std::move(handler);
+	}
+
+	std::vector<Action> take_unhandled() { return std::move(unhandled_); }
+
+ private:
+	friend class Executor;
+
+	struct Waiter {
+		std::vector<std::string> const *names;
+		std::coroutine_handle<> handle;
+		std::optional<Action> *action;
+		std::exception_ptr *error;
+	};
+
+	void reset() {
+		if (ctx_) {
+			neurosdk_context_destroy(&ctx_);
+		}
+	}
+
+	// Returns the number of actions polled.
+	template <typename Poll>
+	size_t pump_with(Poll &&poll_once) {
+		MessageBatch batch;
+		try {
+			batch = poll_once();
+		} catch (Error const &) {
+			fail_all(std::current_exception());
+			return 0;
+		}
+		for (ActionView action : batch) {
+			dispatch(action);
+		}
+		return batch.size();
+	}
+
+	// Only copies the action if a force or take_unhandled() keeps it.
+	void dispatch(ActionView action) {
+		auto it = std::find_if(waiting_.begin(), waiting_.end(), [&](Waiter &w) {
+			return std::find(w.names->begin(), w.names->end(), action.name()) !=
+			       w.names->end();
+		});
+		if (it == waiting_.end()) {
+			if (on_unhandled_) {
+				on_unhandled_(action);
+			} else {
+				unhandled_.push_back(action.to_owned());
+			}
+			return;
+		}
+		Waiter waiter = *it;
+		waiting_.erase(it);
+		waiter.action->emplace(action.to_owned());
+		waiter.handle.resume();
+	}
+
+	void fail_all(std::exception_ptr error) {
+		std::vector<Waiter> waiting = std::move(waiting_);
+		waiting_.clear();
+		for (Waiter &waiter : waiting) {
+			*waiter.error = error;
+			waiter.handle.resume();
+		}
+	}
+
+	neurosdk_context_t ctx_ = nullptr;
+	std::vector<Waiter> waiting_;
+	std::vector<Action> unhandled_;
+	std::function<void(ActionView)> on_unhandled_;
+	int worker_ = -1;
+};
+
+class Context::ForceAwaitable {
+ public:
+	ForceAwaitable(Context &ctx, Force f) : ctx_(&ctx), force_(std::move(f)) { }
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h) {
+		std::vector<char *> names;
+		names.reserve(force_.action_names.size());
+		for (std::string &name : force_.action_names) {
+			names.push_back(name.data());
+		}
+
+		neurosdk_message_t msg{};
+		msg.kind = NeuroSDK_MessageKind_ActionsForce;
+		msg.value.actions_force.state =
+		    force_.state ? force_.state->data() : nullptr;
+		msg.value.actions_force.query = force_.query.data();
+		msg.value.actions_force.ephemeral_context = force_.ephemeral_context;
+		msg.value.actions_force.action_names = names.data();
+		msg.value.actions_force.action_names_len = (int)names.size();
+		msg.value.actions_force.priority = force_.priority;
+
+		neurosdk_error_e err = neurosdk_context_send(&ctx_->ctx_, &msg);
+		if (err != NeuroSDK_None) {
+			error_ = std::make_exception_ptr(Error(err));
+			return false;
+		}
+		ctx_->waiting_.push_back({&force_.action_names, h, &action_, &error_});
+		return true;
+	}
+	Action await_resume() {
+		if (error_) {
+			std::rethrow_exception(error_);
+		}
+		return std::move(*action_);
+	}
+
+ private:
+	Context *ctx_;
+	Force force_;
+	std::optional<Action> action_;
+	std::exception_ptr error_;
+};
+
+inline Context::ForceAwaitable Context::force(Force f) {
+	return ForceAwaitable(*this, std::move(f));
+}
+
+//////////////
+// Executor //
+//////////////
+
+// Runs tasks bound to contexts on a fixed set of threads. Every context is
+// pinned to one worker thread, which is the only thread that polls it and
+// resumes the tasks waiting on it, so no context is ever used concurrently.
+// A worker shares one `poll_budget` between its contexts: each round, one of
+// them (taking turns) may block for the budget while the others are only
+// checked, and a round that found nothing sleeps out whatever is left of it.
+// An idle worker therefore neither spins, even with a poll_ms of 0, nor leaves
+// an action unread for much longer than the budget.
+class Executor {
+ public:
+	explicit Executor(
+	    unsigned threads = 1,
+	    std::chrono::milliseconds poll_budget = std::chrono::milliseconds(10))
+	    : workers_(threads ? threads : 1),
+	      poll_budget_(std::max(poll_budget, std::chrono::milliseconds(1))) { }
+	Executor(Executor const &) = delete;
+	Executor &operator=(Executor const &) = delete;
+
+	// Schedules `task` to start on the worker that owns `ctx`. The context must
+	// outlive run().
+	void spawn(Context &ctx, Task<void> task) {
+		if (ctx.worker_ < 0) {
+			ctx.worker_ = (int)(next_worker_++ % workers_.size());
+			Worker &w = workers_[(size_t)ctx.worker_];
+			std::lock_guard<std::mutex> lock(w.mtx);
+			w.contexts.push_back(&ctx);
+		}
+		Worker &w = workers_[(size_t)ctx.worker_];
+		outstanding_++;
+		Root root = start(std::move(task));
+		std::lock_guard<std::mutex> lock(w.mtx);
+		w.ready.push_back(root.handle);
+		w.cv.notify_one();
+	}
+
+	// Drives all contexts until every spawned task has finished. Rethrows the
+	// first exception that escaped a task.
+	void run() {
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < workers_.size(); i++) {
+			threads.emplace_back([this, i] { work(workers_[i]); });
+		}
+		work(workers_[0]);
+		for (std::thread &t : threads) {
+			t.join();
+		}
+		if (error_) {
+			std::rethrow_exception(std::exchange(error_, nullptr));
+		}
+	}
+
+ private:
+	struct Root {
+		struct promise_type {
+			Root get_return_object() noexcept {
+				return {std::coroutine_handle<promise_type>::from_promise(*this)};
+			}
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			std::suspend_never final_suspend() const noexcept { return {}; }
+			void return_void() const noexcept { }
+			void unhandled_exception() const noexcept { std::terminate(); }
+		};
+		std::coroutine_handle<> handle;
+	};
+
+	struct Worker {
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::vector<Context *> contexts;
+		std::vector<std::coroutine_handle<>> ready;
+	};
+
+	Root start(Task<void> task) {
+		try {
+			co_await std::move(task);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(error_mtx_);
+			if (!error_) {
+				error_ = std::current_exception();
+			}
+		}
+		outstanding_--;
+	}
+
+	void work(Worker &w) {
+		// Under a millisecond, so checking a context never waits on its socket.
+		constexpr std::chrono::microseconds check_only(999);
+		size_t turn = 0;
+		while (outstanding_ > 0) {
+			auto deadline = std::chrono::steady_clock::now() + poll_budget_;
+			std::vector<std::coroutine_handle<>> ready;
+			std::vector<Context *> contexts;
+			{
+				std::lock_guard<std::mutex> lock(w.mtx);
+				ready.swap(w.ready);
+				contexts = w.contexts;
+			}
+			for (std::coroutine_handle<> h : ready) {
+				h.resume();
+			}
+
+			size_t polled = 0;
+			size_t blocking = contexts.empty() ? 0 : turn++ % contexts.size();
+			for (size_t i = 0; i < contexts.size(); i++) {
+				if (i != blocking) {
+					Context *ctx = contexts[i];
+					polled += ctx->pump_with([&] { return ctx->poll(0, check_only); });
+				}
+			}
+			if (!contexts.empty()) {
+				// Resumed tasks may have queued sends, which must not wait out the
+				// budget.
+				bool idle = ready.empty() && polled == 0;
+				Context *ctx = contexts[blocking];
+				polled += ctx->pump_with([&] {
+					return ctx->poll(0, idle ? std::chrono::microseconds(poll_budget_)
+					                        : check_only);
+				});
+			}
+
+			if (ready.empty() && polled == 0) {
+				std::unique_lock<std::mutex> lock(w.mtx);
+				w.cv.wait_until(lock, deadline, [&] { return !w.ready.empty(); });
+			}
+		}
+	}
+
+	std::vector<Worker> workers_;
+	std::chrono::milliseconds poll_budget_;
+	std::atomic<size_t> next_worker_{0};
+	std::atomic<int> outstanding_{0};
+	std::mutex error_mtx_;
+	std::exception_ptr error_;
+};
+
+}  // namespace neurosdk
+
+#endif  // NEURO_SDK_HPP
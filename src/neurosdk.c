@@ -1,6 +1,9 @@
 #include <neurosdk.h>
 
+#include <errno.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -19,10 +22,27 @@
 #endif
 
 #include <json.h>
+#define MG_ENABLE_CUSTOM_CALLOC 1
 #include <mongoose.h>
 
 #define ENVIRONMENT_VARIABLE_NAME "NEURO_SDK_WS_URL"
 #define MESSAGE_QUEUE_SIZE 10
+#define MAX_INBOUND_FRAMES 1024
+#define DEFAULT_COALESCE_WINDOW_MS 100
+#define DEFAULT_DEDUP_WINDOW_MS 1000
+#define DEFAULT_MAX_PENDING_MESSAGES 256
+#define DEFAULT_MAX_INBOUND_BYTES (16 * 1024 * 1024)
+#define DEFAULT_HEARTBEAT_MAX_MISSED 3
+#define DEFAULT_RECONNECT_MAX_MS 30000
+#define RTT_SAMPLE_COUNT 64
+#define MAX_INFLIGHT_ACTIONS 256
+#define MAX_ACTION_PROFILES 256
+#define RECORD_MAGIC "NSDKREC1"
+#define RECORD_HEADER_SIZE 16
+#define TRACE_BUFFER_EVENTS 65536
+#define WS_STREAM_WINDOW (256 * 1024)
+#define WS_FRAGMENT_SIZE (16 * 1024)
+#define REGISTER_FRAME_SIZE (64 * 1024)
 
 #ifndef LIB_VERSION
 #error "LIB_VERSION is not defined!"
@@ -33,32 +53,46 @@
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
 
-#define LOG_DEBUG(context, ...)                                        \
-	if (context->debug_prints && aprintf(&context->logm, __VA_ARGS__)) { \
-		context->callback_log(NeuroSDK_Severity_Debug, context->logm,      \
-		                      context->user_data);                         \
-		free(context->logm);                                               \
+// Each message is formatted into its own buffer, so logging is safe from any
+// thread.
+#define LOG_DEBUG(context, ...)                                   \
+	if (context->debug_prints) {                                    \
+		char *logm_ = NULL;                                           \
+		if (aprintf(&context->allocator, &logm_, __VA_ARGS__) >= 0) { \
+			context->callback_log(NeuroSDK_Severity_Debug, logm_,       \
+			                      context->user_data);                  \
+			mem_free(logm_);                                            \
+		}                                                             \
 	}
 
-#define LOG_INFO(context, ...)                                              \
-	if (context->validation_layers && aprintf(&context->logm, __VA_ARGS__)) { \
-		context->callback_log(NeuroSDK_Severity_Info, context->logm,            \
-		                      context->user_data);                              \
-		free(context->logm);                                                    \
+#define LOG_INFO(context, ...)                                    \
+	if (context->validation_layers) {                               \
+		char *logm_ = NULL;                                           \
+		if (aprintf(&context->allocator, &logm_, __VA_ARGS__) >= 0) { \
+			context->callback_log(NeuroSDK_Severity_Info, logm_,        \
+			                      context->user_data);                  \
+			mem_free(logm_);                                            \
+		}                                                             \
 	}
 
-#define LOG_WARN(context, ...)                                              \
-	if (context->validation_layers && aprintf(&context->logm, __VA_ARGS__)) { \
-		context->callback_log(NeuroSDK_Severity_Warn, context->logm,            \
-		                      context->user_data);                              \
-		free(context->logm);                                                    \
+#define LOG_WARN(context, ...)                                    \
+	if (context->validation_layers) {                               \
+		char *logm_ = NULL;                                           \
+		if (aprintf(&context->allocator, &logm_, __VA_ARGS__) >= 0) { \
+			context->callback_log(NeuroSDK_Severity_Warn, logm_,        \
+			                      context->user_data);                  \
+			mem_free(logm_);                                            \
+		}                                                             \
 	}
 
-#define LOG_ERROR(context, ...)                                             \
-	if (context->validation_layers && aprintf(&context->logm, __VA_ARGS__)) { \
-		context->callback_log(NeuroSDK_Severity_Error, context->logm,           \
-		                      context->user_data);                              \
-		free(context->logm);                                                    \
+#define LOG_ERROR(context, ...)                                   \
+	if (context->validation_layers) {                               \
+		char *logm_ = NULL;                                           \
+		if (aprintf(&context->allocator, &logm_, __VA_ARGS__) >= 0) { \
+			context->callback_log(NeuroSDK_Severity_Error, logm_,       \
+			                      context->user_data);                  \
+			mem_free(logm_);                                            \
+		}                                                             \
 	}
 
 static void default_logger(neurosdk_severity_e severity,
@@ -107,45 +141,676 @@ static void default_logger(neurosdk_severity_e severity,
 	RESET;
 }
 
+// Connection state and allocation counters are shared between the polling
+// thread and any thread that sends.
+#if defined(_MSC_VER)
+static bool atomic_load_bool(bool *p) {
+	return InterlockedOr8((char volatile *)p, 0) != 0;
+}
+static void atomic_store_bool(bool *p, bool value) {
+	InterlockedExchange8((char volatile *)p, (char)value);
+}
+static int atomic_load_int(int *p) {
+	return (int)InterlockedOr((long volatile *)p, 0);
+}
+static void atomic_store_int(int *p, int value) {
+	InterlockedExchange((long volatile *)p, (long)value);
+}
+#ifdef _WIN64
+static size_t atomic_load_size(size_t *p) {
+	return (size_t)InterlockedOr64((LONG64 volatile *)p, 0);
+}
+static void atomic_store_size(size_t *p, size_t value) {
+	InterlockedExchange64((LONG64 volatile *)p, (LONG64)value);
+}
+static size_t atomic_add_size(size_t *p, size_t delta) {
+	return (size_t)InterlockedExchangeAdd64((LONG64 volatile *)p,
+	                                        (LONG64)delta) +
+	       delta;
+}
+static bool atomic_cas_size(size_t *p, size_t expected, size_t value) {
+	return (size_t)InterlockedCompareExchange64(
+	           (LONG64 volatile *)p, (LONG64)value, (LONG64)expected) ==
+	       expected;
+}
+#else
+static size_t atomic_load_size(size_t *p) {
+	return (size_t)InterlockedOr((long volatile *)p, 0);
+}
+static void atomic_store_size(size_t *p, size_t value) {
+	InterlockedExchange((long volatile *)p, (long)value);
+}
+static size_t atomic_add_size(size_t *p, size_t delta) {
+	return (size_t)InterlockedExchangeAdd((long volatile *)p, (long)delta) +
+	       delta;
+}
+static bool atomic_cas_size(size_t *p, size_t expected, size_t value) {
+	return (size_t)InterlockedCompareExchange((long volatile *)p, (long)value,
+	                                          (long)expected) == expected;
+}
+#endif
+#else
+static bool atomic_load_bool(bool *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+static void atomic_store_bool(bool *p, bool value) {
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+static int atomic_load_int(int *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+static void atomic_store_int(int *p, int value) {
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+static size_t atomic_load_size(size_t *p) {
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+static void atomic_store_size(size_t *p, size_t value) {
+	__atomic_store_n(p, value, __ATOMIC_RELAXED);
+}
+static size_t atomic_add_size(size_t *p, size_t delta) {
+	return __atomic_add_fetch(p, delta, __ATOMIC_RELAXED);
+}
+static bool atomic_cas_size(size_t *p, size_t expected, size_t value) {
+	return __atomic_compare_exchange_n(p, &expected, value, false,
+	                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+#endif
+
+// Unique per thread, its address identifies the thread that polls a context.
+static _Thread_local char thread_marker;
+
+static size_t current_thread_id(void) {
+	return (size_t)(uintptr_t)&thread_marker;
+}
+
+typedef struct allocator {
+	neurosdk_allocator_t hooks;
+	size_t bytes_in_use;
+	size_t peak_bytes_in_use;
+	size_t allocations;  // Successful alloc and realloc calls
+	size_t live_allocations;
+} allocator_t;
+
+// Prefixed to every block so it can be freed without knowing its context. On
+// 64-bit targets this keeps the 16 byte alignment the C runtime gives us.
+typedef struct alloc_header {
+	allocator_t *owner;
+	size_t size;
+} alloc_header_t;
+
+static void *libc_alloc(size_t size, void *user_data) {
+	(void)user_data;
+	return malloc(size);
+}
+
+static void *libc_realloc(void *ptr,
+                          size_t old_size,
+                          size_t new_size,
+                          void *user_data) {
+	(void)old_size;
+	(void)user_data;
+	return realloc(ptr, new_size);
+}
+
+static void libc_free(void *ptr, size_t size, void *user_data) {
+	(void)size;
+	(void)user_data;
+	free(ptr);
+}
+
+// Used for mongoose allocations made outside of any SDK call.
+static allocator_t default_allocator = {
+    .hooks = {libc_alloc, libc_realloc, libc_free, NULL},
+};
+
+// Allocator of the context whose API call is running on this thread. Mongoose
+// has no per-manager allocator, so mg_calloc() picks this up instead.
+static _Thread_local allocator_t *current_allocator;
+
+static void mem_account(allocator_t *a, size_t added) {
+	size_t in_use = atomic_add_size(&a->bytes_in_use, added);
+	size_t peak = atomic_load_size(&a->peak_bytes_in_use);
+	while (in_use > peak &&
+	       !atomic_cas_size(&a->peak_bytes_in_use, peak, in_use)) {
+		peak = atomic_load_size(&a->peak_bytes_in_use);
+	}
+}
+
+static void *mem_alloc(allocator_t *a, size_t size) {
+	if (size > SIZE_MAX - sizeof(alloc_header_t)) {
+		return NULL;
+	}
+	alloc_header_t *header =
+	    a->hooks.alloc(sizeof(alloc_header_t) + size, a->hooks.user_data);
+	if (!header) {
+		return NULL;
+	}
+	header->owner = a;
+	header->size = size;
+	mem_account(a, size);
+	atomic_add_size(&a->allocations, 1);
+	atomic_add_size(&a->live_allocations, 1);
+	return header + 1;
+}
+
+static void *mem_calloc(allocator_t *a, size_t count, size_t size) {
+	if (size && count > SIZE_MAX / size) {
+		return NULL;
+	}
+	void *ptr = mem_alloc(a, count * size);
+	if (ptr) {
+		memset(ptr, 0, count * size);
+	}
+	return ptr;
+}
+
+static void mem_free(void *ptr) {
+	if (!ptr) {
+		return;
+	}
+	alloc_header_t *header = (alloc_header_t *)ptr - 1;
+	allocator_t *a = header->owner;
+	size_t size = header->size;
+	// Read everything first, the block may hold the allocator itself.
+	neurosdk_callback_free_t free_fn = a->hooks.free;
+	void *user_data = a->hooks.user_data;
+	atomic_add_size(&a->bytes_in_use, (size_t)0 - size);
+	atomic_add_size(&a->live_allocations, (size_t)0 - 1);
+	free_fn(header, sizeof(alloc_header_t) + size, user_data);
+}
+
+static void *mem_realloc(allocator_t *a, void *ptr, size_t size) {
+	if (!ptr) {
+		return mem_alloc(a, size);
+	}
+	alloc_header_t *header = (alloc_header_t *)ptr - 1;
+	size_t old_size = header->size;
+	if (!a->hooks.realloc) {
+		void *grown = mem_alloc(a, size);
+		if (grown) {
+			memcpy(grown, ptr, old_size < size ? old_size : size);
+			mem_free(ptr);
+		}
+		return grown;
+	}
+	if (size > SIZE_MAX - sizeof(alloc_header_t)) {
+		return NULL;
+	}
+	header = a->hooks.realloc(header, sizeof(alloc_header_t) + old_size,
+	                          sizeof(alloc_header_t) + size, a->hooks.user_data);
+	if (!header) {
+		return NULL;
+	}
+	header->size = size;
+	mem_account(a, size - old_size);
+	atomic_add_size(&a->allocations, 1);
+	return header + 1;
+}
+
+static char *mem_strdup(allocator_t *a, char const *str) {
+	size_t len = strlen(str);
+	char *copy = mem_alloc(a, len + 1);
+	if (copy) {
+		memcpy(copy, str, len + 1);
+	}
+	return copy;
+}
+
+static int aprintf(allocator_t *a, char **strp, const char *fmt, ...) {
+	*strp = NULL;
+	va_list args;
+	va_start(args, fmt);
+	int bytes = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (bytes < 0) {
+		return -1;
+	}
+	*strp = mem_alloc(a, (size_t)bytes + 1);
+	if (!*strp) {
+		return -1;
+	}
+	va_start(args, fmt);
+	vsnprintf(*strp, (size_t)bytes + 1, fmt, args);
+	va_end(args);
+	return bytes;
+}
+
+static void *json_alloc_(void *user_data, size_t size) {
+	return mem_alloc((allocator_t *)user_data, size);
+}
+
+static json_value_t *mem_json_parse(allocator_t *a,
+                                    char const *src,
+                                    size_t len) {
+	return json_parse_ex(src, len, json_parse_flags_default, json_alloc_, a,
+	                     NULL);
+}
+
+void *mg_calloc(size_t count, size_t size) {
+	return mem_calloc(current_allocator ? current_allocator : &default_allocator,
+	                  count, size);
+}
+
+void mg_free(void *ptr) {
+	mem_free(ptr);
+}
+
+typedef struct pending_message {
+	char *str;
+	size_t len;
+	// Bytes of `str` that are only escaped while the frame is written, so a
+	// large value is never held escaped in full.
+	size_t value_at;
+	size_t value_len;
+	neurosdk_message_kind_e kind;
+	uint64_t queued_ms;
+	char *context_text;  // Escaped, only kept for coalescable context messages
+	bool throttled;
+} pending_message_t;
+
+// A message too large to hand to the socket at once, serialized and sent as
+// a fragmented websocket message a window at a time.
+typedef struct outbound_stream {
+	pending_message_t msg;  // `msg.str` is NULL while nothing is streaming
+	size_t pos;             // Next byte of `msg.str` to serialize
+} outbound_stream_t;
+
+typedef struct pending_queue {
+	pending_message_t *messages;
+	int size;
+	int cap;
+} pending_queue_t;
+
+// Outbound lanes, drained from first to last. Registrations come before forces
+// so a force never reaches the server ahead of the actions it names.
+typedef enum pending_lane {
+	PendingLane_Control = 0,
+	PendingLane_Result,
+	PendingLane_Actions,
+	PendingLane_Force,
+	PendingLane_Context,
+	PendingLane_Count
+} pending_lane_e;
+
+typedef struct token_bucket {
+	double rate;  // Tokens per millisecond, 0 when unlimited
+	double burst;
+	double tokens;
+	uint64_t refill_ms;
+} token_bucket_t;
+
+typedef struct latency_samples {
+	uint32_t samples[RTT_SAMPLE_COUNT];  // Ring, in microseconds
+	int len;
+	int head;
+} latency_samples_t;
+
+typedef struct heartbeat {
+	int max_missed;
+	int missed;
+	bool awaiting_pong;
+	uint64_t pings_sent;
+	uint64_t pongs_received;
+	latency_samples_t rtt;
+} heartbeat_t;
+
+// An action that was received and has not been answered yet.
+typedef struct inflight_action {
+	char *id;
+	uint64_t received_us;
+	int profile;  // Index into `profiles`, -1 when there was no room
+	bool warned;  // Already reported as slow
+} inflight_action_t;
+
+// Response times of the actions of one name.
+typedef struct action_profile {
+	char *name;
+	latency_samples_t latency;
+	uint64_t results;
+	uint64_t slow;
+	uint64_t orphaned;
+} action_profile_t;
+
+typedef struct dedup_entry {
+	uint64_t hash;
+	uint64_t sent_ms;
+	bool valid;
+} dedup_entry_t;
+
+// JSON types a schema node accepts. Integral numbers carry both number bits.
+typedef enum schema_type {
+	SchemaType_Null = (1 << 0),
+	SchemaType_Boolean = (1 << 1),
+	SchemaType_Integer = (1 << 2),
+	SchemaType_Number = (1 << 3),
+	SchemaType_String = (1 << 4),
+	SchemaType_Array = (1 << 5),
+	SchemaType_Object = (1 << 6),
+} schema_type_e;
+
+typedef enum schema_node_flags {
+	SchemaNode_Minimum = (1 << 0),
+	SchemaNode_Maximum = (1 << 1),
+	SchemaNode_ExclusiveMinimum = (1 << 2),
+	SchemaNode_ExclusiveMaximum = (1 << 3),
+	SchemaNode_NoAdditionalProperties = (1 << 4),
+} schema_node_flags_e;
+
+// One compiled (sub)schema. Children, property names, required names and enum
+// values are ranges into the arrays of the owning action_schema_t.
+typedef struct schema_node {
+	uint8_t types;  // 0 accepts any type
+	uint8_t flags;
+	double minimum;
+	double maximum;
+	double exclusive_minimum;
+	double exclusive_maximum;
+	size_t min_length;
+	size_t max_length;
+	size_t min_items;
+	size_t max_items;
+	int items;  // Node index, -1 when unconstrained
+	int props;
+	int props_len;
+	int required;
+	int required_len;
+	int enums;
+	int enums_len;
+} schema_node_t;
+
+typedef struct schema_prop {
+	json_string_t const *key;
+	int node;
+} schema_prop_t;
+
+// Validator compiled from a registered action schema. Node 0 is the root and
+// the parsed schema is kept alive for the names and enum values it points to.
+typedef struct action_schema {
+	allocator_t *allocator;
+	char *name;
+	uint64_t name_hash;
+	json_value_t *tree;
+	schema_node_t *nodes;
+	int nodes_len;
+	int nodes_cap;
+	schema_prop_t *props;
+	int props_len;
+	int props_cap;
+	json_value_t const **values;
+	int values_len;
+	int values_cap;
+} action_schema_t;
+
+// A text frame as received, parsed later by poll.
+typedef struct raw_frame {
+	char *data;
+	size_t len;
+	uint64_t received_us;
+	uint64_t sequence;
+} raw_frame_t;
+
+typedef struct trace_event {
+	char const *name;  // Always a string literal
+	uint64_t ts_us;
+	int64_t value;  // Counters only
+	char phase;     // 'B'egin, 'E'nd or 'C'ounter, as in Chrome traces
+} trace_event_t;
+
+// Only its own thread appends. `len` is stored with release semantics, so a
+// dump from another thread sees every event below it complete. Events past
+// TRACE_BUFFER_EVENTS are dropped.
+typedef struct trace_buffer {
+	trace_event_t *events;
+	int len;
+	int tid;
+	size_t thread;  // current_thread_id() of the owner
+	struct trace_buffer *next;
+} trace_buffer_t;
+
+typedef struct tracer {
+	mtx_t mtx;  // Guards the buffer list, taken once per thread and by dumps
+	trace_buffer_t *buffers;
+	int threads;
+	size_t serial;  // Tells contexts apart in the per-thread cache
+	char *path;     // Dumped to on destroy, may be NULL
+} tracer_t;
+
+// Recording being replayed, loaded whole. `pos` is the next record.
+typedef struct replay {
+	unsigned char *data;
+	size_t size;
+	size_t pos;
+	uint64_t start_us;
+	bool max_speed;
+	bool finished;
+} replay_t;
+
+typedef struct action_handler {
+	char *name;
+	uint64_t name_hash;
+	neurosdk_callback_action_t fn;
+	void *user_data;
+} action_handler_t;
+
+typedef struct action_job {
+	neurosdk_message_t msg;
+	neurosdk_callback_action_t fn;
+	void *user_data;
+} action_job_t;
+
+// Ring buffer deque. The owning worker pops from the back, idle workers steal
+// from the front.
+typedef struct job_queue {
+	mtx_t mtx;
+	action_job_t *jobs;
+	int head;
+	int size;
+	int cap;
+} job_queue_t;
+
+typedef struct worker_pool {
+	struct context *ctx;
+	thrd_t *threads;
+	job_queue_t *queues;
+	int count;
+	int started;  // Threads to join, at most count
+	int next;  // Round-robin target, only used by the polling thread
+	mtx_t wake_mtx;
+	cnd_t wake_cnd;
+	int queued;  // Guarded by wake_mtx
+	bool stopping;
+} worker_pool_t;
+
+// An action as last registered, sent again after a reconnect.
+typedef struct session_action {
+	char *name;
+	uint64_t name_hash;
+	char *json;  // Its element of the actions array
+	size_t len;
+} session_action_t;
+
 typedef struct context {
+	allocator_t allocator;
 	char const *game_name;  // This is escaped
 	int poll_ms;
+	int coalesce_window_ms;
+	int dedup_window_ms;
 
 	void *user_data;
 
 	neurosdk_callback_log_t callback_log;
-	char *logm;
 
+	// Only touched by the polling thread, as is the inbound message queue.
 	neurosdk_error_e conn_err;
+	// Written by the polling thread, read anywhere through the atomic helpers.
 	bool connected;
+	bool peer_timed_out;
+	size_t poll_thread;  // current_thread_id() of the last poll
+	heartbeat_t heartbeat;
 
 	neurosdk_message_t *message_queue;
 	int message_queue_size;
 	int message_queue_cap;
+	raw_frame_t *frames;  // Oldest first
+	int frames_len;
+	int frames_cap;
+	size_t frames_bytes;
+	uint64_t frames_received;  // Numbers the frames, dropped ones included
+	size_t max_frame_size;
+	size_t max_inbound_bytes;
+	size_t max_action_data;  // 0 for no limit
+
+	FILE *record_file;  // Written under out_mtx
+	uint64_t record_start_us;
+	replay_t *replay;  // Set instead of `conn` when replaying
+	tracer_t *tracer;
 
 	struct mg_mgr mgr;
-	struct mg_connection *conn;
+	// Copied from the desc for wss:// URLs, used when the socket connects.
+	struct mg_tls_opts tls_opts;
+	bool tls;
+	struct mg_connection *conn;  // NULL while waiting to reconnect
+	size_t conn_id;  // For mg_wakeup(), `conn` is freed on close. Atomic.
+	// Reconnecting, only touched by the polling thread. Zero
+	// `reconnect_min_ms` leaves a lost connection lost.
+	char *url;
+	int reconnect_min_ms;
+	int reconnect_max_ms;
+	int reconnect_delay_ms;  // Before the next attempt, doubled by each
+	uint64_t reconnect_at_ms;  // 0 while none is due
+	bool was_open;  // A websocket opened before, so the next one is a reconnect
+	bool closing;  // Closed on purpose, by shutdown or destroy
 
 	mtx_t out_mtx;
-	char **pending_messages;
-	int pending_messages_size;
-	int pending_messages_cap;
+	pending_queue_t pending[PendingLane_Count];
+	int pending_count;
+	int pending_reserved;  // Slots promised to register_actions() frames
+	outbound_stream_t stream;  // Holds back every lane until it is sent
+	inflight_action_t *inflight;  // Oldest first, guarded by out_mtx
+	int inflight_len;
+	int inflight_cap;
+	latency_samples_t queued_latency;
+	latency_samples_t response_latency;
+	uint64_t unmatched_results;
+	action_profile_t *profiles;  // Guarded by out_mtx, names live until destroy
+	int profiles_len;
+	int profiles_cap;
+	uint64_t slow_action_us;  // 0 disables the warnings
+	int max_pending;
+	dedup_entry_t dedup[NEUROSDK_MESSAGE_KIND_COUNT];
+	token_bucket_t buckets[NEUROSDK_MESSAGE_KIND_COUNT];
+
+	neurosdk_context_stats_t stats;
+
+	mtx_t registry_mtx;  // Guards the schemas and handlers of actions
+	action_schema_t *schemas;
+	int schemas_len;
+	int schemas_cap;
+	action_handler_t *handlers;
+	int handlers_len;
+	int handlers_cap;
+	// What a new connection is told first, only kept with reconnecting. Also
+	// guarded by registry_mtx.
+	bool startup_sent;
+	session_action_t *session;
+	int session_len;
+	int session_cap;
+	worker_pool_t *pool;
 
 	bool debug_prints : 1;
 	bool validation_layers : 1;
+	bool coalesce_messages : 1;
+	bool priority_lanes : 1;
+	bool deduplicate_messages : 1;
+	bool parse_action_data : 1;
+	bool validate_actions : 1;
+	bool reject_invalid_actions : 1;
 } context_t;
 
-static char *escape_string(char const *str) {
-	if (!str)
-		return NULL;
+static neurosdk_error_e pool_start(context_t *ctx, int threads);
+static int pool_stop(context_t *ctx);
 
-	size_t len = strlen(str);
-	char *escaped = malloc(len * 4 + 1);
-	if (!escaped)
-		return NULL;
+static pending_lane_e pending_lane(context_t *ctx,
+                                   neurosdk_message_kind_e kind) {
+	if (!ctx->priority_lanes) {
+		return PendingLane_Control;
+	}
+	switch (kind) {
+		case NeuroSDK_MessageKind_ActionResult:
+			return PendingLane_Result;
+		case NeuroSDK_MessageKind_ActionsRegister:
+		case NeuroSDK_MessageKind_ActionsUnregister:
+			return PendingLane_Actions;
+		case NeuroSDK_MessageKind_ActionsForce:
+			return PendingLane_Force;
+		case NeuroSDK_MessageKind_Context:
+			return PendingLane_Context;
+		case NeuroSDK_MessageKind_Startup:
+		default:
+			return PendingLane_Control;
+	}
+}
+
+// Tokens in the bucket at `now_ms`, counting the refill since the last take.
+static double bucket_tokens(token_bucket_t const *bucket, uint64_t now_ms) {
+	double tokens =
+	    bucket->tokens + (double)(now_ms - bucket->refill_ms) * bucket->rate;
+	return tokens > bucket->burst ? bucket->burst : tokens;
+}
+
+static bool bucket_take(token_bucket_t *bucket, uint64_t now_ms) {
+	if (bucket->rate <= 0) {
+		return true;
+	}
+	bucket->tokens = bucket_tokens(bucket, now_ms);
+	bucket->refill_ms = now_ms;
+	if (bucket->tokens < 1.0) {
+		return false;
+	}
+	bucket->tokens -= 1.0;
+	return true;
+}
+
+static bool pending_reserve(allocator_t *a, pending_queue_t *queue) {
+	if (queue->size < queue->cap) {
+		return true;
+	}
+	int cap = queue->cap * 2;
+	pending_message_t *messages =
+	    mem_realloc(a, queue->messages, (size_t)cap * sizeof(pending_message_t));
+	if (!messages) {
+		return false;
+	}
+	queue->messages = messages;
+	queue->cap = cap;
+	return true;
+}
+
+// Length of `str` once escaped for a JSON string, without the quotes.
+static size_t escaped_length(char const *str, size_t len) {
+	size_t out = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char ch = (unsigned char)str[i];
+		switch (ch) {
+			case '\n':
+			case '\t':
+			case '\r':
+			case '\\':
+			case '\"':
+				out += 2;
+				break;
+			default:
+				out += ch < 32 ? 6 : 1;
+		}
+	}
+	return out;
+}
 
-	char *dst = escaped;
-	while (*str) {
+// Writes escaped_length(str, len) bytes to `dst`, returns the end.
+static char *escape_into(char *dst, char const *str, size_t len) {
+	static char const hex[] = "0123456789ABCDEF";
+	for (char const *end = str + len; str < end;) {
 		switch (*str) {
 			case '\n':
 				*dst++ = '\\';
@@ -167,411 +832,3411 @@ static char *escape_string(char const *str) {
 				*dst++ = '\\';
 				*dst++ = '\"';
 				break;
-			case '\'':
-				*dst++ = '\\';
-				*dst++ = '\'';
-				break;
 			default:
-				if ((unsigned char)*str < 32 || (unsigned char)*str > 126) {
-					dst += sprintf(dst, "\\x%02X", (unsigned char)*str);
+				if ((unsigned char)*str < 32) {
+					*dst++ = '\\';
+					*dst++ = 'u';
+					*dst++ = '0';
+					*dst++ = '0';
+					*dst++ = hex[(unsigned char)*str >> 4];
+					*dst++ = hex[(unsigned char)*str & 15];
 				} else {
 					*dst++ = *str;
 				}
 		}
 		str++;
 	}
-	*dst = '\0';
-	return escaped;
+	return dst;
 }
 
-#if defined(_MSC_VER)
-static int vasprintf(char **strp, const char *fmt, va_list ap) {
-	va_list ap_copy;
-	int formattedLength, actualLength;
-	size_t requiredSize;
-	*strp = NULL;
-	va_copy(ap_copy, ap);
-	formattedLength = _vscprintf(fmt, ap_copy);
-	va_end(ap_copy);
-	if (formattedLength < 0) {
-		return -1;
+// Escapes `str` into `dst` until the next escape would not fit in `cap`
+// bytes. Returns the bytes written and sets `used` to the input consumed.
+static size_t escape_chunk(char *dst,
+                           size_t cap,
+                           char const *str,
+                           size_t len,
+                           OUT size_t *used) {
+	size_t n = 0, i = 0;
+	while (i < len) {
+		size_t safe = (cap - n) / 6;  // Bytes that fit even as \u00XX
+		if (safe) {
+			size_t take = len - i < safe ? len - i : safe;
+			n = (size_t)(escape_into(dst + n, str + i, take) - dst);
+			i += take;
+			continue;
+		}
+		if (n + escaped_length(str + i, 1) > cap) {
+			break;
+		}
+		n = (size_t)(escape_into(dst + n, str + i, 1) - dst);
+		i++;
 	}
-	requiredSize = ((size_t)formattedLength) + 1;
-	*strp = (char *)malloc(requiredSize);
-	if (*strp == NULL) {
-		errno = ENOMEM;
+	*used = i;
+	return n;
+}
+
+static char *escape_string_n(allocator_t *a, char const *str, size_t len) {
+	if (!str)
+		return NULL;
+
+	char *escaped = mem_alloc(a, escaped_length(str, len) + 1);
+	if (!escaped)
+		return NULL;
+
+	*escape_into(escaped, str, len) = '\0';
+	return escaped;
+}
+
+// Builds `head`, then `value`, then `tail` in one exactly sized allocation.
+// The value is left unescaped at `value_at` for flush_pending() to escape
+// while writing the frame, so large strings are copied once in total.
+static int join_raw(allocator_t *a,
+                    char const *head,
+                    char const *value,
+                    size_t value_len,
+                    char const *tail,
+                    OUT char **out,
+                    OUT size_t *value_at) {
+	*out = NULL;
+	size_t head_len = strlen(head), tail_len = strlen(tail);
+	size_t total = head_len + value_len + tail_len;
+	if (total > INT_MAX)
 		return -1;
-	}
-	actualLength = vsnprintf_s(*strp, requiredSize, requiredSize - 1, fmt, ap);
-	if (actualLength != formattedLength) {
-		free(*strp);
-		*strp = NULL;
-		errno = 1;
+
+	char *buf = mem_alloc(a, total + 1);
+	if (!buf)
 		return -1;
-	}
-	return formattedLength;
+
+	memcpy(buf, head, head_len);
+	memcpy(buf + head_len, value, value_len);
+	memcpy(buf + head_len + value_len, tail, tail_len + 1);
+	*out = buf;
+	*value_at = head_len;
+	return (int)total;
 }
-#endif
 
-static int aprintf(char **strp, const char *fmt, ...) {
-	va_list args;
-	va_start(args, fmt);
-	int bytes = vasprintf(strp, fmt, args);
-	va_end(args);
-	return bytes;
+// Length of the frame `msg` is sent as.
+static size_t serialized_length(pending_message_t const *msg) {
+	return msg->len - msg->value_len +
+	       escaped_length(msg->str + msg->value_at, msg->value_len);
 }
 
-NEUROSDK_EXPORT char const *neurosdk_version(void) {
-	return STR(LIB_VERSION);
+// Writes the frame of `msg` from byte `*pos` of its `str` on to `dst`,
+// escaping its value, until `cap` bytes are written or the message ends.
+// Returns the bytes written.
+static size_t serialize_chunk(pending_message_t const *msg,
+                              size_t *pos,
+                              char *dst,
+                              size_t cap) {
+	size_t value_end = msg->value_at + msg->value_len;
+	size_t n = 0;
+	while (*pos < msg->len && n < cap) {
+		if (*pos >= msg->value_at && *pos < value_end) {
+			size_t used;
+			n += escape_chunk(dst + n, cap - n, msg->str + *pos, value_end - *pos,
+			                  &used);
+			if (!used) {
+				break;
+			}
+			*pos += used;
+			continue;
+		}
+		size_t end = *pos < msg->value_at ? msg->value_at : msg->len;
+		size_t take = end - *pos < cap - n ? end - *pos : cap - n;
+		memcpy(dst + n, msg->str + *pos, take);
+		n += take;
+		*pos += take;
+	}
+	return n;
 }
-NEUROSDK_EXPORT char const *neurosdk_git_hash(void) {
-	return STR(LIB_BUILD_HASH);
+
+static char *escape_string(allocator_t *a, char const *str) {
+	if (!str)
+		return NULL;
+	return escape_string_n(a, str, strlen(str));
 }
 
-NEUROSDK_EXPORT char const *neurosdk_error_string(neurosdk_error_e err) {
-	switch (err) {
-		case NeuroSDK_None:
-			return "None.";
-		case NeuroSDK_Internal:
-			return "An internal error occurred.";
-		case NeuroSDK_Uninitialized:
-			return "Component is not initialized.";
-		case NeuroSDK_NoGameName:
-			return "Game name is missing.";
-		case NeuroSDK_OutOfMemory:
-			return "Memory allocation failed.";
-		case NeuroSDK_NoURL:
-			return "No URL provided.";
-		case NeuroSDK_ConnectionError:
-			return "Failed to establish a connection.";
-		case NeuroSDK_MessageQueueFull:
-			return "Message queue is full.";
-		case NeuroSDK_ReceivedBinary:
-			return "Unexpected binary data received.";
-		case NeuroSDK_InvalidJSON:
-			return "Received malformed JSON.";
-		case NeuroSDK_UnknownCommand:
-			return "Unknown command received.";
-		case NeuroSDK_InvalidMessage:
-			return "Message format is invalid.";
-		case NeuroSDK_CommandNotAvailable:
-			return "The requested command is not available in this context.";
-		case NeuroSDK_SendFailed:
-			return "Failed to send message.";
-		default:
-			return "Unknown error code.";
+static uint64_t now_us(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER counter;
+	if (!freq.QuadPart) {
+		QueryPerformanceFrequency(&freq);
 	}
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / freq.QuadPart) * 1000000 +
+	       (uint64_t)(counter.QuadPart % freq.QuadPart) * 1000000 /
+	           (uint64_t)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
 }
 
-static neurosdk_error_e parse_s2c_json(context_t *ctx,
-                                       neurosdk_message_t *msg,
-                                       char const *json,
-                                       int len) {
-	if (!ctx) {
-		return NeuroSDK_Uninitialized;
-	}
-	if (!json || len <= 0) {
-		LOG_ERROR(ctx, "[parse_s2c_json] Provided JSON is empty or null.");
-		return NeuroSDK_InvalidJSON;
+static void latency_add(latency_samples_t *s, uint64_t us) {
+	s->samples[s->head] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+	s->head = (s->head + 1) % RTT_SAMPLE_COUNT;
+	if (s->len < RTT_SAMPLE_COUNT) {
+		s->len++;
 	}
+}
 
-	neurosdk_error_e res = NeuroSDK_None;
-	json_value_t *root = json_parse(json, len);
-	if (!root) {
-		LOG_ERROR(ctx, "[parse_s2c_json] Could not parse message: invalid JSON.");
-		return NeuroSDK_InvalidJSON;
+static int compare_u32(void const *a, void const *b) {
+	uint32_t x = *(uint32_t const *)a, y = *(uint32_t const *)b;
+	return (x > y) - (x < y);
+}
+
+// Summarizes the samples, under the lock guarding them or from a copy.
+static void latency_summarize(latency_samples_t const *s,
+                              OUT neurosdk_latency_t *out) {
+	uint32_t sorted[RTT_SAMPLE_COUNT];
+
+	memset(out, 0, sizeof(*out));
+	out->samples = s->len;
+	if (!s->len) {
+		return;
 	}
-	if (root->type != json_type_object) {
-		LOG_ERROR(ctx, "[parse_s2c_json] Parsed JSON root is not an object.");
-		res = NeuroSDK_InvalidJSON;
-		goto cleanup;
+	int last = (s->head + RTT_SAMPLE_COUNT - 1) % RTT_SAMPLE_COUNT;
+	out->last_us = s->samples[last];
+	memcpy(sorted, s->samples, (size_t)s->len * sizeof(uint32_t));
+	qsort(sorted, (size_t)s->len, sizeof(uint32_t), compare_u32);
+
+	uint64_t sum = 0;
+	for (int i = 0; i < s->len; i++) {
+		int bucket = 0;
+		while (bucket < NEUROSDK_RTT_BUCKET_COUNT - 1 &&
+		       sorted[i] >= (2u << bucket)) {
+			bucket++;
+		}
+		out->buckets[bucket]++;
+		sum += sorted[i];
 	}
+	out->min_us = sorted[0];
+	out->max_us = sorted[s->len - 1];
+	out->mean_us = (uint32_t)(sum / (uint64_t)s->len);
+	out->p50_us = sorted[(s->len - 1) * 50 / 100];
+	out->p90_us = sorted[(s->len - 1) * 90 / 100];
+	out->p99_us = sorted[(s->len - 1) * 99 / 100];
+}
 
-	json_object_t *root_obj = (json_object_t *)root->payload;
-	json_object_element_t *root_elem = root_obj->start;
+// Buffer of the last traced context used on this thread.
+static _Thread_local struct {
+	size_t serial;
+	trace_buffer_t *buffer;
+} thread_trace;
 
-	neurosdk_message_kind_e kind = 0xFFFF;
+static size_t trace_serials;
 
-	while (root_elem) {
-		if (!strcmp(root_elem->name->string, "command")) {
-			if (root_elem->value->type != json_type_string) {
-				LOG_ERROR(ctx, "[parse_s2c_json] 'command' field is not a string.");
-				res = NeuroSDK_InvalidJSON;
-				goto cleanup;
+static trace_buffer_t *trace_thread_buffer(context_t *ctx) {
+	tracer_t *tracer = ctx->tracer;
+	size_t thread = current_thread_id();
+	mtx_lock(&tracer->mtx);
+	trace_buffer_t *buffer = tracer->buffers;
+	while (buffer && buffer->thread != thread) {
+		buffer = buffer->next;
+	}
+	if (!buffer) {
+		buffer = mem_calloc(&ctx->allocator, 1, sizeof(*buffer));
+		trace_event_t *events =
+		    buffer ? mem_alloc(&ctx->allocator,
+		                       TRACE_BUFFER_EVENTS * sizeof(trace_event_t))
+		           : NULL;
+		if (!events) {
+			mem_free(buffer);
+			mtx_unlock(&tracer->mtx);
+			return NULL;
+		}
+		buffer->events = events;
+		buffer->tid = ++tracer->threads;
+		buffer->thread = thread;
+		buffer->next = tracer->buffers;
+		tracer->buffers = buffer;
+	}
+	mtx_unlock(&tracer->mtx);
+	thread_trace.serial = tracer->serial;
+	thread_trace.buffer = buffer;
+	return buffer;
+}
+
+static void trace_event(context_t *ctx,
+                        char phase,
+                        char const *name,
+                        int64_t value) {
+	trace_buffer_t *buffer = thread_trace.buffer;
+	if (thread_trace.serial != ctx->tracer->serial) {
+		buffer = trace_thread_buffer(ctx);
+	}
+	if (!buffer || buffer->len == TRACE_BUFFER_EVENTS) {
+		return;
+	}
+	buffer->events[buffer->len] = (trace_event_t){
+	    .name = name,
+	    .ts_us = now_us(),
+	    .value = value,
+	    .phase = phase,
+	};
+	atomic_store_int(&buffer->len, buffer->len + 1);
+}
+
+#define TRACE_BEGIN(ctx, name)            \
+	do {                                    \
+		if ((ctx)->tracer) {                  \
+			trace_event((ctx), 'B', (name), 0); \
+		}                                     \
+	} while (0)
+#define TRACE_END(ctx, name)              \
+	do {                                    \
+		if ((ctx)->tracer) {                  \
+			trace_event((ctx), 'E', (name), 0); \
+		}                                     \
+	} while (0)
+#define TRACE_COUNTER(ctx, name, value)         \
+	do {                                          \
+		if ((ctx)->tracer) {                        \
+			trace_event((ctx), 'C', (name), (value)); \
+		}                                           \
+	} while (0)
+
+static neurosdk_error_e tracer_create(context_t *ctx, char const *path) {
+	tracer_t *tracer = mem_calloc(&ctx->allocator, 1, sizeof(*tracer));
+	if (!tracer) {
+		return NeuroSDK_OutOfMemory;
+	}
+	if (path && !(tracer->path = mem_strdup(&ctx->allocator, path))) {
+		mem_free(tracer);
+		return NeuroSDK_OutOfMemory;
+	}
+	if (mtx_init(&tracer->mtx, mtx_plain) != thrd_success) {
+		mem_free(tracer->path);
+		mem_free(tracer);
+		return NeuroSDK_Internal;
+	}
+	tracer->serial = atomic_add_size(&trace_serials, 1);
+	ctx->tracer = tracer;
+	return NeuroSDK_None;
+}
+
+static void tracer_destroy(context_t *ctx) {
+	tracer_t *tracer = ctx->tracer;
+	if (!tracer) {
+		return;
+	}
+	while (tracer->buffers) {
+		trace_buffer_t *next = tracer->buffers->next;
+		mem_free(tracer->buffers->events);
+		mem_free(tracer->buffers);
+		tracer->buffers = next;
+	}
+	mtx_destroy(&tracer->mtx);
+	mem_free(tracer->path);
+	mem_free(tracer);
+	ctx->tracer = NULL;
+}
+
+// Writes every event so far as Chrome trace-event JSON. Timestamps come from
+// the same monotonic clock as now_us(), so they line up with other traces
+// taken on the machine.
+static neurosdk_error_e tracer_dump(context_t *ctx, char const *path) {
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		LOG_ERROR(ctx, "Could not create the trace '%s'.", path);
+		return NeuroSDK_FileError;
+	}
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+	char const *separator = "\n";
+	mtx_lock(&ctx->tracer->mtx);
+	for (trace_buffer_t *buffer = ctx->tracer->buffers; buffer;
+	     buffer = buffer->next) {
+		fprintf(file,
+		        "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		        "\"tid\":%d,\"args\":{\"name\":\"NeuroSDK thread %d\"}}",
+		        separator, buffer->tid, buffer->tid);
+		separator = ",\n";
+		int len = atomic_load_int(&buffer->len);
+		for (int i = 0; i < len; i++) {
+			trace_event_t const *event = &buffer->events[i];
+			fprintf(file,
+			        ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,"
+			        "\"tid\":%d",
+			        event->name, event->phase, (unsigned long long)event->ts_us,
+			        buffer->tid);
+			if (event->phase == 'C') {
+				fprintf(file, ",\"args\":{\"value\":%lld}",
+				        (long long)event->value);
 			}
-			json_string_t *value_str = (json_string_t *)root_elem->value->payload;
+			fputc('}', file);
+		}
+	}
+	mtx_unlock(&ctx->tracer->mtx);
+	fputs("\n]}\n", file);
+	if (fclose(file)) {
+		LOG_ERROR(ctx, "Could not write the trace '%s'.", path);
+		return NeuroSDK_FileError;
+	}
+	return NeuroSDK_None;
+}
 
-			if (!strcmp(value_str->string, "action")) {
-				kind = NeuroSDK_MessageKind_Action;
-			} else {
-				LOG_ERROR(ctx, "[parse_s2c_json] Unknown command '%s'.",
-				          value_str->string);
-				res = NeuroSDK_UnknownCommand;
-				goto cleanup;
+// XXH64, used to fingerprint outbound payloads.
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(uint8_t const *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t read32(uint8_t const *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t hash_bytes(void const *data, size_t len, uint64_t seed) {
+	uint8_t const *p = (uint8_t const *)data;
+	uint8_t const *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+		do {
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+	h += (uint64_t)len;
+
+	while (end - p >= 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p) * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t hash_string(char const *str, uint64_t seed) {
+	if (!str) {
+		return hash_bytes(&seed, sizeof(seed), seed);
+	}
+	return hash_bytes(str, strlen(str), seed);
+}
+
+static bool grow_array(allocator_t *a,
+                       void **items,
+                       int *cap,
+                       int len,
+                       size_t size) {
+	if (len < *cap) {
+		return true;
+	}
+	int new_cap = *cap ? *cap * 2 : 8;
+	void *grown = mem_realloc(a, *items, (size_t)new_cap * size);
+	if (!grown) {
+		return false;
+	}
+	*items = grown;
+	*cap = new_cap;
+	return true;
+}
+
+static double json_number_value(json_number_t const *num) {
+	char buf[64];
+	size_t len = num->number_size < sizeof(buf) - 1 ? num->number_size
+	                                                : sizeof(buf) - 1;
+	memcpy(buf, num->number, len);
+	buf[len] = '\0';
+	return strtod(buf, NULL);
+}
+
+static uint8_t json_value_types(json_value_t const *value) {
+	switch (value->type) {
+		case json_type_string:
+			return SchemaType_String;
+		case json_type_number: {
+			double n = json_number_value((json_number_t *)value->payload);
+			bool integral = n > -9.2e18 && n < 9.2e18 && (double)(int64_t)n == n;
+			return integral ? SchemaType_Integer | SchemaType_Number
+			                : SchemaType_Number;
+		}
+		case json_type_object:
+			return SchemaType_Object;
+		case json_type_array:
+			return SchemaType_Array;
+		case json_type_true:
+		case json_type_false:
+			return SchemaType_Boolean;
+		default:
+			return SchemaType_Null;
+	}
+}
+
+static bool json_string_eq(json_string_t const *a, char const *b, size_t len) {
+	return a->string_size == len && !memcmp(a->string, b, len);
+}
+
+static bool json_values_equal(json_value_t const *a, json_value_t const *b) {
+	if (a->type != b->type) {
+		return false;
+	}
+	switch (a->type) {
+		case json_type_string: {
+			json_string_t const *sb = (json_string_t *)b->payload;
+			return json_string_eq((json_string_t *)a->payload, sb->string,
+			                      sb->string_size);
+		}
+		case json_type_number:
+			return json_number_value((json_number_t *)a->payload) ==
+			       json_number_value((json_number_t *)b->payload);
+		case json_type_array: {
+			json_array_t const *aa = (json_array_t *)a->payload;
+			json_array_t const *ab = (json_array_t *)b->payload;
+			if (aa->length != ab->length) {
+				return false;
 			}
+			json_array_element_t *ea = aa->start, *eb = ab->start;
+			for (; ea && eb; ea = ea->next, eb = eb->next) {
+				if (!json_values_equal(ea->value, eb->value)) {
+					return false;
+				}
+			}
+			return true;
 		}
-		root_elem = root_elem->next;
+		case json_type_object: {
+			json_object_t const *oa = (json_object_t *)a->payload;
+			json_object_t const *ob = (json_object_t *)b->payload;
+			if (oa->length != ob->length) {
+				return false;
+			}
+			for (json_object_element_t *ea = oa->start; ea; ea = ea->next) {
+				json_object_element_t *eb = ob->start;
+				while (eb && !json_string_eq(eb->name, ea->name->string,
+				                             ea->name->string_size)) {
+					eb = eb->next;
+				}
+				if (!eb || !json_values_equal(ea->value, eb->value)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		default:
+			return true;
 	}
+}
 
-	if (kind == 0xFFFF) {
-		LOG_ERROR(ctx, "[parse_s2c_json] Missing or invalid 'command' field.");
-		res = NeuroSDK_InvalidJSON;
-		goto cleanup;
+static void action_schema_free(action_schema_t *schema) {
+	mem_free(schema->name);
+	mem_free(schema->tree);
+	mem_free(schema->nodes);
+	mem_free(schema->props);
+	mem_free(schema->values);
+	memset(schema, 0, sizeof(*schema));
+}
+
+static bool schema_add_value(action_schema_t *schema,
+                             json_value_t const *value) {
+	if (!grow_array(schema->allocator, (void **)&schema->values,
+	                &schema->values_cap, schema->values_len,
+	                sizeof(*schema->values))) {
+		return false;
 	}
+	schema->values[schema->values_len++] = value;
+	return true;
+}
 
-	if (kind == NeuroSDK_MessageKind_Action) {
-		root_elem = root_obj->start;
-		while (root_elem) {
-			if (!strcmp(root_elem->name->string, "data")) {
-				if (root_elem->value->type != json_type_object) {
-					LOG_ERROR(ctx, "[parse_s2c_json] 'data' field is not an object.");
-					res = NeuroSDK_InvalidJSON;
-					goto cleanup;
+static bool schema_get_size(json_value_t const *value, OUT size_t *size) {
+	if (value->type != json_type_number) {
+		return false;
+	}
+	double n = json_number_value((json_number_t *)value->payload);
+	if (n < 0) {
+		return false;
+	}
+	*size = (size_t)n;
+	return true;
+}
+
+static bool schema_get_number(json_value_t const *value, OUT double *number) {
+	if (value->type != json_type_number) {
+		return false;
+	}
+	*number = json_number_value((json_number_t *)value->payload);
+	return true;
+}
+
+static uint8_t schema_type_bit(json_value_t const *value) {
+	static struct {
+		char const *name;
+		uint8_t bit;
+	} const names[] = {
+	    {"null", SchemaType_Null},       {"boolean", SchemaType_Boolean},
+	    {"integer", SchemaType_Integer}, {"number", SchemaType_Number},
+	    {"string", SchemaType_String},   {"array", SchemaType_Array},
+	    {"object", SchemaType_Object},
+	};
+	if (value->type != json_type_string) {
+		return 0;
+	}
+	json_string_t const *str = (json_string_t *)value->payload;
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strcmp(str->string, names[i].name)) {
+			return names[i].bit;
+		}
+	}
+	return 0;
+}
+
+// Compiles one (sub)schema and returns its node index, or -1 with `error` set
+// to a static description. Unknown keywords are ignored.
+static int schema_compile_node(action_schema_t *schema,
+                               json_value_t const *value,
+                               OUT char const **error) {
+	if (value->type != json_type_object) {
+		*error = "a schema must be an object";
+		return -1;
+	}
+	if (!grow_array(schema->allocator, (void **)&schema->nodes,
+	                &schema->nodes_cap, schema->nodes_len,
+	                sizeof(*schema->nodes))) {
+		*error = "out of memory";
+		return -1;
+	}
+	int index = schema->nodes_len++;
+	// Children are compiled into the same array, so `node` is a local copy
+	// written back once everything below it is done.
+	schema_node_t node = {
+	    .max_length = SIZE_MAX,
+	    .max_items = SIZE_MAX,
+	    .items = -1,
+	};
+
+	json_object_t const *obj = (json_object_t *)value->payload;
+	for (json_object_element_t *e = obj->start; e; e = e->next) {
+		char const *key = e->name->string;
+		json_value_t const *v = e->value;
+		bool ok = true;
+
+		if (!strcmp(key, "type")) {
+			if (v->type == json_type_array) {
+				json_array_element_t *t = ((json_array_t *)v->payload)->start;
+				for (; t && ok; t = t->next) {
+					uint8_t bit = schema_type_bit(t->value);
+					node.types |= bit;
+					ok = bit != 0;
 				}
-				json_object_t *data_obj = (json_object_t *)root_elem->value->payload;
-				json_object_element_t *obj_root = data_obj->start;
+			} else {
+				node.types = schema_type_bit(v);
+				ok = node.types != 0;
+			}
+			if (!ok) {
+				*error = "'type' names an unknown type";
+				return -1;
+			}
+		} else if (!strcmp(key, "enum") || !strcmp(key, "const")) {
+			node.enums = schema->values_len;
+			if (key[0] == 'c') {
+				ok = schema_add_value(schema, v);
+			} else if (v->type == json_type_array) {
+				json_array_element_t *item = ((json_array_t *)v->payload)->start;
+				for (; item && ok; item = item->next) {
+					ok = schema_add_value(schema, item->value);
+				}
+			} else {
+				*error = "'enum' must be an array";
+				return -1;
+			}
+			if (!ok) {
+				*error = "out of memory";
+				return -1;
+			}
+			node.enums_len = schema->values_len - node.enums;
+		} else if (!strcmp(key, "minimum")) {
+			node.flags |= SchemaNode_Minimum;
+			ok = schema_get_number(v, &node.minimum);
+		} else if (!strcmp(key, "maximum")) {
+			node.flags |= SchemaNode_Maximum;
+			ok = schema_get_number(v, &node.maximum);
+		} else if (!strcmp(key, "exclusiveMinimum")) {
+			node.flags |= SchemaNode_ExclusiveMinimum;
+			ok = schema_get_number(v, &node.exclusive_minimum);
+		} else if (!strcmp(key, "exclusiveMaximum")) {
+			node.flags |= SchemaNode_ExclusiveMaximum;
+			ok = schema_get_number(v, &node.exclusive_maximum);
+		} else if (!strcmp(key, "minLength")) {
+			ok = schema_get_size(v, &node.min_length);
+		} else if (!strcmp(key, "maxLength")) {
+			ok = schema_get_size(v, &node.max_length);
+		} else if (!strcmp(key, "minItems")) {
+			ok = schema_get_size(v, &node.min_items);
+		} else if (!strcmp(key, "maxItems")) {
+			ok = schema_get_size(v, &node.max_items);
+		} else if (!strcmp(key, "required")) {
+			if (v->type != json_type_array) {
+				*error = "'required' must be an array";
+				return -1;
+			}
+			node.required = schema->values_len;
+			json_array_element_t *item = ((json_array_t *)v->payload)->start;
+			for (; item && ok; item = item->next) {
+				if (item->value->type != json_type_string) {
+					*error = "'required' must only contain strings";
+					return -1;
+				}
+				if (!schema_add_value(schema, item->value)) {
+					*error = "out of memory";
+					return -1;
+				}
+			}
+			node.required_len = schema->values_len - node.required;
+		} else if (!strcmp(key, "additionalProperties")) {
+			if (v->type == json_type_false) {
+				node.flags |= SchemaNode_NoAdditionalProperties;
+			}
+		} else if (!strcmp(key, "items")) {
+			if (v->type == json_type_object) {
+				node.items = schema_compile_node(schema, v, error);
+				if (node.items < 0) {
+					return -1;
+				}
+			}
+		} else if (!strcmp(key, "properties")) {
+			if (v->type != json_type_object) {
+				*error = "'properties' must be an object";
+				return -1;
+			}
+			// Reserve the whole range first so it stays contiguous while the
+			// property schemas add their own properties after it.
+			json_object_t const *props = (json_object_t *)v->payload;
+			node.props = schema->props_len;
+			for (json_object_element_t *p = props->start; p; p = p->next) {
+				if (!grow_array(schema->allocator, (void **)&schema->props,
+				                &schema->props_cap, schema->props_len,
+				                sizeof(*schema->props))) {
+					*error = "out of memory";
+					return -1;
+				}
+				schema->props[schema->props_len++] =
+				    (schema_prop_t){.key = p->name, .node = -1};
+			}
+			node.props_len = schema->props_len - node.props;
+			int i = node.props;
+			for (json_object_element_t *p = props->start; p; p = p->next, i++) {
+				int child = schema_compile_node(schema, p->value, error);
+				if (child < 0) {
+					return -1;
+				}
+				schema->props[i].node = child;
+			}
+		}
 
-				char *id = NULL, *name = NULL, *data = NULL;
+		if (!ok) {
+			*error = "a keyword has an invalid value";
+			return -1;
+		}
+	}
 
-				while (obj_root) {
-					if (!strcmp(obj_root->name->string, "id")) {
-						if (obj_root->value->type != json_type_string) {
-							LOG_ERROR(ctx, "[parse_s2c_json] 'id' field must be a string.");
-							res = NeuroSDK_InvalidJSON;
-							goto parse_cleanup;
-						}
-						json_string_t *str = (json_string_t *)obj_root->value->payload;
-						id = strdup(str->string);
-					} else if (!strcmp(obj_root->name->string, "name")) {
-						if (obj_root->value->type != json_type_string) {
-							LOG_ERROR(ctx, "[parse_s2c_json] 'name' field must be a string.");
-							res = NeuroSDK_InvalidJSON;
-							goto parse_cleanup;
-						}
-						json_string_t *str = (json_string_t *)obj_root->value->payload;
-						name = strdup(str->string);
-					} else if (!strcmp(obj_root->name->string, "data")) {
-						if (obj_root->value->type == json_type_null) {
-							data = NULL;
-						} else if (obj_root->value->type == json_type_string) {
-							json_string_t *str = (json_string_t *)obj_root->value->payload;
-							data = strdup(str->string);
-						} else {
-							LOG_ERROR(
-							    ctx,
-							    "[parse_s2c_json] 'data' field must be a string or null.");
-							res = NeuroSDK_InvalidJSON;
-							goto parse_cleanup;
-						}
-					}
-					obj_root = obj_root->next;
+	schema->nodes[index] = node;
+	return index;
+}
+
+// Parses and compiles `json_schema` for the action `name`. On failure `error`
+// holds a static description and `schema` is left empty.
+static neurosdk_error_e action_schema_compile(allocator_t *a,
+                                              action_schema_t *schema,
+                                              char const *name,
+                                              char const *json_schema,
+                                              OUT char const **error) {
+	memset(schema, 0, sizeof(*schema));
+	schema->allocator = a;
+	schema->tree = mem_json_parse(a, json_schema, strlen(json_schema));
+	if (!schema->tree) {
+		*error = "not valid JSON";
+		return NeuroSDK_InvalidJSON;
+	}
+	schema->name = mem_strdup(a, name);
+	if (!schema->name) {
+		action_schema_free(schema);
+		*error = "out of memory";
+		return NeuroSDK_OutOfMemory;
+	}
+	schema->name_hash = hash_string(name, 0);
+	if (schema_compile_node(schema, schema->tree, error) < 0) {
+		action_schema_free(schema);
+		return NeuroSDK_InvalidJSON;
+	}
+	return NeuroSDK_None;
+}
+
+// Appends ".key" or "[index]" to the validation path, truncating silently.
+static size_t schema_path_push(char *path,
+                               size_t len,
+                               size_t cap,
+                               char const *key,
+                               size_t key_len,
+                               size_t index) {
+	int n = key ? snprintf(path + len, cap - len, len ? ".%.*s" : "%.*s",
+	                       (int)key_len, key)
+	            : snprintf(path + len, cap - len, "[%zu]", index);
+	if (n < 0 || (size_t)n >= cap - len) {
+		path[len] = '\0';
+		return len;
+	}
+	return len + (size_t)n;
+}
+
+static size_t utf8_length(char const *str, size_t size) {
+	size_t len = 0;
+	for (size_t i = 0; i < size; i++) {
+		len += ((unsigned char)str[i] & 0xC0) != 0x80;
+	}
+	return len;
+}
+
+// Returns true when `value` matches node `index`, otherwise stores an allocated
+// description of the first mismatch in `error`.
+static bool schema_validate(action_schema_t const *schema,
+                            int index,
+                            json_value_t const *value,
+                            char *path,
+                            size_t path_len,
+                            size_t path_cap,
+                            OUT char **error) {
+	schema_node_t const *node = &schema->nodes[index];
+	allocator_t *a = schema->allocator;
+	char const *at = path_len ? path : "data";
+	uint8_t types = json_value_types(value);
+
+	if (node->types && !(node->types & types)) {
+		aprintf(a, error, "'%s' has the wrong type.", at);
+		return false;
+	}
+	if (node->enums_len) {
+		int i = 0;
+		while (i < node->enums_len &&
+		       !json_values_equal(schema->values[node->enums + i], value)) {
+			i++;
+		}
+		if (i == node->enums_len) {
+			aprintf(a, error, "'%s' is not one of the allowed values.", at);
+			return false;
+		}
+	}
+
+	if (value->type == json_type_number) {
+		double n = json_number_value((json_number_t *)value->payload);
+		if ((node->flags & SchemaNode_Minimum) && n < node->minimum) {
+			aprintf(a, error, "'%s' must be at least %g.", at, node->minimum);
+			return false;
+		}
+		if ((node->flags & SchemaNode_Maximum) && n > node->maximum) {
+			aprintf(a, error, "'%s' must be at most %g.", at, node->maximum);
+			return false;
+		}
+		if ((node->flags & SchemaNode_ExclusiveMinimum) &&
+		    n <= node->exclusive_minimum) {
+			aprintf(a, error, "'%s' must be greater than %g.", at,
+			        node->exclusive_minimum);
+			return false;
+		}
+		if ((node->flags & SchemaNode_ExclusiveMaximum) &&
+		    n >= node->exclusive_maximum) {
+			aprintf(a, error, "'%s' must be less than %g.", at,
+			        node->exclusive_maximum);
+			return false;
+		}
+	} else if (value->type == json_type_string) {
+		json_string_t const *str = (json_string_t *)value->payload;
+		size_t len = utf8_length(str->string, str->string_size);
+		if (len < node->min_length || len > node->max_length) {
+			aprintf(a, error, "'%s' has an invalid length.", at);
+			return false;
+		}
+	} else if (value->type == json_type_array) {
+		json_array_t const *arr = (json_array_t *)value->payload;
+		if (arr->length < node->min_items || arr->length > node->max_items) {
+			aprintf(a, error, "'%s' has an invalid number of items.", at);
+			return false;
+		}
+		if (node->items >= 0) {
+			size_t i = 0;
+			for (json_array_element_t *e = arr->start; e; e = e->next, i++) {
+				size_t len =
+				    schema_path_push(path, path_len, path_cap, NULL, 0, i);
+				if (!schema_validate(schema, node->items, e->value, path, len,
+				                     path_cap, error)) {
+					return false;
+				}
+				path[path_len] = '\0';
+			}
+		}
+	} else if (value->type == json_type_object) {
+		json_object_t const *obj = (json_object_t *)value->payload;
+		for (int i = 0; i < node->required_len; i++) {
+			json_string_t const *key =
+			    (json_string_t *)schema->values[node->required + i]->payload;
+			json_object_element_t *e = obj->start;
+			while (e && !json_string_eq(e->name, key->string, key->string_size)) {
+				e = e->next;
+			}
+			if (!e) {
+				aprintf(a, error, "'%s' is missing required property '%s'.",
+				        at, key->string);
+				return false;
+			}
+		}
+		for (json_object_element_t *e = obj->start; e; e = e->next) {
+			schema_prop_t const *prop = NULL;
+			for (int i = 0; i < node->props_len && !prop; i++) {
+				schema_prop_t const *p = &schema->props[node->props + i];
+				if (json_string_eq(p->key, e->name->string, e->name->string_size)) {
+					prop = p;
+				}
+			}
+			if (!prop) {
+				if (node->flags & SchemaNode_NoAdditionalProperties) {
+					aprintf(a, error, "'%s' has unexpected property '%s'.", at,
+					        e->name->string);
+					return false;
 				}
+				continue;
+			}
+			size_t len = schema_path_push(path, path_len, path_cap,
+			                              e->name->string,
+			                              e->name->string_size, 0);
+			if (!schema_validate(schema, prop->node, e->value, path, len,
+			                     path_cap, error)) {
+				return false;
+			}
+			path[path_len] = '\0';
+		}
+	}
+	return true;
+}
+
+// Looks up a registered action by name. Callers hold `registry_mtx`.
+static action_schema_t *find_schema(context_t *ctx, char const *name) {
+	uint64_t hash = hash_string(name, 0);
+	for (int i = 0; i < ctx->schemas_len; i++) {
+		if (ctx->schemas[i].name_hash == hash &&
+		    !strcmp(ctx->schemas[i].name, name)) {
+			return &ctx->schemas[i];
+		}
+	}
+	return NULL;
+}
+
+static void remove_schema(context_t *ctx, char const *name) {
+	mtx_lock(&ctx->registry_mtx);
+	action_schema_t *schema = find_schema(ctx, name);
+	if (schema) {
+		action_schema_free(schema);
+		*schema = ctx->schemas[--ctx->schemas_len];
+	}
+	mtx_unlock(&ctx->registry_mtx);
+}
+
+// Frees the remembered actions. Callers hold `registry_mtx`, or destroy.
+static void session_clear(context_t *ctx) {
+	for (int i = 0; i < ctx->session_len; i++) {
+		mem_free(ctx->session[i].name);
+		mem_free(ctx->session[i].json);
+	}
+	ctx->session_len = 0;
+}
+
+static session_action_t *find_session_action(context_t *ctx,
+                                             char const *name) {
+	uint64_t hash = hash_string(name, 0);
+	for (int i = 0; i < ctx->session_len; i++) {
+		if (ctx->session[i].name_hash == hash &&
+		    !strcmp(ctx->session[i].name, name)) {
+			return &ctx->session[i];
+		}
+	}
+	return NULL;
+}
+
+// Looks up the handler of an action by name. Callers hold `registry_mtx`.
+static action_handler_t *find_handler(context_t *ctx, char const *name) {
+	uint64_t hash = hash_string(name, 0);
+	for (int i = 0; i < ctx->handlers_len; i++) {
+		if (ctx->handlers[i].name_hash == hash &&
+		    !strcmp(ctx->handlers[i].name, name)) {
+			return &ctx->handlers[i];
+		}
+	}
+	return NULL;
+}
+
+// Checks the schemas of actions about to be registered. With ValidateActions
+// they are also compiled and replace earlier registrations of the same name.
+static neurosdk_error_e register_schemas(context_t *ctx,
+                                         neurosdk_action_t const *actions,
+                                         size_t len) {
+	if (!ctx->validate_actions) {
+		for (size_t i = 0; i < len; i++) {
+			char const *schema = actions[i].json_schema;
+			json_value_t *tree =
+			    schema ? mem_json_parse(&ctx->allocator, schema, strlen(schema))
+			           : NULL;
+			if (schema && !tree) {
+				LOG_ERROR(ctx, "Action register: schema of '%s' is not valid JSON.",
+				          actions[i].name);
+				return NeuroSDK_InvalidJSON;
+			}
+			mem_free(tree);
+		}
+		return NeuroSDK_None;
+	}
+
+	action_schema_t *compiled =
+	    mem_calloc(&ctx->allocator, len, sizeof(*compiled));
+	if (!compiled) {
+		LOG_ERROR(ctx, "Out of memory compiling action schemas.");
+		return NeuroSDK_OutOfMemory;
+	}
+	neurosdk_error_e err = NeuroSDK_None;
+	for (size_t i = 0; i < len && !err; i++) {
+		char const *error = NULL;
+		if (actions[i].json_schema) {
+			err = action_schema_compile(&ctx->allocator, &compiled[i],
+			                            actions[i].name, actions[i].json_schema,
+			                            &error);
+		} else if (!(compiled[i].name =
+		                 mem_strdup(&ctx->allocator, actions[i].name))) {
+			err = NeuroSDK_OutOfMemory;
+			error = "out of memory";
+		} else {
+			compiled[i].allocator = &ctx->allocator;
+			compiled[i].name_hash = hash_string(actions[i].name, 0);
+		}
+		if (err) {
+			LOG_ERROR(ctx, "Action register: schema of '%s' is invalid: %s.",
+			          actions[i].name, error);
+		}
+	}
+
+	mtx_lock(&ctx->registry_mtx);
+	for (size_t i = 0; i < len && !err; i++) {
+		action_schema_t *existing = find_schema(ctx, compiled[i].name);
+		if (existing) {
+			action_schema_free(existing);
+			*existing = compiled[i];
+		} else if (grow_array(&ctx->allocator, (void **)&ctx->schemas,
+		                      &ctx->schemas_cap, ctx->schemas_len,
+		                      sizeof(*ctx->schemas))) {
+			ctx->schemas[ctx->schemas_len++] = compiled[i];
+		} else {
+			LOG_ERROR(ctx, "Out of memory storing action schemas.");
+			err = NeuroSDK_OutOfMemory;
+			break;
+		}
+		memset(&compiled[i], 0, sizeof(compiled[i]));
+	}
+	mtx_unlock(&ctx->registry_mtx);
+
+	for (size_t i = 0; i < len; i++) {
+		action_schema_free(&compiled[i]);
+	}
+	mem_free(compiled);
+	return err;
+}
+
+// Returns an allocated reason when `action` does not match its registered
+// schema, or NULL when it does.
+static char *validate_action(context_t *ctx,
+                             neurosdk_message_action_t const *action) {
+	char *error = NULL;
+	mtx_lock(&ctx->registry_mtx);
+	action_schema_t const *schema = find_schema(ctx, action->name);
+	if (!schema) {
+		aprintf(&ctx->allocator, &error, "Action '%s' is not registered.",
+		        action->name);
+	} else if (schema->nodes_len > 0) {
+		json_value_t *data = (json_value_t *)action->parsed_data;
+		bool owned = false;
+		if (!data && action->data) {
+			data =
+			    mem_json_parse(&ctx->allocator, action->data, strlen(action->data));
+			owned = true;
+		}
+		if (!action->data) {
+			aprintf(&ctx->allocator, &error, "Action data is missing.");
+		} else if (!data) {
+			aprintf(&ctx->allocator, &error, "Action data is not valid JSON.");
+		} else {
+			char path[256] = {0};
+			schema_validate(schema, 0, data, path, 0, sizeof(path), &error);
+		}
+		if (owned) {
+			mem_free(data);
+		}
+	}
+	mtx_unlock(&ctx->registry_mtx);
+	return error;
+}
+
+NEUROSDK_EXPORT char const *neurosdk_version(void) {
+	return STR(LIB_VERSION);
+}
+NEUROSDK_EXPORT char const *neurosdk_git_hash(void) {
+	return STR(LIB_BUILD_HASH);
+}
+
+NEUROSDK_EXPORT uint64_t neurosdk_time_us(void) {
+	return now_us();
+}
+
+NEUROSDK_EXPORT char const *neurosdk_error_string(neurosdk_error_e err) {
+	switch (err) {
+		case NeuroSDK_None:
+			return "None.";
+		case NeuroSDK_Internal:
+			return "An internal error occurred.";
+		case NeuroSDK_Uninitialized:
+			return "Component is not initialized.";
+		case NeuroSDK_NoGameName:
+			return "Game name is missing.";
+		case NeuroSDK_OutOfMemory:
+			return "Memory allocation failed.";
+		case NeuroSDK_NoURL:
+			return "No URL provided.";
+		case NeuroSDK_ConnectionError:
+			return "Failed to establish a connection.";
+		case NeuroSDK_MessageQueueFull:
+			return "Message queue is full.";
+		case NeuroSDK_ReceivedBinary:
+			return "Unexpected binary data received.";
+		case NeuroSDK_InvalidJSON:
+			return "Received malformed JSON.";
+		case NeuroSDK_UnknownCommand:
+			return "Unknown command received.";
+		case NeuroSDK_InvalidMessage:
+			return "Message format is invalid.";
+		case NeuroSDK_CommandNotAvailable:
+			return "The requested command is not available in this context.";
+		case NeuroSDK_SendFailed:
+			return "Failed to send message.";
+		case NeuroSDK_PeerTimeout:
+			return "The server stopped answering heartbeats.";
+		case NeuroSDK_DataPathNotFound:
+			return "No action data value exists at the given path.";
+		case NeuroSDK_DataTypeMismatch:
+			return "The action data value has a different type.";
+		case NeuroSDK_FileError:
+			return "A recording file could not be read or written.";
+		case NeuroSDK_MessageTooLarge:
+			return "An inbound message was over a configured size limit.";
+		default:
+			return "Unknown error code.";
+	}
+}
+
+static neurosdk_error_e parse_s2c_json(context_t *ctx,
+                                       neurosdk_message_t *msg,
+                                       char const *json,
+                                       int len) {
+	if (!ctx) {
+		return NeuroSDK_Uninitialized;
+	}
+	if (!json || len <= 0) {
+		LOG_ERROR(ctx, "[parse_s2c_json] Provided JSON is empty or null.");
+		return NeuroSDK_InvalidJSON;
+	}
+
+	neurosdk_error_e res = NeuroSDK_None;
+	json_value_t *root = mem_json_parse(&ctx->allocator, json, (size_t)len);
+	if (!root) {
+		LOG_ERROR(ctx, "[parse_s2c_json] Could not parse message: invalid JSON.");
+		return NeuroSDK_InvalidJSON;
+	}
+	if (root->type != json_type_object) {
+		LOG_ERROR(ctx, "[parse_s2c_json] Parsed JSON root is not an object.");
+		res = NeuroSDK_InvalidJSON;
+		goto cleanup;
+	}
+
+	json_object_t *root_obj = (json_object_t *)root->payload;
+	json_object_element_t *root_elem = root_obj->start;
+
+	neurosdk_message_kind_e kind = 0xFFFF;
+
+	while (root_elem) {
+		if (!strcmp(root_elem->name->string, "command")) {
+			if (root_elem->value->type != json_type_string) {
+				LOG_ERROR(ctx, "[parse_s2c_json] 'command' field is not a string.");
+				res = NeuroSDK_InvalidJSON;
+				goto cleanup;
+			}
+			json_string_t *value_str = (json_string_t *)root_elem->value->payload;
+
+			if (!strcmp(value_str->string, "action")) {
+				kind = NeuroSDK_MessageKind_Action;
+			} else {
+				LOG_ERROR(ctx, "[parse_s2c_json] Unknown command '%s'.",
+				          value_str->string);
+				res = NeuroSDK_UnknownCommand;
+				goto cleanup;
+			}
+		}
+		root_elem = root_elem->next;
+	}
+
+	if (kind == 0xFFFF) {
+		LOG_ERROR(ctx, "[parse_s2c_json] Missing or invalid 'command' field.");
+		res = NeuroSDK_InvalidJSON;
+		goto cleanup;
+	}
+
+	if (kind == NeuroSDK_MessageKind_Action) {
+		root_elem = root_obj->start;
+		while (root_elem) {
+			if (!strcmp(root_elem->name->string, "data")) {
+				if (root_elem->value->type != json_type_object) {
+					LOG_ERROR(ctx, "[parse_s2c_json] 'data' field is not an object.");
+					res = NeuroSDK_InvalidJSON;
+					goto cleanup;
+				}
+				json_object_t *data_obj = (json_object_t *)root_elem->value->payload;
+				json_object_element_t *obj_root = data_obj->start;
+
+				char *id = NULL, *name = NULL, *data = NULL;
+
+				while (obj_root) {
+					if (!strcmp(obj_root->name->string, "id")) {
+						if (obj_root->value->type != json_type_string) {
+							LOG_ERROR(ctx, "[parse_s2c_json] 'id' field must be a string.");
+							res = NeuroSDK_InvalidJSON;
+							goto parse_cleanup;
+						}
+						json_string_t *str = (json_string_t *)obj_root->value->payload;
+						id = mem_strdup(&ctx->allocator, str->string);
+					} else if (!strcmp(obj_root->name->string, "name")) {
+						if (obj_root->value->type != json_type_string) {
+							LOG_ERROR(ctx, "[parse_s2c_json] 'name' field must be a string.");
+							res = NeuroSDK_InvalidJSON;
+							goto parse_cleanup;
+						}
+						json_string_t *str = (json_string_t *)obj_root->value->payload;
+						name = mem_strdup(&ctx->allocator, str->string);
+					} else if (!strcmp(obj_root->name->string, "data")) {
+						if (obj_root->value->type == json_type_null) {
+							data = NULL;
+						} else if (obj_root->value->type == json_type_string) {
+							json_string_t *str = (json_string_t *)obj_root->value->payload;
+							if (ctx->max_action_data &&
+							    str->string_size > ctx->max_action_data) {
+								LOG_ERROR(ctx,
+								          "[parse_s2c_json] 'data' of %zu bytes is over the "
+								          "%zu byte limit.",
+								          str->string_size, ctx->max_action_data);
+								mtx_lock(&ctx->out_mtx);
+								ctx->stats.oversized_messages++;
+								mtx_unlock(&ctx->out_mtx);
+								res = NeuroSDK_MessageTooLarge;
+								goto parse_cleanup;
+							}
+							data = mem_strdup(&ctx->allocator, str->string);
+						} else {
+							LOG_ERROR(
+							    ctx,
+							    "[parse_s2c_json] 'data' field must be a string or null.");
+							res = NeuroSDK_InvalidJSON;
+							goto parse_cleanup;
+						}
+					}
+					obj_root = obj_root->next;
+				}
+
+				if (!id || !name) {
+					LOG_ERROR(ctx,
+					          "[parse_s2c_json] 'data' object for 'action' must contain "
+					          "'id' and 'name'.");
+					res = NeuroSDK_InvalidJSON;
+					goto parse_cleanup;
+				}
+
+				json_value_t *parsed_data = NULL;
+				if (data && ctx->parse_action_data) {
+					parsed_data = mem_json_parse(&ctx->allocator, data, strlen(data));
+					if (!parsed_data) {
+						LOG_WARN(ctx,
+						         "[parse_s2c_json] Data of action '%s' is not valid "
+						         "JSON, leaving it unparsed.",
+						         name);
+					}
+				}
+
+				msg->kind = NeuroSDK_MessageKind_Action;
+				msg->value.action = (neurosdk_message_action_t){
+				    .id = id,
+				    .name = name,
+				    .data = data,
+				    .parsed_data = (neurosdk_action_data_t *)parsed_data,
+				};
+				if (ctx->validate_actions) {
+					msg->value.action.validation_error =
+					    validate_action(ctx, &msg->value.action);
+				}
+				goto cleanup;
+			parse_cleanup:
+				if (id)
+					mem_free(id);
+				if (name)
+					mem_free(name);
+				if (data)
+					mem_free(data);
+				goto cleanup;
+			}
+			root_elem = root_elem->next;
+		}
+	} else {
+		LOG_ERROR(ctx, "[parse_s2c_json] Received an unhandled S2C command.");
+		unreachable();
+	}
+
+cleanup:
+	mem_free(root);
+	return res;
+}
+
+static void put_le(unsigned char *out, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		out[i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+static void put_be(unsigned char *out, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		out[i] = (unsigned char)(value >> (8 * (bytes - 1 - i)));
+	}
+}
+
+static uint64_t get_le(unsigned char const *in, int bytes) {
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++) {
+		value |= (uint64_t)in[i] << (8 * i);
+	}
+	return value;
+}
+
+static bool record_write(context_t *ctx, void const *data, size_t len) {
+	if (fwrite(data, 1, len, ctx->record_file) != len) {
+		LOG_ERROR(ctx, "Could not write to the recording, recording stopped.");
+		fclose(ctx->record_file);
+		ctx->record_file = NULL;
+		return false;
+	}
+	return true;
+}
+
+static bool record_header(context_t *ctx, bool outbound, size_t len) {
+	unsigned char header[RECORD_HEADER_SIZE] = {0};
+	put_le(header, now_us() - ctx->record_start_us, 8);
+	put_le(header + 8, len, 4);
+	header[12] = outbound;
+	return record_write(ctx, header, sizeof(header));
+}
+
+static void record_padding(context_t *ctx, size_t len) {
+	static unsigned char const padding[8] = {0};
+	record_write(ctx, padding, (8 - len % 8) % 8);
+}
+
+// Appends a record: time since the recording started in microseconds (u64),
+// payload length (u32), direction (u8, 0 inbound, 1 outbound), 3 zero bytes,
+// then the payload padded with zeros to a multiple of 8 bytes. Callers hold
+// `out_mtx`.
+static void record_frame(context_t *ctx,
+                         bool outbound,
+                         char const *data,
+                         size_t len) {
+	if (!ctx->record_file || len > UINT32_MAX) {
+		return;
+	}
+	if (record_header(ctx, outbound, len) && record_write(ctx, data, len)) {
+		record_padding(ctx, len);
+	}
+}
+
+// record_frame() for an outbound message of `len` bytes once serialized,
+// which is written a chunk at a time.
+static void record_message(context_t *ctx,
+                           pending_message_t const *msg,
+                           size_t len) {
+	if (!msg->value_len) {
+		record_frame(ctx, true, msg->str, msg->len);
+		return;
+	}
+	if (!ctx->record_file || len > UINT32_MAX ||
+	    !record_header(ctx, true, len)) {
+		return;
+	}
+	char chunk[WS_FRAGMENT_SIZE];
+	size_t pos = 0;
+	while (pos < msg->len) {
+		size_t n = serialize_chunk(msg, &pos, chunk, sizeof(chunk));
+		if (!record_write(ctx, chunk, n)) {
+			return;
+		}
+	}
+	record_padding(ctx, len);
+}
+
+static neurosdk_error_e recorder_open(context_t *ctx, char const *path) {
+	// The file header is the magic followed by the format version (u32) and
+	// 4 reserved bytes, keeping records 8-byte aligned.
+	unsigned char header[RECORD_HEADER_SIZE] = RECORD_MAGIC;
+	put_le(header + 8, 1, 4);
+	ctx->record_file = fopen(path, "wb");
+	if (!ctx->record_file ||
+	    fwrite(header, sizeof(header), 1, ctx->record_file) != 1) {
+		LOG_ERROR(ctx, "Could not create the recording '%s'.", path);
+		if (ctx->record_file) {
+			fclose(ctx->record_file);
+			ctx->record_file = NULL;
+		}
+		return NeuroSDK_FileError;
+	}
+	ctx->record_start_us = now_us();
+	return NeuroSDK_None;
+}
+
+static neurosdk_error_e replay_open(context_t *ctx,
+                                    char const *path,
+                                    bool max_speed) {
+	FILE *file = fopen(path, "rb");
+	long size = -1;
+	if (file && !fseek(file, 0, SEEK_END)) {
+		size = ftell(file);
+	}
+	replay_t *replay = mem_calloc(&ctx->allocator, 1, sizeof(*replay));
+	unsigned char *data = size >= RECORD_HEADER_SIZE
+	                          ? mem_alloc(&ctx->allocator, (size_t)size)
+	                          : NULL;
+	bool loaded = replay && data && !fseek(file, 0, SEEK_SET) &&
+	              fread(data, 1, (size_t)size, file) == (size_t)size &&
+	              !memcmp(data, RECORD_MAGIC, 8) && get_le(data + 8, 4) == 1;
+	if (file) {
+		fclose(file);
+	}
+	if (!loaded) {
+		LOG_ERROR(ctx, "Could not load the recording '%s'.", path);
+		mem_free(data);
+		mem_free(replay);
+		return replay ? NeuroSDK_FileError : NeuroSDK_OutOfMemory;
+	}
+	replay->data = data;
+	replay->size = (size_t)size;
+	replay->pos = RECORD_HEADER_SIZE;
+	replay->start_us = now_us();
+	replay->max_speed = max_speed;
+	ctx->replay = replay;
+	return NeuroSDK_None;
+}
+
+static void replay_close(context_t *ctx) {
+	if (ctx->replay) {
+		mem_free(ctx->replay->data);
+		mem_free(ctx->replay);
+		ctx->replay = NULL;
+	}
+}
+
+static void sleep_us(uint64_t us) {
+	struct timespec duration = {
+	    .tv_sec = (time_t)(us / 1000000),
+	    .tv_nsec = (long)(us % 1000000) * 1000,
+	};
+	thrd_sleep(&duration, NULL);
+}
+
+// Finds or adds the profile of the action `name`, -1 once the table is full.
+// Caller holds `out_mtx`.
+static int find_profile(context_t *ctx, char const *name) {
+	for (int i = 0; i < ctx->profiles_len; i++) {
+		if (!strcmp(ctx->profiles[i].name, name)) {
+			return i;
+		}
+	}
+	if (ctx->profiles_len == MAX_ACTION_PROFILES ||
+	    !grow_array(&ctx->allocator, (void **)&ctx->profiles,
+	                &ctx->profiles_cap, ctx->profiles_len,
+	                sizeof(action_profile_t))) {
+		return -1;
+	}
+	char *copy = mem_strdup(&ctx->allocator, name);
+	if (!copy) {
+		return -1;
+	}
+	ctx->profiles[ctx->profiles_len] = (action_profile_t){.name = copy};
+	return ctx->profiles_len++;
+}
+
+// Counts an action that will never get its result and drops it. Caller holds
+// `out_mtx`.
+static void orphan_action(context_t *ctx, int i) {
+	inflight_action_t *action = &ctx->inflight[i];
+	char const *name = "?";
+	if (action->profile >= 0) {
+		action_profile_t *profile = &ctx->profiles[action->profile];
+		profile->orphaned++;
+		name = profile->name;
+	}
+	LOG_WARN(ctx, "Action '%s' (%s) was never answered.", name, action->id);
+	mem_free(action->id);
+	ctx->inflight_len--;
+	memmove(action, action + 1,
+	        (size_t)(ctx->inflight_len - i) * sizeof(inflight_action_t));
+}
+
+// Remembers a received action until its result is sent. When too many go
+// unanswered the oldest is given up on.
+static void track_action(context_t *ctx,
+                         neurosdk_message_action_t const *action,
+                         uint64_t received_us) {
+	char *copy = mem_strdup(&ctx->allocator, action->id);
+	if (!copy) {
+		return;
+	}
+	mtx_lock(&ctx->out_mtx);
+	if (ctx->inflight_len == MAX_INFLIGHT_ACTIONS) {
+		orphan_action(ctx, 0);
+	}
+	if (grow_array(&ctx->allocator, (void **)&ctx->inflight, &ctx->inflight_cap,
+	               ctx->inflight_len, sizeof(inflight_action_t))) {
+		ctx->inflight[ctx->inflight_len++] = (inflight_action_t){
+		    copy, received_us, find_profile(ctx, action->name), false};
+		copy = NULL;
+	}
+	mtx_unlock(&ctx->out_mtx);
+	mem_free(copy);
+}
+
+// Records the response time of the action `id` once its result is queued,
+// up to `now`, when the result was sent.
+static void answer_action(context_t *ctx,
+                          char const *id,
+                          size_t id_len,
+                          uint64_t now) {
+	mtx_lock(&ctx->out_mtx);
+	int i = 0;
+	while (i < ctx->inflight_len &&
+	       (strncmp(ctx->inflight[i].id, id, id_len) ||
+	        ctx->inflight[i].id[id_len])) {
+		i++;
+	}
+	if (i == ctx->inflight_len) {
+		ctx->unmatched_results++;
+		mtx_unlock(&ctx->out_mtx);
+		return;
+	}
+
+	inflight_action_t *action = &ctx->inflight[i];
+	uint64_t latency_us = now - action->received_us;
+	latency_add(&ctx->response_latency, latency_us);
+	if (action->profile >= 0) {
+		action_profile_t *profile = &ctx->profiles[action->profile];
+		latency_add(&profile->latency, latency_us);
+		profile->results++;
+		if (ctx->slow_action_us && latency_us > ctx->slow_action_us &&
+		    !action->warned) {
+			profile->slow++;
+			LOG_WARN(ctx, "Action '%s' (%s) took %llu ms to answer.",
+			         profile->name, action->id,
+			         (unsigned long long)(latency_us / 1000));
+		}
+	}
+	mem_free(action->id);
+	ctx->inflight_len--;
+	memmove(action, action + 1,
+	        (size_t)(ctx->inflight_len - i) * sizeof(inflight_action_t));
+	mtx_unlock(&ctx->out_mtx);
+}
+
+// Warns once about each action waiting longer than `slow_action_us` for its
+// result.
+static void check_slow_actions(context_t *ctx) {
+	uint64_t now = now_us();
+	mtx_lock(&ctx->out_mtx);
+	for (int i = 0; i < ctx->inflight_len; i++) {
+		inflight_action_t *action = &ctx->inflight[i];
+		if (action->warned || now - action->received_us <= ctx->slow_action_us) {
+			continue;
+		}
+		action->warned = true;
+		char const *name = "?";
+		if (action->profile >= 0) {
+			ctx->profiles[action->profile].slow++;
+			name = ctx->profiles[action->profile].name;
+		}
+		LOG_WARN(ctx, "Action '%s' (%s) has waited %llu ms for its result.",
+		         name, action->id,
+		         (unsigned long long)((now - action->received_us) / 1000));
+	}
+	mtx_unlock(&ctx->out_mtx);
+}
+
+// Copies a received text frame for poll to parse later.
+static neurosdk_error_e queue_frame(context_t *ctx,
+                                    char const *buf,
+                                    size_t len) {
+	uint64_t sequence = ++ctx->frames_received;
+	if (ctx->frames_len == MAX_INBOUND_FRAMES) {
+		LOG_ERROR(ctx,
+		          "Inbound frame queue is full! (NeuroSDK_MessageQueueFull).");
+		return NeuroSDK_MessageQueueFull;
+	}
+	if (len > ctx->max_frame_size ||
+	    ctx->frames_bytes + len > ctx->max_inbound_bytes) {
+		LOG_ERROR(ctx,
+		          "Dropped an inbound frame of %zu bytes, %zu bytes are already "
+		          "queued (NeuroSDK_MessageTooLarge).",
+		          len, ctx->frames_bytes);
+		mtx_lock(&ctx->out_mtx);
+		ctx->stats.oversized_messages++;
+		mtx_unlock(&ctx->out_mtx);
+		return NeuroSDK_MessageTooLarge;
+	}
+	char *data = mem_alloc(&ctx->allocator, len + 1);
+	if (!data ||
+	    !grow_array(&ctx->allocator, (void **)&ctx->frames, &ctx->frames_cap,
+	                ctx->frames_len, sizeof(raw_frame_t))) {
+		LOG_ERROR(ctx, "Out of memory queueing an inbound frame.");
+		mem_free(data);
+		return NeuroSDK_OutOfMemory;
+	}
+	memcpy(data, buf, len);
+	data[len] = '\0';
+	ctx->frames[ctx->frames_len++] =
+	    (raw_frame_t){data, len, now_us(), sequence};
+	ctx->frames_bytes += len;
+
+	if (ctx->record_file) {
+		mtx_lock(&ctx->out_mtx);
+		record_frame(ctx, false, buf, len);
+		mtx_unlock(&ctx->out_mtx);
+	}
+	return NeuroSDK_None;
+}
+
+// Queues the inbound frames of the recording that are due, in place of a
+// socket read. Like one, it waits up to `timeout_ms` when nothing is due yet.
+// Outbound records are skipped; what the game sends now is not compared.
+static void replay_feed(context_t *ctx, int timeout_ms) {
+	replay_t *replay = ctx->replay;
+	uint64_t wait_until_us = now_us() + (uint64_t)timeout_ms * 1000;
+	bool fed = false;
+	while (replay->pos < replay->size && ctx->frames_len < MAX_INBOUND_FRAMES) {
+		unsigned char const *record = replay->data + replay->pos;
+		size_t left = replay->size - replay->pos - RECORD_HEADER_SIZE;
+		size_t len = replay->size - replay->pos >= RECORD_HEADER_SIZE
+		                 ? (size_t)get_le(record + 8, 4)
+		                 : SIZE_MAX;
+		if (len > left) {
+			LOG_WARN(ctx, "The recording is truncated, stopping the replay.");
+			replay->pos = replay->size;
+			break;
+		}
+		bool outbound = record[12];
+		// Wait for poll to make room rather than drop frames of the recording.
+		if (!outbound && ctx->frames_len &&
+		    ctx->frames_bytes + len > ctx->max_inbound_bytes) {
+			break;
+		}
+		if (!outbound && !replay->max_speed) {
+			uint64_t due_us = replay->start_us + get_le(record, 8);
+			uint64_t now = now_us();
+			if (due_us > now) {
+				if (fed || ctx->frames_len) {
+					break;
+				}
+				uint64_t until_us = due_us < wait_until_us ? due_us : wait_until_us;
+				if (until_us > now) {
+					sleep_us(until_us - now);
+				}
+				if (due_us > until_us) {
+					break;
+				}
+			}
+		}
+		neurosdk_error_e err = NeuroSDK_None;
+		if (!outbound) {
+			// A frame that cannot be queued is dropped, as one from the socket is.
+			err = queue_frame(ctx, (char const *)record + RECORD_HEADER_SIZE, len);
+			fed = fed || !err;
+		}
+		replay->pos += RECORD_HEADER_SIZE + (len + 7) / 8 * 8;
+		if (err) {
+			ctx->conn_err = err;
+			break;
+		}
+	}
+	if (replay->pos >= replay->size && !replay->finished) {
+		LOG_INFO(ctx, "Replay reached the end of the recording.");
+		replay->finished = true;
+	}
+}
+
+// Frees every message still waiting to be sent and returns their number.
+static int drop_pending(context_t *ctx) {
+	int dropped = 0;
+	mtx_lock(&ctx->out_mtx);
+	for (int lane = 0; lane < PendingLane_Count; lane++) {
+		pending_queue_t *queue = &ctx->pending[lane];
+		for (int i = 0; i < queue->size; i++) {
+			mem_free(queue->messages[i].str);
+			mem_free(queue->messages[i].context_text);
+		}
+		dropped += queue->size;
+		queue->size = 0;
+	}
+	if (ctx->stream.msg.str) {
+		mem_free(ctx->stream.msg.str);
+		ctx->stream = (outbound_stream_t){0};
+		dropped++;
+	}
+	ctx->pending_count = 0;
+	mtx_unlock(&ctx->out_mtx);
+	return dropped;
+}
+
+// Locks `out_mtx` on the paths every message takes, tracing the wait.
+static void lock_out_mtx(context_t *ctx) {
+	TRACE_BEGIN(ctx, "out_mtx wait");
+	mtx_lock(&ctx->out_mtx);
+	TRACE_END(ctx, "out_mtx wait");
+}
+
+// Appends the header of a masked client frame with a `len` byte payload to
+// the send buffer and returns where the payload goes, or 0 if out of memory.
+// mg_ws_send() always sets FIN and needs the payload built already, so frames
+// are written by hand.
+static size_t ws_frame_header(struct mg_connection *c,
+                              size_t len,
+                              int op,
+                              bool fin,
+                              OUT uint8_t mask[4]) {
+	uint8_t header[14];
+	size_t n = 2;
+	header[0] = (uint8_t)(op | (fin ? 128 : 0));
+	if (len < 126) {
+		header[1] = (uint8_t)len;
+	} else if (len < 65536) {
+		header[1] = 126;
+		put_be(header + 2, len, 2);
+		n = 4;
+	} else {
+		header[1] = 127;
+		put_be(header + 2, len, 8);
+		n = 10;
+	}
+	header[1] |= 128;
+	mg_random(mask, 4);
+	memcpy(header + n, mask, 4);
+	n += 4;
+	if (!mg_send(c, header, n)) {
+		return 0;
+	}
+	return c->send.len;
+}
+
+static void ws_mask(uint8_t *payload, size_t len, uint8_t const mask[4]) {
+	for (size_t i = 0; i < len; i++) {
+		payload[i] ^= mask[i & 3];
+	}
+}
+
+// Appends one masked client frame of `data` to the send buffer.
+static bool ws_send_fragment(struct mg_connection *c,
+                             char const *data,
+                             size_t len,
+                             int op,
+                             bool fin) {
+	uint8_t mask[4];
+	size_t start = ws_frame_header(c, len, op, fin, mask);
+	if (!start || !mg_send(c, data, len)) {
+		return false;
+	}
+	ws_mask(c->send.buf + start, len, mask);
+	return true;
+}
+
+// Appends `msg` as one text frame of `len` bytes, escaping its value straight
+// into the send buffer.
+static bool ws_send_message(struct mg_connection *c,
+                            pending_message_t const *msg,
+                            size_t len) {
+	uint8_t mask[4];
+	size_t start = ws_frame_header(c, len, WEBSOCKET_OP_TEXT, true, mask);
+	if (!start || mg_iobuf_add(&c->send, start, NULL, len) != len) {
+		return false;
+	}
+	size_t pos = 0;
+	serialize_chunk(msg, &pos, (char *)c->send.buf + start, len);
+	ws_mask(c->send.buf + start, len, mask);
+	return true;
+}
+
+// Tops the send buffer up to WS_STREAM_WINDOW with fragments of the streamed
+// message, serializing one fragment at a time. Returns true once it has been
+// sent completely. Caller holds `out_mtx`.
+static bool stream_pending(context_t *ctx, struct mg_connection *c) {
+	outbound_stream_t *stream = &ctx->stream;
+	char chunk[WS_FRAGMENT_SIZE];
+	while (stream->pos < stream->msg.len && c->send.len < WS_STREAM_WINDOW) {
+		int op = stream->pos ? WEBSOCKET_OP_CONTINUE : WEBSOCKET_OP_TEXT;
+		size_t pos = stream->pos;
+		size_t n = serialize_chunk(&stream->msg, &pos, chunk, sizeof(chunk));
+		if (!ws_send_fragment(c, chunk, n, op, pos == stream->msg.len)) {
+			// A partial frame cannot be taken back, the stream is broken.
+			LOG_ERROR(ctx, "Out of memory streaming a message, closing.");
+			c->is_closing = 1;
+			stream->pos = 0;
+			return false;
+		}
+		stream->pos = pos;
+	}
+	if (stream->pos < stream->msg.len) {
+		return false;
+	}
+	mem_free(stream->msg.str);
+	*stream = (outbound_stream_t){0};
+	return true;
+}
+
+// Sends as many pending messages as the rate limits allow, lane by lane. A
+// throttled message holds back the rest of its lane, so messages within a
+// lane never overtake each other. A message larger than WS_STREAM_WINDOW is
+// streamed over several calls and holds back every lane meanwhile. Without a
+// connection, when replaying, the messages are only recorded.
+static void flush_pending(context_t *ctx, struct mg_connection *c) {
+	uint64_t now_ms = mg_millis();
+	lock_out_mtx(ctx);
+	if (ctx->stream.msg.str && c && !stream_pending(ctx, c)) {
+		mtx_unlock(&ctx->out_mtx);
+		return;
+	}
+	for (int lane = 0; lane < PendingLane_Count && !ctx->stream.msg.str;
+	     lane++) {
+		pending_queue_t *queue = &ctx->pending[lane];
+		int sent = 0;
+		while (sent < queue->size && !ctx->stream.msg.str) {
+			pending_message_t *msg = &queue->messages[sent];
+			if (!bucket_take(&ctx->buckets[msg->kind], now_ms)) {
+				if (!msg->throttled) {
+					msg->throttled = true;
+					ctx->stats.throttled_messages++;
+				}
+				break;
+			}
+			LOG_DEBUG(ctx, "Sending message: %s", msg->str);
+			size_t len = serialized_length(msg);
+			record_message(ctx, msg, len);
+			if (c && len > WS_STREAM_WINDOW) {
+				TRACE_BEGIN(ctx, "stream message");
+				ctx->stream = (outbound_stream_t){*msg, 0};
+				ctx->stream.msg.context_text = NULL;  // Freed below
+				stream_pending(ctx, c);
+				TRACE_END(ctx, "stream message");
+			} else {
+				if (c && !ws_send_message(c, msg, len)) {
+					LOG_ERROR(ctx, "Out of memory sending a message, closing.");
+					c->is_closing = 1;
+				}
+				mem_free(msg->str);
+			}
+			mem_free(msg->context_text);
+			sent++;
+		}
+		if (sent) {
+			memmove(queue->messages, queue->messages + sent,
+			        (size_t)(queue->size - sent) * sizeof(pending_message_t));
+			queue->size -= sent;
+			ctx->pending_count -= sent;
+		}
+	}
+	TRACE_COUNTER(ctx, "pending messages", ctx->pending_count);
+	mtx_unlock(&ctx->out_mtx);
+}
+
+// Returns how long until the first throttled message may go out, or -1 if no
+// message is waiting on a rate limit.
+static int throttle_wait_ms(context_t *ctx) {
+	int wait = -1;
+	uint64_t now_ms = mg_millis();
+	mtx_lock(&ctx->out_mtx);
+	for (int lane = 0; lane < PendingLane_Count; lane++) {
+		pending_queue_t *queue = &ctx->pending[lane];
+		if (!queue->size || !queue->messages[0].throttled) {
+			continue;
+		}
+		token_bucket_t *bucket = &ctx->buckets[queue->messages[0].kind];
+		double tokens = bucket_tokens(bucket, now_ms);
+		int lane_wait =
+		    tokens >= 1.0 ? 0 : (int)((1.0 - tokens) / bucket->rate) + 1;
+		if (wait < 0 || lane_wait < wait) {
+			wait = lane_wait;
+		}
+	}
+	mtx_unlock(&ctx->out_mtx);
+	return wait;
+}
+
+// Wait at most `poll_ms` for I/O, but wake up in time to release the next
+// throttled message or to reconnect.
+static int io_timeout_ms(context_t *ctx) {
+	int wait = throttle_wait_ms(ctx);
+	if (ctx->reconnect_at_ms) {
+		uint64_t now_ms = mg_millis();
+		int until = ctx->reconnect_at_ms > now_ms
+		                ? (int)(ctx->reconnect_at_ms - now_ms)
+		                : 0;
+		if (wait < 0 || until < wait) {
+			wait = until;
+		}
+	}
+	if (wait >= 0 && wait < ctx->poll_ms) {
+		return wait;
+	}
+	return ctx->poll_ms;
+}
+
+static void heartbeat_fn_(void *arg) {
+	context_t *ctx = (context_t *)arg;
+	heartbeat_t *hb = &ctx->heartbeat;
+
+	if (!atomic_load_bool(&ctx->connected) || !ctx->conn) {
+		return;
+	}
+
+	// neurosdk_context_rtt() reads the counters from other threads.
+	mtx_lock(&ctx->out_mtx);
+	bool timed_out = hb->awaiting_pong && ++hb->missed >= hb->max_missed;
+	int missed = hb->missed;
+	if (!timed_out) {
+		hb->awaiting_pong = true;
+		hb->pings_sent++;
+	}
+	mtx_unlock(&ctx->out_mtx);
+
+	if (timed_out) {
+		LOG_WARN(ctx,
+		         "No pong received for %d heartbeats. Marking as disconnected.",
+		         missed);
+		atomic_store_bool(&ctx->connected, false);
+		atomic_store_bool(&ctx->peer_timed_out, true);
+		ctx->conn->is_closing = 1;
+		return;
+	}
+
+	uint64_t sent_us = now_us();
+	mg_ws_send(ctx->conn, &sent_us, sizeof(sent_us), WEBSOCKET_OP_PING);
+}
+
+static void heartbeat_pong(context_t *ctx, struct mg_ws_message *wm) {
+	heartbeat_t *hb = &ctx->heartbeat;
+	uint64_t sent_us;
+
+	if (wm->data.len != sizeof(sent_us)) {
+		return;
+	}
+	memcpy(&sent_us, wm->data.buf, sizeof(sent_us));
+	uint64_t rtt_us = now_us() - sent_us;
+
+	mtx_lock(&ctx->out_mtx);
+	latency_add(&hb->rtt, rtt_us);
+	hb->pongs_received++;
+	hb->missed = 0;
+	hb->awaiting_pong = false;
+	mtx_unlock(&ctx->out_mtx);
+}
+
+// Payload length announced by the websocket frame header at `buf`, false
+// while the header is incomplete.
+static bool ws_frame_length(uint8_t const *buf, size_t len, OUT uint64_t *n) {
+	if (len < 2) {
+		return false;
+	}
+	*n = buf[1] & 127;
+	if (*n < 126) {
+		return true;
+	}
+	size_t bytes = *n == 126 ? 2 : 8;  // Big endian extended length
+	if (len < 2 + bytes) {
+		return false;
+	}
+	*n = 0;
+	for (size_t i = 0; i < bytes; i++) {
+		*n = *n << 8 | buf[2 + i];
+	}
+	return true;
+}
+
+// Refuses a frame over `max_frame_size` before it is buffered. The rest of it
+// cannot be skipped without parsing it, so the connection is closed with 1009,
+// message too big, and whatever still arrives is discarded unread.
+static void refuse_frame(context_t *ctx, struct mg_connection *c, uint64_t n) {
+	LOG_ERROR(ctx,
+	          "Inbound frame of %llu bytes is over the %zu byte limit, closing "
+	          "the connection (NeuroSDK_MessageTooLarge).",
+	          (unsigned long long)n, ctx->max_frame_size);
+	mtx_lock(&ctx->out_mtx);
+	ctx->stats.oversized_messages++;
+	mtx_unlock(&ctx->out_mtx);
+	ctx->conn_err = NeuroSDK_MessageTooLarge;
+	mg_ws_send(c, "\x03\xf1", 2, WEBSOCKET_OP_CLOSE);
+	c->is_draining = 1;
+	c->pfn = NULL;  // Mongoose's websocket parser
+	c->recv.len = 0;
+}
+
+static void send_restored(context_t *ctx,
+                          struct mg_connection *c,
+                          char const *str,
+                          size_t len) {
+	mg_ws_send(c, str, len, WEBSOCKET_OP_TEXT);
+	mtx_lock(&ctx->out_mtx);
+	record_frame(ctx, true, str, len);
+	mtx_unlock(&ctx->out_mtx);
+}
+
+// Tells a new connection what the lost one was told: startup, if it was sent,
+// then every action still registered, in frames of at most
+// REGISTER_FRAME_SIZE bytes. Runs on MG_EV_WS_OPEN, ahead of anything queued.
+static void restore_session(context_t *ctx, struct mg_connection *c) {
+	static char const tail[] = "]}}";
+	char *head = NULL;
+	int head_len = aprintf(&ctx->allocator, &head,
+	                       "{\"command\":\"actions/register\",\"game\":\"%s\","
+	                       "\"data\":{\"actions\":[",
+	                       ctx->game_name);
+	bool ok = head_len >= 0;
+
+	mtx_lock(&ctx->registry_mtx);
+	if (ok && ctx->startup_sent) {
+		char *startup = NULL;
+		int len = aprintf(&ctx->allocator, &startup,
+		                  "{\"command\":\"startup\",\"game\":\"%s\"}",
+		                  ctx->game_name);
+		ok = len >= 0;
+		if (ok) {
+			send_restored(ctx, c, startup, (size_t)len);
+		}
+		mem_free(startup);
+	}
+	int first = 0;
+	while (ok && first < ctx->session_len) {
+		size_t size = (size_t)head_len + sizeof(tail) - 1;
+		int end = first;
+		while (end < ctx->session_len) {
+			size_t part = ctx->session[end].len + (end > first);
+			if (end > first && size + part > REGISTER_FRAME_SIZE) {
+				break;
+			}
+			size += part;
+			end++;
+		}
+		char *frame = mem_alloc(&ctx->allocator, size);
+		ok = frame != NULL;
+		if (ok) {
+			char *p = frame;
+			memcpy(p, head, (size_t)head_len);
+			p += head_len;
+			for (int i = first; i < end; i++) {
+				if (i > first) {
+					*p++ = ',';
+				}
+				memcpy(p, ctx->session[i].json, ctx->session[i].len);
+				p += ctx->session[i].len;
+			}
+			memcpy(p, tail, sizeof(tail) - 1);
+			send_restored(ctx, c, frame, size);
+		}
+		mem_free(frame);
+		first = end;
+	}
+	int restored = ctx->session_len;
+	mtx_unlock(&ctx->registry_mtx);
+	mem_free(head);
+
+	if (!ok) {
+		LOG_ERROR(ctx, "Out of memory restoring the session, closing.");
+		c->is_closing = 1;
+		return;
+	}
+	LOG_INFO(ctx, "Reconnected, registered %d actions again.", restored);
+}
+
+// Plans the next connection attempt. Each one waits twice as long as the
+// last, up to `reconnect_max_ms`.
+static void schedule_reconnect(context_t *ctx) {
+	ctx->reconnect_at_ms = mg_millis() + (uint64_t)ctx->reconnect_delay_ms;
+	LOG_INFO(ctx, "Reconnecting in %d ms.", ctx->reconnect_delay_ms);
+	ctx->reconnect_delay_ms = ctx->reconnect_delay_ms > ctx->reconnect_max_ms / 2
+	                              ? ctx->reconnect_max_ms
+	                              : ctx->reconnect_delay_ms * 2;
+}
+
+static void connection_fn_(struct mg_connection *c, int ev, void *ev_data) {
+	context_t *ctx = (context_t *)c->fn_data;
+
+	if (ev == MG_EV_CONNECT && ctx->tls) {
+		mg_tls_init(c, &ctx->tls_opts);
+		return;
+	}
+	if (ev == MG_EV_HTTP_MSG) {
+		mg_ws_upgrade(c, ev_data, NULL);
+		return;
+	}
+	if (ev == MG_EV_ERROR) {
+		LOG_ERROR(ctx, "Connection error: %s", (char *)ev_data);
+	}
+	if (ev == MG_EV_ERROR || ev == MG_EV_CLOSE) {
+		LOG_WARN(ctx,
+		         "Connection closed or error occurred (ev=%d). Marking "
+		         "as disconnected.",
+		         ev);
+		atomic_store_bool(&ctx->connected, false);
+		// A half sent message starts over on the next connection.
+		mtx_lock(&ctx->out_mtx);
+		ctx->stream.pos = 0;
+		mtx_unlock(&ctx->out_mtx);
+		if (ev == MG_EV_CLOSE && c == ctx->conn) {
+			ctx->conn = NULL;
+			atomic_store_size(&ctx->conn_id, 0);
+			if (ctx->reconnect_min_ms && !ctx->closing) {
+				schedule_reconnect(ctx);
+			}
+		}
+		return;
+	}
+	if (ev == MG_EV_WS_OPEN) {
+		LOG_INFO(ctx, "Websocket connection opened successfully.");
+		bool reconnected = ctx->was_open;
+		if (reconnected) {
+			restore_session(ctx, c);
+		}
+		ctx->was_open = true;
+		ctx->reconnect_delay_ms = ctx->reconnect_min_ms;
+		atomic_store_bool(&ctx->connected, true);
+		mtx_lock(&ctx->out_mtx);
+		ctx->heartbeat.missed = 0;
+		ctx->heartbeat.awaiting_pong = false;
+		ctx->stats.reconnects += reconnected;
+		mtx_unlock(&ctx->out_mtx);
+		return;
+	}
+	if (ev == MG_EV_WS_CTL) {
+		struct mg_ws_message *wm = (struct mg_ws_message *)ev_data;
+		if ((wm->flags & 15) == WEBSOCKET_OP_PONG) {
+			heartbeat_pong(ctx, wm);
+		}
+		return;
+	}
+	if (ev == MG_EV_READ && !c->pfn) {
+		c->recv.len = 0;
+		return;
+	}
+	if (ev == MG_EV_READ && c->is_websocket && !c->is_draining) {
+		// Complete frames were handled already, what is left is the start of
+		// the next one, after the fragments of its message received so far.
+		size_t ofs = (size_t)c->pfn_data;
+		uint64_t n = 0;
+		if (c->recv.len > ofs &&
+		    ws_frame_length(c->recv.buf + ofs, c->recv.len - ofs, &n) &&
+		    (n > ctx->max_frame_size || ofs > ctx->max_frame_size - n)) {
+			refuse_frame(ctx, c, ofs + n);
+		}
+		return;
+	}
+	if (ev == MG_EV_WS_MSG) {
+		struct mg_ws_message *wm = (struct mg_ws_message *)ev_data;
+		// Only copied here. Parsing waits for poll, which bounds that work.
+		neurosdk_error_e err = queue_frame(ctx, wm->data.buf, wm->data.len);
+		if (err) {
+			ctx->conn_err = err;
+		}
+	} else if (ev == MG_EV_WAKEUP || ev == MG_EV_POLL) {
+		if (atomic_load_bool(&ctx->connected)) {
+			flush_pending(ctx, c);
+		}
+	}
+}
+
+static bool tls_copy(allocator_t *a, char const *src, OUT struct mg_str *dst) {
+	if (!src) {
+		return true;
+	}
+	*dst = mg_str(mem_strdup(a, src));
+	return dst->buf != NULL;
+}
+
+static void tls_free(context_t *ctx) {
+	mem_free((void *)ctx->tls_opts.ca.buf);
+	mem_free((void *)ctx->tls_opts.cert.buf);
+	mem_free((void *)ctx->tls_opts.key.buf);
+	mem_free((void *)ctx->tls_opts.name.buf);
+	memset(&ctx->tls_opts, 0, sizeof(ctx->tls_opts));
+}
+
+// Keeps the certificates for MG_EV_CONNECT. Host names are only checked
+// against a CA, without one mongoose accepts any server certificate.
+static neurosdk_error_e tls_setup(context_t *ctx,
+                                  char const *url,
+                                  neurosdk_context_create_desc_t *desc) {
+	allocator_t *a = &ctx->allocator;
+	if ((desc->tls_cert != NULL) != (desc->tls_key != NULL)) {
+		LOG_ERROR(ctx, "TLS: 'tls_cert' and 'tls_key' must be set together.");
+		return NeuroSDK_ConnectionError;
+	}
+	if (!desc->tls_ca) {
+		LOG_WARN(ctx, "TLS: no 'tls_ca' set, the server is not verified.");
+	}
+	struct mg_str host = mg_url_host(url);
+	char *name = desc->tls_ca ? mem_alloc(a, host.len + 1) : NULL;
+	if (name) {
+		memcpy(name, host.buf, host.len);
+		name[host.len] = '\0';
+		ctx->tls_opts.name = mg_str_n(name, host.len);
+	}
+	if ((desc->tls_ca && !name) ||
+	    !tls_copy(a, desc->tls_ca, &ctx->tls_opts.ca) ||
+	    !tls_copy(a, desc->tls_cert, &ctx->tls_opts.cert) ||
+	    !tls_copy(a, desc->tls_key, &ctx->tls_opts.key)) {
+		tls_free(ctx);
+		return NeuroSDK_OutOfMemory;
+	}
+	ctx->tls = true;
+	return NeuroSDK_None;
+}
+
+// Interrupts a poll waiting on the socket so it flushes. Safe from any thread,
+// a no-op while reconnecting.
+static void wake_poll(context_t *ctx) {
+	unsigned long id = (unsigned long)atomic_load_size(&ctx->conn_id);
+	// Mongoose copies the payload even when it is empty, so it must not be NULL.
+	mg_wakeup(&ctx->mgr, id, "", 0);
+}
+
+// Starts the next connection attempt once it is due. Polling thread only.
+static void reconnect_if_due(context_t *ctx) {
+	if (!ctx->reconnect_at_ms || mg_millis() < ctx->reconnect_at_ms) {
+		return;
+	}
+	ctx->reconnect_at_ms = 0;
+	LOG_INFO(ctx, "Reconnecting to %s.", ctx->url);
+	ctx->conn =
+	    mg_ws_connect(&ctx->mgr, ctx->url, connection_fn_, (void *)ctx, NULL);
+	if (!ctx->conn) {
+		schedule_reconnect(ctx);
+		return;
+	}
+	atomic_store_size(&ctx->conn_id, ctx->conn->id);
+}
+
+static neurosdk_error_e connect_socket(context_t *context,
+                                       char const *url,
+                                       neurosdk_context_create_desc_t *desc) {
+	if (mg_url_is_ssl(url)) {
+		neurosdk_error_e err = tls_setup(context, url, desc);
+		if (err != NeuroSDK_None) {
+			return err;
+		}
+	}
+	if (desc->reconnect_min_ms > 0) {
+		context->url = mem_strdup(&context->allocator, url);
+		if (!context->url) {
+			return NeuroSDK_OutOfMemory;
+		}
+		context->reconnect_min_ms = desc->reconnect_min_ms;
+		context->reconnect_max_ms = desc->reconnect_max_ms > 0
+		                                ? desc->reconnect_max_ms
+		                                : DEFAULT_RECONNECT_MAX_MS;
+		if (context->reconnect_max_ms < context->reconnect_min_ms) {
+			context->reconnect_max_ms = context->reconnect_min_ms;
+		}
+		context->reconnect_delay_ms = context->reconnect_min_ms;
+	}
+	context->conn = mg_ws_connect(&context->mgr, url, connection_fn_,
+	                              (void *)context, NULL);
+	if (!context->conn) {
+		return NeuroSDK_ConnectionError;
+	}
+	atomic_store_size(&context->conn_id, context->conn->id);
+
+	context->heartbeat.max_missed = desc->heartbeat_max_missed > 0
+	                                    ? desc->heartbeat_max_missed
+	                                    : DEFAULT_HEARTBEAT_MAX_MISSED;
+	if (desc->heartbeat_interval_ms > 0) {
+		mg_timer_add(&context->mgr, (uint64_t)desc->heartbeat_interval_ms,
+		             MG_TIMER_REPEAT, heartbeat_fn_, context);
+	}
+
+	// A refused connection or handshake clears `conn` and fails right away.
+	for (int i = 0;
+	     i < 10 && context->conn && !atomic_load_bool(&context->connected);
+	     i++) {
+		mg_mgr_poll(&context->mgr, 300);
+	}
+	if (!atomic_load_bool(&context->connected)) {
+		return NeuroSDK_ConnectionError;
+	}
+	return NeuroSDK_None;
+}
+
+static neurosdk_error_e create_context(neurosdk_context_t *ctx,
+                                       neurosdk_context_create_desc_t *desc) {
+	neurosdk_error_e res = NeuroSDK_None;
+	allocator_t allocator = {.hooks = desc->allocator};
+	if (!allocator.hooks.alloc || !allocator.hooks.free) {
+		allocator.hooks = default_allocator.hooks;
+	}
+	context_t *context = mem_calloc(&allocator, 1, sizeof(context_t));
+	if (!context) {
+		return NeuroSDK_OutOfMemory;
+	}
+	// From here on the context accounts for itself, its own block included.
+	context->allocator = allocator;
+	((alloc_header_t *)context - 1)->owner = &context->allocator;
+	current_allocator = &context->allocator;
+
+	if (!desc->game_name || !strlen(desc->game_name)) {
+		mem_free(context);
+		return NeuroSDK_NoGameName;
+	}
+	context->game_name = escape_string(&context->allocator, desc->game_name);
+	context->poll_ms = desc->poll_ms;
+
+	context->user_data = desc->user_data;
+	context->callback_log = desc->callback_log;
+	if (!context->callback_log) {
+		context->callback_log = default_logger;
+	}
+
+	context->debug_prints = desc->flags & NeuroSDK_ContextCreateFlags_DebugPrints;
+	context->validation_layers =
+	    desc->flags & NeuroSDK_ContextCreateFlags_ValidationLayers;
+	context->coalesce_messages =
+	    desc->flags & NeuroSDK_ContextCreateFlags_CoalesceMessages;
+	context->priority_lanes =
+	    desc->flags & NeuroSDK_ContextCreateFlags_PriorityLanes;
+	context->coalesce_window_ms = desc->coalesce_window_ms > 0
+	                                  ? desc->coalesce_window_ms
+	                                  : DEFAULT_COALESCE_WINDOW_MS;
+	context->deduplicate_messages =
+	    desc->flags & NeuroSDK_ContextCreateFlags_DeduplicateMessages;
+	context->parse_action_data =
+	    desc->flags & NeuroSDK_ContextCreateFlags_ParseActionData;
+	context->validate_actions =
+	    desc->flags & (NeuroSDK_ContextCreateFlags_ValidateActions |
+	                   NeuroSDK_ContextCreateFlags_RejectInvalidActions);
+	context->reject_invalid_actions =
+	    desc->flags & NeuroSDK_ContextCreateFlags_RejectInvalidActions;
+	context->dedup_window_ms = desc->dedup_window_ms > 0
+	                               ? desc->dedup_window_ms
+	                               : DEFAULT_DEDUP_WINDOW_MS;
+
+	context->max_pending = desc->max_pending_messages > 0
+	                           ? desc->max_pending_messages
+	                           : DEFAULT_MAX_PENDING_MESSAGES;
+	context->max_frame_size =
+	    desc->max_frame_size ? desc->max_frame_size : MG_MAX_RECV_SIZE;
+	context->max_inbound_bytes = desc->max_inbound_bytes
+	                                 ? desc->max_inbound_bytes
+	                                 : DEFAULT_MAX_INBOUND_BYTES;
+	context->max_action_data = desc->max_action_data;
+	context->slow_action_us =
+	    desc->slow_action_ms > 0 ? (uint64_t)desc->slow_action_ms * 1000 : 0;
+	uint64_t now_ms = mg_millis();
+	for (int kind = 0; kind < NEUROSDK_MESSAGE_KIND_COUNT; kind++) {
+		neurosdk_rate_limit_t const *limit = &desc->rate_limits[kind];
+		if (limit->messages_per_second <= 0) {
+			continue;
+		}
+		token_bucket_t *bucket = &context->buckets[kind];
+		bucket->rate = limit->messages_per_second / 1000.0;
+		bucket->burst = limit->burst > 1 ? limit->burst : 1;
+		bucket->tokens = bucket->burst;
+		bucket->refill_ms = now_ms;
+	}
+
+	for (int lane = 0; lane < PendingLane_Count; lane++) {
+		pending_queue_t *queue = &context->pending[lane];
+		queue->cap = MESSAGE_QUEUE_SIZE;
+		queue->size = 0;
+		queue->messages = mem_alloc(&context->allocator,
+		                            queue->cap * sizeof(pending_message_t));
+		if (!queue->messages) {
+			res = NeuroSDK_OutOfMemory;
+			goto cleanup;
+		}
+	}
+
+	context->message_queue_cap = MESSAGE_QUEUE_SIZE;
+	context->message_queue_size = 0;
+	context->message_queue =
+	    mem_alloc(&context->allocator,
+	              context->message_queue_cap * sizeof(neurosdk_message_t));
+	if (!context->message_queue) {
+		res = NeuroSDK_OutOfMemory;
+		goto cleanup;
+	}
+
+	char *fetched_url = (char *)desc->url;
+	if (!fetched_url) {
+		fetched_url = getenv(ENVIRONMENT_VARIABLE_NAME);
+	}
+	if (!fetched_url && !desc->replay_path) {
+		res = NeuroSDK_NoURL;
+		goto cleanup;
+	}
+
+	mg_mgr_init(&context->mgr);
+	// The level is global and read by every manager's poll, possibly on other
+	// threads, so it is only written the first time.
+	if (mg_log_level != MG_LL_NONE) {
+		mg_log_set(MG_LL_NONE);
+	}
+	mg_wakeup_init(&context->mgr);
+
+	if (mtx_init(&context->out_mtx, mtx_plain) != thrd_success) {
+		res = NeuroSDK_Internal;
+		goto cleanup2;
+	}
+	if (mtx_init(&context->registry_mtx, mtx_plain) != thrd_success) {
+		res = NeuroSDK_Internal;
+		goto cleanup3;
+	}
+
+	context->poll_thread = current_thread_id();
+	if (desc->flags & NeuroSDK_ContextCreateFlags_Trace) {
+		res = tracer_create(context, desc->trace_path);
+		if (res != NeuroSDK_None) {
+			goto cleanup4;
+		}
+	}
+	if (desc->record_path) {
+		res = recorder_open(context, desc->record_path);
+		if (res != NeuroSDK_None) {
+			goto cleanup4;
+		}
+	}
+	if (desc->replay_path) {
+		res = replay_open(context, desc->replay_path,
+		                  desc->flags & NeuroSDK_ContextCreateFlags_ReplayMaxSpeed);
+		if (res != NeuroSDK_None) {
+			goto cleanup4;
+		}
+		atomic_store_bool(&context->connected, true);
+	} else {
+		res = connect_socket(context, fetched_url, desc);
+		if (res != NeuroSDK_None) {
+			goto cleanup4;
+		}
+	}
+	if (desc->worker_threads > 0) {
+		res = pool_start(context, desc->worker_threads);
+		if (res != NeuroSDK_None) {
+			goto cleanup4;
+		}
+	}
+
+	(*ctx) = (neurosdk_context_t)context;
+	return res;
+
+cleanup4:
+	if (context->record_file) {
+		fclose(context->record_file);
+	}
+	replay_close(context);
+	tracer_destroy(context);
+	tls_free(context);
+	mem_free(context->url);
+	mtx_destroy(&context->registry_mtx);
+cleanup3:
+	mtx_destroy(&context->out_mtx);
+cleanup2:
+	mg_mgr_free(&context->mgr);
+	for (int i = 0; i < context->frames_len; i++) {
+		mem_free(context->frames[i].data);
+	}
+	mem_free(context->frames);
+cleanup:
+	for (int lane = 0; lane < PendingLane_Count; lane++) {
+		mem_free(context->pending[lane].messages);
+	}
+	mem_free(context->message_queue);
+	mem_free((void *)context->game_name);
+	mem_free(context);
+	return res;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_create(neurosdk_context_t *ctx,
+                        neurosdk_context_create_desc_t *desc) {
+	// Creating points mongoose at the new context's allocator, which must not
+	// be left behind if the context is freed again.
+	allocator_t *previous = current_allocator;
+	neurosdk_error_e res = create_context(ctx, desc);
+	current_allocator = previous;
+	return res;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_destroy(neurosdk_context_t *ctx) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+
+	LOG_DEBUG(context, "Destroying NeuroSDK context.");
+
+	// Workers send results through the manager, so they stop first.
+	allocator_t *previous = current_allocator;
+	if (previous == &context->allocator) {
+		previous = NULL;
+	}
+	current_allocator = &context->allocator;
+	pool_stop(context);
+
+	// mg_mgr_free() runs a last poll, which may still flush.
+	context->closing = true;
+	mg_mgr_free(&context->mgr);
+	int dropped = drop_pending(context);
+	if (dropped) {
+		LOG_WARN(context, "Dropped %d unsent messages.", dropped);
+	}
+	if (context->record_file) {
+		fclose(context->record_file);
+	}
+	replay_close(context);
+	if (context->tracer && context->tracer->path) {
+		tracer_dump(context, context->tracer->path);
+	}
+	tracer_destroy(context);
+	tls_free(context);
+	mem_free(context->url);
+	mtx_destroy(&context->out_mtx);
+	for (int i = 0; i < context->frames_len; i++) {
+		mem_free(context->frames[i].data);
+	}
+	mem_free(context->frames);
+	if (context->inflight_len) {
+		LOG_WARN(context, "%d actions were never answered.",
+		         context->inflight_len);
+	}
+	for (int i = 0; i < context->inflight_len; i++) {
+		mem_free(context->inflight[i].id);
+	}
+	mem_free(context->inflight);
+	for (int i = 0; i < context->profiles_len; i++) {
+		mem_free(context->profiles[i].name);
+	}
+	mem_free(context->profiles);
+
+	for (int lane = 0; lane < PendingLane_Count; lane++) {
+		mem_free(context->pending[lane].messages);
+	}
+	for (int i = 0; i < context->message_queue_size; i++) {
+		neurosdk_message_destroy(&context->message_queue[i]);
+	}
+	for (int i = 0; i < context->schemas_len; i++) {
+		action_schema_free(&context->schemas[i]);
+	}
+	mem_free(context->schemas);
+	for (int i = 0; i < context->handlers_len; i++) {
+		mem_free(context->handlers[i].name);
+	}
+	mem_free(context->handlers);
+	session_clear(context);
+	mem_free(context->session);
+	mtx_destroy(&context->registry_mtx);
+	mem_free(context->message_queue);
+	mem_free((void *)context->game_name);
+	mem_free(context);
+	current_allocator = previous;
+
+	*ctx = NULL;
+	return NeuroSDK_None;
+}
+
+// Whether every queued message has been handed to the socket and written.
+static bool outbound_drained(context_t *ctx) {
+	mtx_lock(&ctx->out_mtx);
+	bool drained = ctx->pending_count == 0 && !ctx->stream.msg.str;
+	mtx_unlock(&ctx->out_mtx);
+	if (drained && !ctx->replay && atomic_load_bool(&ctx->connected)) {
+		drained = ctx->conn->send.len == 0;
+	}
+	return drained;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_shutdown(neurosdk_context_t *ctx,
+                          int timeout_ms,
+                          OUT int *dropped) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+
+	LOG_DEBUG(context, "Shutting down NeuroSDK context.");
+
+	// Destroying sees the context's own allocator, so the caller's is restored
+	// here instead.
+	allocator_t *previous = current_allocator;
+	if (previous == &context->allocator) {
+		previous = NULL;
+	}
+	current_allocator = &context->allocator;
+	// The workers drain their queues before they exit, queueing the results.
+	int lost = pool_stop(context);
+	uint64_t deadline_ms =
+	    mg_millis() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+
+	while (!outbound_drained(context) && mg_millis() < deadline_ms) {
+		int wait_ms = (int)(deadline_ms - mg_millis());
+		if (context->replay) {
+			flush_pending(context, NULL);
+			sleep_us(1000);
+		} else if (!atomic_load_bool(&context->connected)) {
+			break;
+		} else {
+			mg_mgr_poll(&context->mgr, wait_ms < 10 ? wait_ms : 10);
+		}
+	}
+
+	context->closing = true;
+	if (!context->replay && atomic_load_bool(&context->connected)) {
+		// 1000, normal closure. Mongoose closes the socket once it is sent.
+		mg_ws_send(context->conn, "\x03\xe8", 2, WEBSOCKET_OP_CLOSE);
+		context->conn->is_draining = 1;
+		while (atomic_load_bool(&context->connected) &&
+		       mg_millis() < deadline_ms) {
+			int wait_ms = (int)(deadline_ms - mg_millis());
+			mg_mgr_poll(&context->mgr, wait_ms < 10 ? wait_ms : 10);
+		}
+	}
+
+	lost += drop_pending(context);
+	if (lost) {
+		LOG_WARN(context, "Shutdown dropped %d messages.", lost);
+	}
+	if (dropped) {
+		*dropped = lost;
+	}
+	neurosdk_error_e err = neurosdk_context_destroy(ctx);
+	current_allocator = previous;
+	return err;
+}
+
+static void make_array(allocator_t *a,
+                       char **strings,
+                       int count,
+                       OUT char **json_str) {
+	int total = 2;  // '[' and ']'
+	for (int i = 0; i < count; i++) {
+		// "..." => 2 quotes + length
+		total += 2 + (int)strlen(strings[i]);
+		if (i < count - 1)
+			total++;  // comma
+	}
+	*json_str = mem_alloc(a, (size_t)total + 1);
+	if (!*json_str)
+		return;
+
+	char *dst = *json_str;
+	*dst++ = '[';
+	for (int i = 0; i < count; i++) {
+		*dst++ = '"';
+		strcpy(dst, strings[i]);
+		dst += strlen(strings[i]);
+		*dst++ = '"';
+		if (i < count - 1) {
+			*dst++ = ',';
+		}
+	}
+	*dst++ = ']';
+	*dst = '\0';
+}
+
+static int build_context_frame(context_t *ctx,
+                               char const *escaped_message,
+                               bool silent,
+                               OUT char **str) {
+	return aprintf(&ctx->allocator, str,
+	               "{\"command\":\"context\",\"game\":\"%s\",\"data\":{"
+	               "\"message\":\"%s\",\"silent\":%s}}",
+	               ctx->game_name, escaped_message, silent ? "true" : "false");
+}
+
+// Folds a freshly built message into the unsent ones. A newer actions/force
+// supersedes any queued one, and a silent context message is appended to a
+// silent context message at the tail of its lane if that one is still within
+// the coalescing window. Returns true if `*str` was merged into the queue, in
+// which case ownership of `*str` and `*context_text` was taken. Must be called
+// with `out_mtx` held.
+static bool coalesce_pending(context_t *ctx,
+                             neurosdk_message_kind_e kind,
+                             char **str,
+                             char **context_text,
+                             uint64_t now_ms) {
+	pending_queue_t *queue = &ctx->pending[pending_lane(ctx, kind)];
+
+	if (kind == NeuroSDK_MessageKind_ActionsForce) {
+		for (int i = 0; i < queue->size; i++) {
+			pending_message_t *msg = &queue->messages[i];
+			if (msg->kind != NeuroSDK_MessageKind_ActionsForce) {
+				continue;
+			}
+			mem_free(msg->str);
+			mem_free(msg->context_text);
+			memmove(msg, msg + 1,
+			        (size_t)(queue->size - i - 1) * sizeof(pending_message_t));
+			queue->size--;
+			ctx->pending_count--;
+			ctx->stats.coalesced_forces++;
+			break;
+		}
+		return false;
+	}
+
+	if (kind != NeuroSDK_MessageKind_Context || !*context_text || !queue->size) {
+		return false;
+	}
+	pending_message_t *tail = &queue->messages[queue->size - 1];
+	if (tail->kind != NeuroSDK_MessageKind_Context || !tail->context_text ||
+	    now_ms - tail->queued_ms > (uint64_t)ctx->coalesce_window_ms) {
+		return false;
+	}
+
+	char *merged_text = NULL, *merged = NULL;
+	if (aprintf(&ctx->allocator, &merged_text, "%s\\n%s",
+	            tail->context_text, *context_text) < 0) {
+		return false;
+	}
+	int merged_len = build_context_frame(ctx, merged_text, true, &merged);
+	if (merged_len < 0) {
+		mem_free(merged_text);
+		return false;
+	}
+	mem_free(tail->str);
+	mem_free(tail->context_text);
+	tail->str = merged;
+	tail->len = (size_t)merged_len;
+	tail->context_text = merged_text;
+	mem_free(*str);
+	mem_free(*context_text);
+	*str = NULL;
+	*context_text = NULL;
+	ctx->stats.coalesced_contexts++;
+	return true;
+}
+
+// Fingerprints an actions/force message before it is serialized. Returns
+// false for messages that will be rejected by validation anyway.
+static bool force_hash(neurosdk_message_actions_force_t const *m,
+                       OUT uint64_t *hash) {
+	if (!m->query || !m->action_names || m->action_names_len <= 0) {
+		return false;
+	}
+	uint8_t flags[2] = {2, (uint8_t)m->priority};
+	if (m->ephemeral_context == true || m->ephemeral_context == false) {
+		flags[0] = m->ephemeral_context;
+	}
+	uint64_t h = NeuroSDK_MessageKind_ActionsForce;
+	h = hash_string(m->state, h);
+	h = hash_string(m->query, h);
+	for (int i = 0; i < m->action_names_len; i++) {
+		h = hash_string(m->action_names[i], h);
+	}
+	*hash = hash_bytes(flags, sizeof(flags), h);
+	return true;
+}
+
+// Returns true (and counts the hit) if a message with the same fingerprint was
+// the last one of its kind and went out within the dedup window.
+static bool dedup_hit(context_t *ctx,
+                      neurosdk_message_kind_e kind,
+                      uint64_t hash) {
+	dedup_entry_t *entry = &ctx->dedup[kind];
+	uint64_t now_ms = mg_millis();
+
+	mtx_lock(&ctx->out_mtx);
+	bool hit = entry->valid && entry->hash == hash &&
+	           now_ms - entry->sent_ms < (uint64_t)ctx->dedup_window_ms;
+	if (hit) {
+		ctx->stats.dedup_hits++;
+	}
+	mtx_unlock(&ctx->out_mtx);
+
+	if (hit) {
+		LOG_DEBUG(ctx, "Skipping duplicate message of kind %d.", kind);
+	}
+	return hit;
+}
+
+// While reconnecting, messages wait in the queue for the next connection.
+static neurosdk_error_e check_sendable(context_t *context) {
+	if (!atomic_load_bool(&context->connected) && !context->reconnect_min_ms) {
+		LOG_ERROR(context,
+		          "neurosdk_context_send: cannot send message because we are "
+		          "not connected.");
+		return NeuroSDK_ConnectionError;
+	}
+	return NeuroSDK_None;
+}
+
+// Adds a built message to its pending lane without driving the connection.
+// Takes ownership of `str` and `context_text`. If `dedup` is set, `hash`
+// becomes the fingerprint of the last message of this kind.
+static neurosdk_error_e queue_message(context_t *context,
+                                      neurosdk_message_kind_e kind,
+                                      char *str,
+                                      int bytes,
+                                      size_t value_at,
+                                      size_t value_len,
+                                      char *context_text,
+                                      bool dedup,
+                                      uint64_t hash) {
+	if (!str || bytes <= 0) {
+		LOG_ERROR(context,
+		          "Failed to build JSON message for sending (aprintf error).");
+		mem_free(str);
+		mem_free(context_text);
+		return NeuroSDK_InvalidMessage;
+	}
 
-				if (!id || !name) {
-					LOG_ERROR(ctx,
-					          "[parse_s2c_json] 'data' object for 'action' must contain "
-					          "'id' and 'name'.");
-					res = NeuroSDK_InvalidJSON;
-					goto parse_cleanup;
-				}
+	LOG_DEBUG(context, "Queueing message for send: %s (%d bytes)", str, bytes);
 
-				msg->kind = NeuroSDK_MessageKind_Action;
-				msg->value.action = (neurosdk_message_action_t){
-				    .id = id,
-				    .name = name,
-				    .data = data,
-				};
-				goto cleanup;
-			parse_cleanup:
-				if (id)
-					free(id);
-				if (name)
-					free(name);
-				if (data)
-					free(data);
-				goto cleanup;
-			}
-			root_elem = root_elem->next;
-		}
+	uint64_t now_ms = mg_millis();
+	pending_queue_t *queue = &context->pending[pending_lane(context, kind)];
+	lock_out_mtx(context);
+	// Every register frame had its slot reserved by register_actions().
+	bool reserved = kind == NeuroSDK_MessageKind_ActionsRegister &&
+	                context->pending_reserved > 0;
+	if (context->coalesce_messages &&
+	    coalesce_pending(context, kind, &str, &context_text, now_ms)) {
+		LOG_DEBUG(context, "Coalesced message into an unsent one.");
+	} else if (!reserved && context->pending_count + context->pending_reserved >=
+	                            context->max_pending) {
+		mtx_unlock(&context->out_mtx);
+		LOG_ERROR(context, "Pending messages buffer is full.");
+		mem_free(str);
+		mem_free(context_text);
+		return NeuroSDK_MessageQueueFull;
+	} else if (!pending_reserve(&context->allocator, queue)) {
+		mtx_unlock(&context->out_mtx);
+		LOG_ERROR(context, "Out of memory growing pending messages buffer.");
+		mem_free(str);
+		mem_free(context_text);
+		return NeuroSDK_OutOfMemory;
 	} else {
-		LOG_ERROR(ctx, "[parse_s2c_json] Received an unhandled S2C command.");
-		unreachable();
+		queue->messages[queue->size++] = (pending_message_t){
+		    .str = str,
+		    .len = (size_t)bytes,
+		    .value_at = value_at,
+		    .value_len = value_len,
+		    .kind = kind,
+		    .queued_ms = now_ms,
+		    .context_text = context_text,
+		};
+		context->pending_count++;
+		context->pending_reserved -= reserved;
 	}
-
-cleanup:
-	free(root);
-	return res;
+	if (dedup) {
+		context->dedup[kind] = (dedup_entry_t){
+		    .hash = hash,
+		    .sent_ms = now_ms,
+		    .valid = true,
+		};
+	}
+	mtx_unlock(&context->out_mtx);
+	return NeuroSDK_None;
 }
 
-static void connection_fn_(struct mg_connection *c, int ev, void *ev_data) {
-	context_t *ctx = (context_t *)c->fn_data;
-
-	ctx->conn_err = NeuroSDK_None;
+static neurosdk_error_e enqueue_message(context_t *context,
+                                        neurosdk_message_kind_e kind,
+                                        char *str,
+                                        int bytes,
+                                        size_t value_at,
+                                        size_t value_len,
+                                        char *context_text,
+                                        bool dedup,
+                                        uint64_t hash) {
+	TRACE_BEGIN(context, "enqueue_message");
+	neurosdk_error_e err = queue_message(context, kind, str, bytes, value_at,
+	                                     value_len, context_text, dedup, hash);
+	if (err) {
+		TRACE_END(context, "enqueue_message");
+		return err;
+	}
 
-	if (ev == MG_EV_HTTP_MSG) {
-		mg_ws_upgrade(c, ev_data, NULL);
-		return;
+	bool poll_thread =
+	    atomic_load_size(&context->poll_thread) == current_thread_id();
+	if (context->replay) {
+		if (poll_thread) {
+			flush_pending(context, NULL);
+		}
+		TRACE_END(context, "enqueue_message");
+		return NeuroSDK_None;
 	}
-	if (ev == MG_EV_ERROR || ev == MG_EV_CLOSE) {
-		LOG_WARN(ctx,
-		         "Connection closed or error occurred (ev=%d). Marking "
-		         "as disconnected.",
-		         ev);
-		ctx->connected = false;
-		return;
+
+	wake_poll(context);
+
+	// Only the polling thread may drive mongoose. Other threads leave the
+	// flush to it, the wakeup interrupts a poll that is already waiting.
+	if (poll_thread) {
+		current_allocator = &context->allocator;
+		mg_mgr_poll(&context->mgr, io_timeout_ms(context));
+		mg_mgr_poll(&context->mgr, io_timeout_ms(context));
 	}
-	if (ev == MG_EV_WS_OPEN) {
-		LOG_INFO(ctx, "Websocket connection opened successfully.");
-		ctx->connected = true;
-		return;
+
+	TRACE_END(context, "enqueue_message");
+	return NeuroSDK_None;
+}
+
+static neurosdk_error_e send_context(context_t *context,
+                                     char const *message,
+                                     size_t message_len,
+                                     bool silent) {
+	uint64_t hash = 0;
+	bool dedup = context->deduplicate_messages;
+	if (dedup) {
+		uint8_t silent_byte = silent;
+		hash = hash_bytes(message, message_len, NeuroSDK_MessageKind_Context);
+		hash = hash_bytes(&silent_byte, sizeof(silent_byte), hash);
+		if (dedup_hit(context, NeuroSDK_MessageKind_Context, hash)) {
+			return NeuroSDK_None;
+		}
 	}
-	if (ev == MG_EV_WS_MSG) {
-		struct mg_ws_message *wm = (struct mg_ws_message *)ev_data;
-		for (size_t i = 0; i < wm->data.len; i++) {
-			if (!isprint((unsigned char)wm->data.buf[i]) &&
-			    !isspace((unsigned char)wm->data.buf[i])) {
-				LOG_ERROR(ctx, "Received binary (non-plaintext) data from server!");
-				ctx->conn_err = NeuroSDK_ReceivedBinary;
-				return;
-			}
+
+	char *str = NULL, *context_text = NULL;
+	size_t value_at = 0, value_len = 0;
+	int bytes;
+	if (context->coalesce_messages && silent) {
+		// Keep the escaped text around so pending frames can be merged.
+		context_text = escape_string_n(&context->allocator, message, message_len);
+		if (!context_text) {
+			LOG_ERROR(context, "Out of memory while escaping 'message' for context.");
+			return NeuroSDK_OutOfMemory;
 		}
-		neurosdk_message_t msg;
-		LOG_DEBUG(ctx, "Received message: %.*s", (int)wm->data.len, wm->data.buf);
-		ctx->conn_err = parse_s2c_json(ctx, &msg, wm->data.buf, (int)wm->data.len);
-		if (!ctx->conn_err) {
-			if (ctx->message_queue_size == ctx->message_queue_cap) {
-				LOG_ERROR(ctx, "Message queue is full! (NeuroSDK_MessageQueueFull).");
-				ctx->conn_err = NeuroSDK_MessageQueueFull;
-				return;
-			}
-			ctx->message_queue[ctx->message_queue_size++] = msg;
+		bytes = build_context_frame(context, context_text, silent, &str);
+	} else {
+		char *head = NULL;
+		if (aprintf(&context->allocator, &head,
+		            "{\"command\":\"context\",\"game\":\"%s\",\"data\":{"
+		            "\"message\":\"",
+		            context->game_name) < 0) {
+			LOG_ERROR(context, "Out of memory while building context message.");
+			return NeuroSDK_OutOfMemory;
 		}
+		char const *tail =
+		    silent ? "\",\"silent\":true}}" : "\",\"silent\":false}}";
+		bytes = join_raw(&context->allocator, head, message, message_len, tail,
+		                 &str, &value_at);
+		value_len = message_len;
+		mem_free(head);
+	}
+	return enqueue_message(context, NeuroSDK_MessageKind_Context, str, bytes,
+	                       value_at, value_len, context_text, dedup, hash);
+}
 
-		c->recv.len = 0;
-	} else if (ev == MG_EV_WAKEUP) {
-		mtx_lock(&ctx->out_mtx);
-		for (int i = 0; i < ctx->pending_messages_size; i++) {
-			char *msg = ctx->pending_messages[i];
-			LOG_DEBUG(ctx, "Sending message: %s", msg);
-			mg_ws_send(c, msg, strlen(msg), WEBSOCKET_OP_TEXT);
-			free(msg);
+static int build_action_result(context_t *context,
+                               char const *id,
+                               size_t id_len,
+                               bool success,
+                               char const *message,
+                               size_t message_len,
+                               OUT char **str) {
+	char *message_json = mem_strdup(&context->allocator, "null");
+	if (!message_json) {
+		LOG_ERROR(context, "Out of memory duplicating 'null' string.");
+		return -1;
+	}
+	if (message) {
+		mem_free(message_json);
+		char *tmp = escape_string_n(&context->allocator, message, message_len);
+		if (!tmp) {
+			LOG_ERROR(context, "Out of memory escaping 'action_result.message'.");
+			return -1;
 		}
-		ctx->pending_messages_size = 0;
-		mtx_unlock(&ctx->out_mtx);
+		if (aprintf(&context->allocator, &message_json, "\"%s\"", tmp) < 0) {
+			LOG_ERROR(context, "Out of memory building 'action_result.message'.");
+			mem_free(tmp);
+			return -1;
+		}
+		mem_free(tmp);
 	}
+
+	int bytes =
+	    aprintf(&context->allocator, str,
+	            "{\"command\":\"action:result\",\"game\":\"%s\",\"data\":{"
+	            "\"id\":\"%.*s\",\"success\":%s,\"message\":%s}}",
+	            context->game_name, (int)id_len, id, success ? "true" : "false",
+	            message_json);
+	mem_free(message_json);
+	return bytes;
 }
 
-NEUROSDK_EXPORT neurosdk_error_e
-neurosdk_context_create(neurosdk_context_t *ctx,
-                        neurosdk_context_create_desc_t *desc) {
-	neurosdk_error_e res = NeuroSDK_None;
-	context_t *context = malloc(sizeof(context_t));
-	if (!context) {
+static neurosdk_error_e send_action_result(context_t *context,
+                                           char const *id,
+                                           size_t id_len,
+                                           bool success,
+                                           char const *message,
+                                           size_t message_len) {
+	uint64_t sent_us = now_us();
+	char *str = NULL;
+	int bytes = build_action_result(context, id, id_len, success, message,
+	                                message_len, &str);
+	if (bytes < 0) {
 		return NeuroSDK_OutOfMemory;
 	}
-	memset(context, 0, sizeof(*context));
+	neurosdk_error_e err =
+	    enqueue_message(context, NeuroSDK_MessageKind_ActionResult, str, bytes,
+	                    0, 0, NULL, false, 0);
+	if (!err) {
+		answer_action(context, id, id_len, sent_us);
+	}
+	return err;
+}
 
-	if (!desc->game_name || !strlen(desc->game_name)) {
-		free(context);
-		return NeuroSDK_NoGameName;
+static neurosdk_error_e parse_frame(context_t *ctx, raw_frame_t const *frame) {
+	for (size_t i = 0; i < frame->len; i++) {
+		if (!isprint((unsigned char)frame->data[i]) &&
+		    !isspace((unsigned char)frame->data[i])) {
+			LOG_ERROR(ctx, "Received binary (non-plaintext) data from server!");
+			return NeuroSDK_ReceivedBinary;
+		}
 	}
-	context->game_name = escape_string(desc->game_name);
-	context->poll_ms = desc->poll_ms;
+	neurosdk_message_t msg;
+	LOG_DEBUG(ctx, "Received message: %.*s", (int)frame->len, frame->data);
+	TRACE_BEGIN(ctx, "parse_s2c_json");
+	neurosdk_error_e err =
+	    parse_s2c_json(ctx, &msg, frame->data, (int)frame->len);
+	TRACE_END(ctx, "parse_s2c_json");
+	if (!err) {
+		msg.received_us = frame->received_us;
+		msg.sequence = frame->sequence;
+		if (msg.kind == NeuroSDK_MessageKind_Action) {
+			track_action(ctx, &msg.value.action, frame->received_us);
+		}
+		ctx->message_queue[ctx->message_queue_size++] = msg;
+	}
+	return err;
+}
 
-	context->user_data = desc->user_data;
-	context->callback_log = desc->callback_log;
-	if (!context->callback_log) {
-		context->callback_log = default_logger;
+// Parses received frames, oldest first, until the message queue is full, the
+// frames run out or a budget is spent. Budgets of 0 are unlimited. Stops at
+// the first frame that fails to parse and drops it.
+static neurosdk_error_e parse_frames(context_t *ctx,
+                                     int max_messages,
+                                     uint64_t deadline_us) {
+	neurosdk_error_e err = NeuroSDK_None;
+	int used = 0;
+	while (used < ctx->frames_len &&
+	       ctx->message_queue_size < ctx->message_queue_cap) {
+		if (max_messages > 0 && used == max_messages) {
+			break;
+		}
+		if (deadline_us && used > 0 && now_us() >= deadline_us) {
+			break;
+		}
+		raw_frame_t *frame = &ctx->frames[used++];
+		err = parse_frame(ctx, frame);
+		ctx->frames_bytes -= frame->len;
+		mem_free(frame->data);
+		if (err) {
+			break;
+		}
+	}
+	// `frames` is still NULL before the first frame arrives.
+	if (used) {
+		ctx->frames_len -= used;
+		memmove(ctx->frames, ctx->frames + used,
+		        (size_t)ctx->frames_len * sizeof(raw_frame_t));
 	}
+	return err;
+}
 
-	context->debug_prints = desc->flags & NeuroSDK_ContextCreateFlags_DebugPrints;
-	context->validation_layers =
-	    desc->flags & NeuroSDK_ContextCreateFlags_ValidationLayers;
+static bool job_push(allocator_t *a, job_queue_t *queue, action_job_t *job) {
+	mtx_lock(&queue->mtx);
+	if (queue->size == queue->cap) {
+		int cap = queue->cap ? queue->cap * 2 : 16;
+		action_job_t *jobs = mem_alloc(a, (size_t)cap * sizeof(action_job_t));
+		if (!jobs) {
+			mtx_unlock(&queue->mtx);
+			return false;
+		}
+		for (int i = 0; i < queue->size; i++) {
+			jobs[i] = queue->jobs[(queue->head + i) % queue->cap];
+		}
+		mem_free(queue->jobs);
+		queue->jobs = jobs;
+		queue->head = 0;
+		queue->cap = cap;
+	}
+	queue->jobs[(queue->head + queue->size++) % queue->cap] = *job;
+	mtx_unlock(&queue->mtx);
+	return true;
+}
 
-	context->pending_messages_cap = MESSAGE_QUEUE_SIZE;
-	context->pending_messages_size = 0;
-	context->pending_messages =
-	    malloc(context->pending_messages_cap * sizeof(char *));
+static bool job_pop(job_queue_t *queue, bool steal, OUT action_job_t *job) {
+	mtx_lock(&queue->mtx);
+	bool found = queue->size > 0;
+	if (found && steal) {
+		*job = queue->jobs[queue->head];
+		queue->head = (queue->head + 1) % queue->cap;
+		queue->size--;
+	} else if (found) {
+		*job = queue->jobs[(queue->head + --queue->size) % queue->cap];
+	}
+	mtx_unlock(&queue->mtx);
+	return found;
+}
 
-	context->message_queue_cap = MESSAGE_QUEUE_SIZE;
-	context->message_queue_size = 0;
-	context->message_queue =
-	    malloc(context->message_queue_cap * sizeof(neurosdk_message_t));
-	if (!context->message_queue) {
-		free((void *)context->game_name);
-		free(context);
-		return NeuroSDK_OutOfMemory;
+// Takes the newest job of worker `self`, or steals the oldest of another one.
+static bool pool_take(worker_pool_t *pool, int self, OUT action_job_t *job) {
+	bool found = job_pop(&pool->queues[self], false, job);
+	for (int i = 1; i < pool->count && !found; i++) {
+		found = job_pop(&pool->queues[(self + i) % pool->count], true, job);
+	}
+	if (found) {
+		mtx_lock(&pool->wake_mtx);
+		pool->queued--;
+		mtx_unlock(&pool->wake_mtx);
 	}
+	return found;
+}
 
-	char *fetched_url = (char *)desc->url;
-	if (!fetched_url) {
-		fetched_url = getenv(ENVIRONMENT_VARIABLE_NAME);
+static void run_job(context_t *ctx, action_job_t *job) {
+	neurosdk_message_action_t *action = &job->msg.value.action;
+	char message[NEUROSDK_RESULT_MESSAGE_MAX] = {0};
+	TRACE_BEGIN(ctx, "action handler");
+	bool success = job->fn(action, message, job->user_data);
+	TRACE_END(ctx, "action handler");
+	message[sizeof(message) - 1] = '\0';
+	size_t message_len = strlen(message);
+
+	neurosdk_error_e err =
+	    send_action_result(ctx, action->id, strlen(action->id), success,
+	                       message_len ? message : NULL, message_len);
+	if (err) {
+		// The server keeps waiting for this action, make that visible.
+		LOG_ERROR(ctx, "Dropped the result of action '%s': %s", action->name,
+		          neurosdk_error_string(err));
 	}
-	if (!fetched_url) {
-		res = NeuroSDK_NoURL;
-		goto cleanup;
+	neurosdk_message_destroy(&job->msg);
+
+	mtx_lock(&ctx->out_mtx);
+	if (err) {
+		ctx->stats.dropped_results++;
+	} else {
+		ctx->stats.handled_actions++;
 	}
+	mtx_unlock(&ctx->out_mtx);
+}
 
-	mg_mgr_init(&context->mgr);
-	mg_log_set(MG_LL_NONE);
-	mg_wakeup_init(&context->mgr);
+typedef struct worker_arg {
+	worker_pool_t *pool;
+	int index;
+} worker_arg_t;
 
-	if (mtx_init(&context->out_mtx, mtx_plain) != thrd_success) {
-		res = NeuroSDK_Internal;
-		goto cleanup2;
+static int worker_fn_(void *arg) {
+	worker_arg_t self = *(worker_arg_t *)arg;
+	mem_free(arg);
+	worker_pool_t *pool = self.pool;
+	current_allocator = &pool->ctx->allocator;
+
+	for (;;) {
+		action_job_t job;
+		if (pool_take(pool, self.index, &job)) {
+			run_job(pool->ctx, &job);
+			continue;
+		}
+		mtx_lock(&pool->wake_mtx);
+		while (!pool->queued && !pool->stopping) {
+			cnd_wait(&pool->wake_cnd, &pool->wake_mtx);
+		}
+		bool stopping = pool->stopping;
+		mtx_unlock(&pool->wake_mtx);
+		if (stopping) {
+			break;
+		}
 	}
+	return 0;
+}
 
-	struct mg_str host = mg_url_host(fetched_url);
-	unsigned short port = mg_url_port(fetched_url);
-	context->conn = mg_ws_connect(&context->mgr, fetched_url, connection_fn_,
-	                              (void *)context, NULL);
+static neurosdk_error_e pool_start(context_t *ctx, int threads) {
+	worker_pool_t *pool = mem_calloc(&ctx->allocator, 1, sizeof(*pool));
+	if (!pool) {
+		return NeuroSDK_OutOfMemory;
+	}
+	pool->ctx = ctx;
+	pool->threads = mem_calloc(&ctx->allocator, (size_t)threads,
+	                           sizeof(*pool->threads));
+	pool->queues = mem_calloc(&ctx->allocator, (size_t)threads,
+	                          sizeof(*pool->queues));
+	if (!pool->threads || !pool->queues) {
+		mem_free(pool->threads);
+		mem_free(pool->queues);
+		mem_free(pool);
+		return NeuroSDK_OutOfMemory;
+	}
+	mtx_init(&pool->wake_mtx, mtx_plain);
+	cnd_init(&pool->wake_cnd);
+	for (int i = 0; i < threads; i++) {
+		mtx_init(&pool->queues[i].mtx, mtx_plain);
+	}
+	pool->count = threads;
+	ctx->pool = pool;
 
-	if (!context->conn) {
-		res = NeuroSDK_ConnectionError;
-		goto cleanup3;
+	for (int i = 0; i < threads; i++) {
+		worker_arg_t *arg = mem_alloc(&ctx->allocator, sizeof(*arg));
+		if (!arg) {
+			pool_stop(ctx);
+			return NeuroSDK_OutOfMemory;
+		}
+		*arg = (worker_arg_t){.pool = pool, .index = i};
+		if (thrd_create(&pool->threads[i], worker_fn_, arg) != thrd_success) {
+			LOG_ERROR(ctx, "Could not start action worker thread %d.", i);
+			mem_free(arg);
+			pool_stop(ctx);
+			return NeuroSDK_Internal;
+		}
+		pool->started++;
+	}
+	return NeuroSDK_None;
+}
+
+// Joins the workers. Jobs that have not started are dropped unanswered,
+// returns their number.
+static int pool_stop(context_t *ctx) {
+	worker_pool_t *pool = ctx->pool;
+	if (!pool) {
+		return 0;
 	}
+	int dropped = 0;
+	mtx_lock(&pool->wake_mtx);
+	pool->stopping = true;
+	cnd_broadcast(&pool->wake_cnd);
+	mtx_unlock(&pool->wake_mtx);
 
-	for (int i = 0; i < 10 && !context->connected; i++) {
-		mg_mgr_poll(&context->mgr, 300);
+	for (int i = 0; i < pool->started; i++) {
+		thrd_join(pool->threads[i], NULL);
 	}
-	if (!context->connected) {
-		res = NeuroSDK_ConnectionError;
-		goto cleanup3;
+	for (int i = 0; i < pool->count; i++) {
+		action_job_t job;
+		while (job_pop(&pool->queues[i], false, &job)) {
+			neurosdk_message_destroy(&job.msg);
+			dropped++;
+		}
+		mem_free(pool->queues[i].jobs);
+		mtx_destroy(&pool->queues[i].mtx);
 	}
+	cnd_destroy(&pool->wake_cnd);
+	mtx_destroy(&pool->wake_mtx);
+	mem_free(pool->threads);
+	mem_free(pool->queues);
+	mem_free(pool);
+	ctx->pool = NULL;
+	return dropped;
+}
 
-	(*ctx) = (neurosdk_context_t)context;
-	return res;
+// Moves actions with a handler out of the inbound queue and onto the workers.
+static void dispatch_handled_actions(context_t *context) {
+	worker_pool_t *pool = context->pool;
+	int kept = 0;
+	for (int i = 0; i < context->message_queue_size; i++) {
+		neurosdk_message_t *msg = &context->message_queue[i];
+		action_job_t job = {.msg = *msg};
+		if (msg->kind == NeuroSDK_MessageKind_Action) {
+			mtx_lock(&context->registry_mtx);
+			action_handler_t const *handler =
+			    find_handler(context, msg->value.action.name);
+			if (handler) {
+				job.fn = handler->fn;
+				job.user_data = handler->user_data;
+			}
+			mtx_unlock(&context->registry_mtx);
+		}
 
-cleanup3:
-	mtx_destroy(&context->out_mtx);
-cleanup2:
-	mg_mgr_free(&context->mgr);
-cleanup:
-	free(context->pending_messages);
-	free(context->message_queue);
-	free((void *)context->game_name);
-	free(context);
-	return res;
+		int target = pool->next;
+		if (!job.fn ||
+		    !job_push(&context->allocator, &pool->queues[target], &job)) {
+			context->message_queue[kept++] = *msg;
+			continue;
+		}
+		pool->next = (target + 1) % pool->count;
+		mtx_lock(&pool->wake_mtx);
+		pool->queued++;
+		TRACE_COUNTER(context, "queued handler jobs", pool->queued);
+		cnd_signal(&pool->wake_cnd);
+		mtx_unlock(&pool->wake_mtx);
+	}
+	context->message_queue_size = kept;
 }
 
-NEUROSDK_EXPORT neurosdk_error_e
-neurosdk_context_destroy(neurosdk_context_t *ctx) {
-	if (!ctx || !(*ctx)) {
-		return NeuroSDK_Uninitialized;
+// Answers actions that failed validation with a failed action:result and
+// drops them from the inbound queue. The results go out on the next poll.
+static void reject_invalid_actions(context_t *context) {
+	int kept = 0;
+	bool queued = false;
+	for (int i = 0; i < context->message_queue_size; i++) {
+		neurosdk_message_t *msg = &context->message_queue[i];
+		neurosdk_message_action_t *action = &msg->value.action;
+		if (msg->kind != NeuroSDK_MessageKind_Action || !action->validation_error) {
+			context->message_queue[kept++] = *msg;
+			continue;
+		}
+
+		LOG_WARN(context, "Rejecting action '%s' (%s): %s", action->name,
+		         action->id, action->validation_error);
+		char *str = NULL;
+		int bytes = build_action_result(
+		    context, action->id, strlen(action->id), false,
+		    action->validation_error, strlen(action->validation_error), &str);
+		if (bytes >= 0 &&
+		    !queue_message(context, NeuroSDK_MessageKind_ActionResult, str, bytes,
+		                   0, 0, NULL, false, 0)) {
+			answer_action(context, action->id, strlen(action->id), now_us());
+			queued = true;
+		}
+		mtx_lock(&context->out_mtx);
+		context->stats.rejected_actions++;
+		mtx_unlock(&context->out_mtx);
+		neurosdk_message_destroy(msg);
 	}
-	context_t *context = (context_t *)(*ctx);
+	context->message_queue_size = kept;
 
-	LOG_DEBUG(context, "Destroying NeuroSDK context.");
+	if (queued) {
+		wake_poll(context);
+	}
+}
 
-	mtx_destroy(&context->out_mtx);
-	mg_mgr_free(&context->mgr);
+static neurosdk_error_e poll_messages(context_t *context,
+                                      int timeout_ms,
+                                      int max_messages,
+                                      uint32_t max_us,
+                                      OUT neurosdk_message_t **messages,
+                                      OUT int *count) {
+	LOG_DEBUG(context, "Polling context for new messages.");
 
-	free(context->pending_messages);
-	free(context->message_queue);
-	free((void *)context->game_name);
-	free(context);
+	uint64_t deadline_us = max_us ? now_us() + max_us : 0;
+	// Leftover frames are parsed without waiting on the socket.
+	if (context->frames_len) {
+		timeout_ms = 0;
+	}
+	current_allocator = &context->allocator;
+	atomic_store_size(&context->poll_thread, current_thread_id());
+	TRACE_BEGIN(context, "mg_mgr_poll");
+	if (context->replay) {
+		replay_feed(context, timeout_ms);
+		flush_pending(context, NULL);
+	} else {
+		reconnect_if_due(context);
+		mg_mgr_poll(&context->mgr, timeout_ms);
+	}
+	TRACE_END(context, "mg_mgr_poll");
+	TRACE_COUNTER(context, "inbound frames", context->frames_len);
+	if (context->record_file) {
+		fflush(context->record_file);
+	}
+
+	// Reported once per lost connection when it is reconnected, on every poll
+	// otherwise.
+	if (atomic_load_bool(&context->peer_timed_out)) {
+		LOG_ERROR(context, "Connection lost: %s",
+		          neurosdk_error_string(NeuroSDK_PeerTimeout));
+		if (context->reconnect_min_ms) {
+			atomic_store_bool(&context->peer_timed_out, false);
+		}
+		return NeuroSDK_PeerTimeout;
+	}
+	neurosdk_error_e err = context->conn_err;
+	if (!err) {
+		err = parse_frames(context, max_messages, deadline_us);
+	}
+	if (err) {
+		LOG_ERROR(context, "Error during poll: %s",
+		          neurosdk_error_string(err));
+		context->conn_err = NeuroSDK_None;
+		return err;
+	}
+
+	if (context->reject_invalid_actions) {
+		reject_invalid_actions(context);
+	}
+	if (context->pool) {
+		dispatch_handled_actions(context);
+	}
+	if (context->slow_action_us) {
+		check_slow_actions(context);
+	}
+
+	TRACE_COUNTER(context, "returned messages", context->message_queue_size);
+	if (context->message_queue_size) {
+		uint64_t now = now_us();
+		mtx_lock(&context->out_mtx);
+		for (int i = 0; i < context->message_queue_size; i++) {
+			latency_add(&context->queued_latency,
+			            now - context->message_queue[i].received_us);
+		}
+		mtx_unlock(&context->out_mtx);
+	}
+	*messages = context->message_queue;
+	*count = context->message_queue_size;
+	context->message_queue_size = 0;
 
-	*ctx = NULL;
 	return NeuroSDK_None;
 }
 
@@ -583,78 +4248,281 @@ neurosdk_context_poll(neurosdk_context_t *ctx,
 		return NeuroSDK_Uninitialized;
 	}
 	context_t *context = (context_t *)(*ctx);
+	return poll_messages(context, io_timeout_ms(context), 0, 0, messages,
+	                     count);
+}
 
-	if (!context->conn) {
-		LOG_ERROR(context,
-		          "neurosdk_context_poll called but 'conn' is NULL. Context may "
-		          "be uninitialized.");
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_poll_budget(neurosdk_context_t *ctx,
+                             int max_messages,
+                             uint32_t max_us,
+                             OUT neurosdk_message_t **messages,
+                             OUT int *count) {
+	if (!ctx || !(*ctx)) {
 		return NeuroSDK_Uninitialized;
 	}
+	context_t *context = (context_t *)(*ctx);
+	int timeout_ms = io_timeout_ms(context);
+	if (max_us && max_us / 1000 < (uint32_t)timeout_ms) {
+		timeout_ms = (int)(max_us / 1000);
+	}
+	return poll_messages(context, timeout_ms, max_messages, max_us, messages,
+	                     count);
+}
 
-	LOG_DEBUG(context, "Polling context for new messages.");
+// Writes the JSON of `action` to `dst` unless it is NULL. Returns its length
+// either way, so a frame can be sized before it is allocated.
+static size_t action_json(neurosdk_action_t const *action, char *dst) {
+	static char const name_key[] = "{\"name\":\"";
+	static char const desc_key[] = "\",\"description\":\"";
+	static char const schema_key[] = "\",\"schema\":";
+	char const *desc = action->description ? action->description : "";
+	char const *schema = action->json_schema ? action->json_schema : "{}";
+	size_t name_len = strlen(action->name);
+	size_t desc_len = strlen(desc);
+	size_t schema_len = strlen(schema);
+	if (!dst) {
+		return sizeof(name_key) - 1 + escaped_length(action->name, name_len) +
+		       sizeof(desc_key) - 1 + escaped_length(desc, desc_len) +
+		       sizeof(schema_key) - 1 + schema_len + 1;
+	}
 
-	mg_mgr_poll(&context->mgr, context->poll_ms);
+	char *p = dst;
+	memcpy(p, name_key, sizeof(name_key) - 1);
+	p = escape_into(p + sizeof(name_key) - 1, action->name, name_len);
+	memcpy(p, desc_key, sizeof(desc_key) - 1);
+	p = escape_into(p + sizeof(desc_key) - 1, desc, desc_len);
+	memcpy(p, schema_key, sizeof(schema_key) - 1);
+	p += sizeof(schema_key) - 1;
+	memcpy(p, schema, schema_len);
+	p += schema_len;
+	*p++ = '}';
+	return (size_t)(p - dst);
+}
 
-	if (context->conn_err) {
-		LOG_ERROR(context, "Connection error during poll: %s",
-		          neurosdk_error_string(context->conn_err));
-		return context->conn_err;
+// Returns the end of the register frame that starts at `first` and adds
+// its length to `size`. A frame takes actions while it stays within
+// REGISTER_FRAME_SIZE, and at least one.
+static size_t register_frame_end(neurosdk_action_t const *actions,
+                                 size_t first,
+                                 size_t count,
+                                 size_t *size) {
+	size_t end = first;
+	while (end < count) {
+		size_t part = action_json(&actions[end], NULL) + (end > first);
+		if (end > first && *size + part > REGISTER_FRAME_SIZE) {
+			break;
+		}
+		*size += part;
+		end++;
 	}
+	return end;
+}
 
-	*messages = context->message_queue;
-	*count = context->message_queue_size;
-	context->message_queue_size = 0;
+// Reserves `frames` slots in the outbound queue, or none if they do not all
+// fit.
+static neurosdk_error_e reserve_pending(context_t *context, int frames) {
+	lock_out_mtx(context);
+	bool fits = frames <= context->max_pending - context->pending_count -
+	                          context->pending_reserved;
+	if (fits) {
+		context->pending_reserved += frames;
+	}
+	mtx_unlock(&context->out_mtx);
+	return fits ? NeuroSDK_None : NeuroSDK_MessageQueueFull;
+}
 
-	return NeuroSDK_None;
+static void release_pending(context_t *context, int frames) {
+	mtx_lock(&context->out_mtx);
+	context->pending_reserved -= frames;
+	mtx_unlock(&context->out_mtx);
 }
 
-static void make_array(char **strings, int count, OUT char **json_str) {
-	int total = 2;  // '[' and ']'
-	for (int i = 0; i < count; i++) {
-		// "..." => 2 quotes + length
-		total += 2 + (int)strlen(strings[i]);
-		if (i < count - 1)
-			total++;  // comma
+// Keeps the queued actions for restore_session(), replacing earlier ones of
+// the same name.
+static void session_remember(context_t *ctx,
+                             neurosdk_action_t const *actions,
+                             size_t count) {
+	bool ok = true;
+	mtx_lock(&ctx->registry_mtx);
+	for (size_t i = 0; i < count && ok; i++) {
+		session_action_t entry = {.name_hash = hash_string(actions[i].name, 0)};
+		entry.len = action_json(&actions[i], NULL);
+		entry.name = mem_strdup(&ctx->allocator, actions[i].name);
+		entry.json = mem_alloc(&ctx->allocator, entry.len);
+		session_action_t *existing = find_session_action(ctx, actions[i].name);
+		ok = entry.name && entry.json &&
+		     (existing || grow_array(&ctx->allocator, (void **)&ctx->session,
+		                             &ctx->session_cap, ctx->session_len,
+		                             sizeof(*ctx->session)));
+		if (!ok) {
+			mem_free(entry.name);
+			mem_free(entry.json);
+			break;
+		}
+		action_json(&actions[i], entry.json);
+		if (existing) {
+			mem_free(existing->name);
+			mem_free(existing->json);
+			*existing = entry;
+		} else {
+			ctx->session[ctx->session_len++] = entry;
+		}
 	}
-	*json_str = malloc(total + 1);
-	if (!*json_str)
-		return;
+	mtx_unlock(&ctx->registry_mtx);
+	if (!ok) {
+		LOG_ERROR(ctx,
+		          "Out of memory remembering actions, they are not registered "
+		          "again after a reconnect.");
+	}
+}
 
-	char *dst = *json_str;
-	*dst++ = '[';
-	for (int i = 0; i < count; i++) {
-		*dst++ = '"';
-		strcpy(dst, strings[i]);
-		dst += strlen(strings[i]);
-		*dst++ = '"';
-		if (i < count - 1) {
-			*dst++ = ',';
+// Follows a sent startup or actions/unregister in what restore_session()
+// sends. Startup clears the registered actions.
+static void session_update(context_t *ctx, neurosdk_message_t const *msg) {
+	mtx_lock(&ctx->registry_mtx);
+	if (msg->kind == NeuroSDK_MessageKind_Startup) {
+		session_clear(ctx);
+		ctx->startup_sent = true;
+	} else if (msg->kind == NeuroSDK_MessageKind_ActionsUnregister) {
+		neurosdk_message_actions_unregister_t const *unregister =
+		    &msg->value.actions_unregister;
+		for (int i = 0; i < unregister->action_names_len; i++) {
+			session_action_t *entry =
+			    find_session_action(ctx, unregister->action_names[i]);
+			if (entry) {
+				mem_free(entry->name);
+				mem_free(entry->json);
+				*entry = ctx->session[--ctx->session_len];
+			}
 		}
-	}
-	*dst++ = ']';
-	*dst = '\0';
+	}
+	mtx_unlock(&ctx->registry_mtx);
 }
 
-NEUROSDK_EXPORT neurosdk_error_e
-neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
-	if (!ctx || !(*ctx)) {
-		return NeuroSDK_Uninitialized;
+// Sends the actions as a series of actions/register frames of at most
+// REGISTER_FRAME_SIZE bytes, unless a single action is larger. The frames are
+// counted and their queue slots reserved first, so a set that does not fit is
+// refused before anything is queued. Each frame is then sized, written and
+// queued before the next is built. On failure the frames queued so far stay
+// queued.
+static neurosdk_error_e register_actions(context_t *context,
+                                         neurosdk_action_t const *actions,
+                                         size_t count) {
+	if (!count) {
+		LOG_WARN(context,
+		         "MessageKind_ActionsRegister called with zero actions. "
+		         "Nothing to register?");
 	}
-	context_t *context = (context_t *)(*ctx);
-	if (!context->conn) {
+	for (size_t i = 0; i < count; i++) {
+		if (!actions[i].name) {
+			LOG_ERROR(context,
+			          "Action register: action->name is NULL at index %zu.", i);
+			return NeuroSDK_InvalidMessage;
+		}
+		if (!actions[i].description) {
+			LOG_WARN(context,
+			         "Action register: action->description is NULL at index "
+			         "%zu, using empty string.",
+			         i);
+		}
+	}
+	char *head = NULL;
+	if (aprintf(&context->allocator, &head,
+	            "{\"command\":\"actions/register\",\"game\":\"%s\",\"data\":{"
+	            "\"actions\":[",
+	            context->game_name) < 0) {
+		LOG_ERROR(context, "Out of memory building actions register frame.");
+		return NeuroSDK_OutOfMemory;
+	}
+	static char const tail[] = "]}}";
+	size_t head_len = strlen(head);
+
+	// Counting stops once the frames cannot fit anyway.
+	int frames = 0;
+	size_t counted = 0;
+	do {
+		size_t size = head_len + sizeof(tail) - 1;
+		counted = register_frame_end(actions, counted, count, &size);
+		frames++;
+	} while (counted < count && frames <= context->max_pending);
+	neurosdk_error_e err = reserve_pending(context, frames);
+	if (err) {
 		LOG_ERROR(context,
-		          "neurosdk_context_send: invalid context (conn is NULL).");
-		return NeuroSDK_Uninitialized;
+		          "Action register: %d frames do not fit in the pending messages "
+		          "buffer.",
+		          frames);
+		mem_free(head);
+		return err;
+	}
+	err = register_schemas(context, actions, count);
+	if (err) {
+		release_pending(context, frames);
+		mem_free(head);
+		return err;
 	}
-	if (!neurosdk_context_connected(ctx)) {
+
+	size_t first = 0;
+	int queued = 0;
+	do {
+		size_t size = head_len + sizeof(tail) - 1;
+		size_t end = register_frame_end(actions, first, count, &size);
+		if (size > INT_MAX) {
+			LOG_ERROR(context, "Action register: '%s' is too large to send.",
+			          actions[first].name);
+			err = NeuroSDK_InvalidMessage;
+			break;
+		}
+
+		char *frame = mem_alloc(&context->allocator, size + 1);
+		if (!frame) {
+			LOG_ERROR(context, "Out of memory building actions register frame.");
+			err = NeuroSDK_OutOfMemory;
+			break;
+		}
+		char *p = frame;
+		memcpy(p, head, head_len);
+		p += head_len;
+		for (size_t i = first; i < end; i++) {
+			if (i > first) {
+				*p++ = ',';
+			}
+			p += action_json(&actions[i], p);
+		}
+		memcpy(p, tail, sizeof(tail));
+
+		err = enqueue_message(context, NeuroSDK_MessageKind_ActionsRegister, frame,
+		                      (int)size, 0, 0, NULL, false, 0);
+		if (err) {
+			break;
+		}
+		queued++;
+		first = end;
+	} while (first < count);
+
+	if (queued < frames) {
+		release_pending(context, frames - queued);
+	}
+	if (first && context->reconnect_min_ms) {
+		session_remember(context, actions, first);
+	}
+	mem_free(head);
+	if (err && first) {
 		LOG_ERROR(context,
-		          "neurosdk_context_send: cannot send message because we are "
-		          "not connected.");
-		return NeuroSDK_ConnectionError;
+		          "Action register: only the first %zu of %zu actions were "
+		          "queued.",
+		          first, count);
 	}
+	return err;
+}
 
+static neurosdk_error_e send_message(context_t *context,
+                                     neurosdk_message_t *msg) {
+	uint64_t hash = 0;
+	bool dedup = false;
 	char *str = NULL;
 	int bytes = 0;
+	size_t value_at = 0, value_len = 0;
 
 	switch (msg->kind) {
 		case NeuroSDK_MessageKind_Action:
@@ -664,7 +4532,8 @@ neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
 			return NeuroSDK_CommandNotAvailable;
 
 		case NeuroSDK_MessageKind_Startup:
-			bytes = aprintf(&str, "{\"command\":\"startup\",\"game\":\"%s\"}",
+			bytes = aprintf(&context->allocator, &str,
+			                "{\"command\":\"startup\",\"game\":\"%s\"}",
 			                context->game_name);
 			break;
 
@@ -678,112 +4547,16 @@ neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
 			    msg->value.context.silent != false) {
 				msg->value.context.silent = false;
 			}
-			char *escaped_str = escape_string(msg->value.context.message);
-			if (!escaped_str) {
-				LOG_ERROR(context,
-				          "Out of memory while escaping 'message' for context.");
-				return NeuroSDK_OutOfMemory;
-			}
-			bytes = aprintf(&str,
-			                "{\"command\":\"context\",\"game\":\"%s\",\"data\":{"
-			                "\"message\":\"%s\",\"silent\":%s}}",
-			                context->game_name, escaped_str,
-			                msg->value.context.silent ? "true" : "false");
-			free(escaped_str);
-		} break;
+			return send_context(context, msg->value.context.message,
+			                    strlen(msg->value.context.message),
+			                    msg->value.context.silent);
+		}
 
 		case NeuroSDK_MessageKind_ActionsRegister: {
-			if (msg->value.actions_register.actions_len <= 0) {
-				LOG_WARN(context,
-				         "MessageKind_ActionsRegister called with zero actions. "
-				         "Nothing to register?");
-			}
 			int len = msg->value.actions_register.actions_len;
-			char **json_actions = malloc(sizeof(char *) * (size_t)len);
-			if (!json_actions) {
-				LOG_ERROR(context,
-				          "Out of memory while building actions register array.");
-				return NeuroSDK_OutOfMemory;
-			}
-
-			int total_size = 0;
-			for (int i = 0; i < len; i++) {
-				neurosdk_action_t *action = &msg->value.actions_register.actions[i];
-				if (!action->name) {
-					LOG_ERROR(context,
-					          "Action register: action->name is NULL at index %d.", i);
-					free(json_actions);
-					return NeuroSDK_InvalidMessage;
-				}
-				if (!action->description) {
-					LOG_WARN(context,
-					         "Action register: action->description is NULL at index "
-					         "%d, using empty string.",
-					         i);
-				}
-				char *name_escaped = escape_string(action->name);
-				char *desc_escaped =
-				    escape_string(action->description ? action->description : "");
-				if (!name_escaped || !desc_escaped) {
-					LOG_ERROR(context, "Out of memory escaping action fields.");
-					free(name_escaped);
-					free(desc_escaped);
-					free(json_actions);
-					return NeuroSDK_OutOfMemory;
-				}
-				char *schema = action->json_schema ? action->json_schema : "{}";
-
-				int part_bytes =
-				    aprintf(&json_actions[i],
-				            "{\"name\":\"%s\",\"description\":\"%s\",\"schema\":%s}",
-				            name_escaped, desc_escaped, schema);
-				free(desc_escaped);
-				free(name_escaped);
-				if (part_bytes < 0) {
-					LOG_ERROR(context,
-					          "Out of memory building single action register payload.");
-					for (int k = 0; k <= i; k++) {
-						if (json_actions[k])
-							free(json_actions[k]);
-					}
-					free(json_actions);
-					return NeuroSDK_OutOfMemory;
-				}
-				total_size += part_bytes;
-			}
-
-			int approx_size =
-			    total_size + (len - 1) + 2 + 1;  // +2 for '[]', +1 for null-term
-			char *actions_array = malloc((size_t)approx_size);
-			if (!actions_array) {
-				LOG_ERROR(context, "Out of memory building final actions array JSON.");
-				for (int i = 0; i < len; i++) {
-					free(json_actions[i]);
-				}
-				free(json_actions);
-				return NeuroSDK_OutOfMemory;
-			}
-			char *ptr = actions_array;
-			*ptr++ = '[';
-			for (int i = 0; i < len; i++) {
-				int frag_len = (int)strlen(json_actions[i]);
-				memcpy(ptr, json_actions[i], (size_t)frag_len);
-				ptr += frag_len;
-				if (i < len - 1) {
-					*ptr++ = ',';
-				}
-				free(json_actions[i]);
-			}
-			*ptr++ = ']';
-			*ptr = '\0';
-			free(json_actions);
-
-			bytes = aprintf(&str,
-			                "{\"command\":\"actions/"
-			                "register\",\"game\":\"%s\",\"data\":{\"actions\":%s}}",
-			                context->game_name, actions_array);
-			free(actions_array);
-		} break;
+			return register_actions(context, msg->value.actions_register.actions,
+			                        len > 0 ? (size_t)len : 0);
+		}
 
 		case NeuroSDK_MessageKind_ActionsUnregister: {
 			if (msg->value.actions_unregister.action_names_len <= 0) {
@@ -791,8 +4564,16 @@ neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
 				         "MessageKind_ActionsUnregister called with zero action "
 				         "names. Nothing to unregister?");
 			}
+			if (context->validate_actions) {
+				for (int i = 0; i < msg->value.actions_unregister.action_names_len;
+				     i++) {
+					remove_schema(context,
+					              msg->value.actions_unregister.action_names[i]);
+				}
+			}
 			char *json_str = NULL;
-			make_array(msg->value.actions_unregister.action_names,
+			make_array(&context->allocator,
+			           msg->value.actions_unregister.action_names,
 			           msg->value.actions_unregister.action_names_len, &json_str);
 			if (!json_str) {
 				LOG_ERROR(context,
@@ -800,14 +4581,20 @@ neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
 				return NeuroSDK_OutOfMemory;
 			}
 			bytes = aprintf(
-			    &str,
+			    &context->allocator, &str,
 			    "{\"command\":\"actions/"
 			    "unregister\",\"game\":\"%s\",\"data\":{\"action_names\":%s}}",
 			    context->game_name, json_str);
-			free(json_str);
+			mem_free(json_str);
 		} break;
 
 		case NeuroSDK_MessageKind_ActionsForce: {
+			dedup = context->deduplicate_messages &&
+			        force_hash(&msg->value.actions_force, &hash);
+			if (dedup && dedup_hit(context, msg->kind, hash)) {
+				return NeuroSDK_None;
+			}
+
 			char *query = msg->value.actions_force.query;
 			if (!query) {
 				LOG_ERROR(context, "actions/force: 'query' is required but is NULL.");
@@ -826,28 +4613,7 @@ neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
 				ephemeral_null = true;
 			}
 
-			char *state = msg->value.actions_force.state;
-			if (state) {
-				char *escaped = escape_string(state);
-				if (!escaped) {
-					LOG_ERROR(context, "Out of memory escaping 'state'.");
-					return NeuroSDK_OutOfMemory;
-				}
-				char *temp = NULL;
-				if (aprintf(&temp, "\"%s\"", escaped) < 0) {
-					free(escaped);
-					LOG_ERROR(context, "Out of memory building 'state' JSON part.");
-					return NeuroSDK_OutOfMemory;
-				}
-				free(escaped);
-				state = temp;
-			} else {
-				state = strdup("null");
-				if (!state) {
-					LOG_ERROR(context, "Out of memory setting default state to null.");
-					return NeuroSDK_OutOfMemory;
-				}
-			}
+			char const *state = msg->value.actions_force.state;
 
 			char *ephemeral_context_str = "null";
 			if (!ephemeral_null) {
@@ -872,26 +4638,39 @@ neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
 			}
 
 			char *json_str = NULL;
-			make_array(action_names, msg->value.actions_force.action_names_len,
-			           &json_str);
+			make_array(&context->allocator, action_names,
+			           msg->value.actions_force.action_names_len, &json_str);
 			if (!json_str) {
-				free(state);
 				LOG_ERROR(
 				    context,
 				    "Out of memory building action_names array in actions/force.");
 				return NeuroSDK_OutOfMemory;
 			}
 
-			bytes = aprintf(
-			    &str,
-			    "{\"command\":\"actions/"
-			    "force\",\"game\":\"%s\",\"data\":{\"state\":%s,\"query\":\"%s\","
-			    "\"ephemeral_context\":%s,\"action_names\":%s,\"priority\":\"%s\"}}",
-			    context->game_name, state, query, ephemeral_context_str, json_str,
-			    priority);
-
-			free(json_str);
-			free(state);
+			// The state can be megabytes, so it is kept as is between a small
+			// head and tail and only escaped while the frame is sent.
+			char *head = NULL, *tail = NULL;
+			aprintf(&context->allocator, &head,
+			        "{\"command\":\"actions/force\",\"game\":\"%s\",\"data\":{"
+			        "\"state\":%s",
+			        context->game_name, state ? "\"" : "null");
+			aprintf(&context->allocator, &tail,
+			        "%s,\"query\":\"%s\",\"ephemeral_context\":%s,"
+			        "\"action_names\":%s,\"priority\":\"%s\"}}",
+			        state ? "\"" : "", query, ephemeral_context_str, json_str,
+			        priority);
+			mem_free(json_str);
+			if (!head || !tail) {
+				mem_free(head);
+				mem_free(tail);
+				LOG_ERROR(context, "Out of memory building actions/force message.");
+				return NeuroSDK_OutOfMemory;
+			}
+			value_len = state ? strlen(state) : 0;
+			bytes = join_raw(&context->allocator, head, state ? state : "",
+			                 value_len, tail, &str, &value_at);
+			mem_free(head);
+			mem_free(tail);
 		} break;
 
 		case NeuroSDK_MessageKind_ActionResult: {
@@ -903,74 +4682,436 @@ neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
 			    msg->value.action_result.success != false) {
 				msg->value.action_result.success = true;
 			}
-
-			char *message = strdup("null");
-			if (!message) {
-				LOG_ERROR(context, "Out of memory duplicating 'null' string.");
-				return NeuroSDK_OutOfMemory;
-			}
-			if (msg->value.action_result.message) {
-				free(message);
-				char *tmp = escape_string(msg->value.action_result.message);
-				if (!tmp) {
-					LOG_ERROR(context, "Out of memory escaping 'action_result.message'.");
-					return NeuroSDK_OutOfMemory;
-				}
-				if (aprintf(&message, "\"%s\"", tmp) < 0) {
-					LOG_ERROR(context, "Out of memory building 'action_result.message'.");
-					free(tmp);
-					return NeuroSDK_OutOfMemory;
-				}
-				free(tmp);
-			}
-
-			bytes =
-			    aprintf(&str,
-			            "{\"command\":\"action:result\",\"game\":\"%s\",\"data\":{"
-			            "\"id\":\"%s\",\"success\":%s,\"message\":%s}}",
-			            context->game_name, msg->value.action_result.id,
-			            msg->value.action_result.success ? "true" : "false", message);
-			free(message);
-		} break;
+			char *message = msg->value.action_result.message;
+			return send_action_result(context, msg->value.action_result.id,
+			                          strlen(msg->value.action_result.id),
+			                          msg->value.action_result.success, message,
+			                          message ? strlen(message) : 0);
+		}
 
 		default:
 			LOG_ERROR(context, "Unknown or unhandled message kind: %d.", msg->kind);
 			return NeuroSDK_UnknownCommand;
 	}
 
-	if (!str || bytes <= 0) {
-		LOG_ERROR(context,
-		          "Failed to build JSON message for sending (aprintf error).");
-		free(str);
+	neurosdk_error_e err =
+	    enqueue_message(context, msg->kind, str, bytes, value_at, value_len,
+	                    NULL, dedup, hash);
+	if (!err && context->reconnect_min_ms) {
+		session_update(context, msg);
+	}
+	return err;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_send(neurosdk_context_t *ctx, neurosdk_message_t *msg) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+	neurosdk_error_e err = check_sendable(context);
+	if (err) {
+		return err;
+	}
+
+	TRACE_BEGIN(context, "neurosdk_context_send");
+	err = send_message(context, msg);
+	TRACE_END(context, "neurosdk_context_send");
+	return err;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_register_actions(neurosdk_context_t *ctx,
+                                  neurosdk_action_t const *actions,
+                                  size_t count) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+	neurosdk_error_e err = check_sendable(context);
+	if (err) {
+		return err;
+	}
+
+	TRACE_BEGIN(context, "neurosdk_context_register_actions");
+	err = register_actions(context, actions, count);
+	TRACE_END(context, "neurosdk_context_register_actions");
+	return err;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_send_context(neurosdk_context_t *ctx,
+                              char const *message,
+                              size_t message_len,
+                              bool silent) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+	neurosdk_error_e err = check_sendable(context);
+	if (err) {
+		return err;
+	}
+	if (!message) {
+		LOG_ERROR(context, "neurosdk_context_send_context: 'message' is NULL.");
 		return NeuroSDK_InvalidMessage;
 	}
+	return send_context(context, message, message_len, silent);
+}
 
-	LOG_DEBUG(context, "Queueing message for send: %s (%d bytes)", str, bytes);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_send_action_result(neurosdk_context_t *ctx,
+                                    char const *id,
+                                    size_t id_len,
+                                    bool success,
+                                    char const *message,
+                                    size_t message_len) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+	neurosdk_error_e err = check_sendable(context);
+	if (err) {
+		return err;
+	}
+	if (!id) {
+		LOG_ERROR(context, "action/result: 'id' is required but is NULL.");
+		return NeuroSDK_InvalidMessage;
+	}
+	return send_action_result(context, id, id_len, success, message,
+	                          message_len);
+}
+
+NEUROSDK_EXPORT bool neurosdk_context_connected(neurosdk_context_t *ctx) {
+	if (!ctx || !(*ctx)) {
+		return false;
+	}
+	return atomic_load_bool(&((context_t *)*ctx)->connected);
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_stats(neurosdk_context_t *ctx,
+                       OUT neurosdk_context_stats_t *stats) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
 
 	mtx_lock(&context->out_mtx);
-	if (context->pending_messages_size < context->pending_messages_cap) {
-		context->pending_messages[context->pending_messages_size++] = str;
-	} else {
-		mtx_unlock(&context->out_mtx);
-		LOG_ERROR(context, "Out of memory: pending messages buffer is full.");
-		free(str);
-		return NeuroSDK_OutOfMemory;
+	*stats = context->stats;
+	stats->pending_messages = context->pending_count;
+	stats->bytes_in_use = atomic_load_size(&context->allocator.bytes_in_use);
+	stats->peak_bytes_in_use =
+	    atomic_load_size(&context->allocator.peak_bytes_in_use);
+	stats->allocations = atomic_load_size(&context->allocator.allocations);
+	stats->live_allocations =
+	    atomic_load_size(&context->allocator.live_allocations);
+	mtx_unlock(&context->out_mtx);
+
+	return NeuroSDK_None;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_rtt(neurosdk_context_t *ctx, OUT neurosdk_rtt_stats_t *stats) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+	heartbeat_t *hb = &context->heartbeat;
+
+	memset(stats, 0, sizeof(*stats));
+
+	mtx_lock(&context->out_mtx);
+	stats->pings_sent = hb->pings_sent;
+	stats->pongs_received = hb->pongs_received;
+	stats->missed_pongs = hb->missed;
+	latency_samples_t rtt = hb->rtt;
+	mtx_unlock(&context->out_mtx);
+
+	neurosdk_latency_t summary;
+	latency_summarize(&rtt, &summary);
+	stats->samples = summary.samples;
+	stats->last_us = summary.last_us;
+	stats->min_us = summary.min_us;
+	stats->max_us = summary.max_us;
+	stats->mean_us = summary.mean_us;
+	stats->p50_us = summary.p50_us;
+	stats->p90_us = summary.p90_us;
+	stats->p99_us = summary.p99_us;
+	memcpy(stats->buckets, summary.buckets, sizeof(stats->buckets));
+
+	return NeuroSDK_None;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_response_times(neurosdk_context_t *ctx,
+                                OUT neurosdk_response_stats_t *stats) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
 	}
+	context_t *context = (context_t *)(*ctx);
+
+	mtx_lock(&context->out_mtx);
+	latency_samples_t queued = context->queued_latency;
+	latency_samples_t response = context->response_latency;
+	stats->unmatched_results = context->unmatched_results;
 	mtx_unlock(&context->out_mtx);
 
-	mg_wakeup(&context->mgr, context->conn->id, NULL, 0);
+	latency_summarize(&queued, &stats->queued);
+	latency_summarize(&response, &stats->response);
+	return NeuroSDK_None;
+}
 
-	mg_mgr_poll(&context->mgr, context->poll_ms);
-	mg_mgr_poll(&context->mgr, context->poll_ms);
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_action_profiles(neurosdk_context_t *ctx,
+                                 OUT neurosdk_action_profile_t *profiles,
+                                 int cap,
+                                 OUT int *count) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
 
+	mtx_lock(&context->out_mtx);
+	*count = context->profiles_len;
+	for (int i = 0; i < cap && i < context->profiles_len; i++) {
+		action_profile_t const *profile = &context->profiles[i];
+		profiles[i].name = profile->name;
+		profiles[i].results = profile->results;
+		profiles[i].slow = profile->slow;
+		profiles[i].orphaned = profile->orphaned;
+		latency_summarize(&profile->latency, &profiles[i].latency);
+	}
+	mtx_unlock(&context->out_mtx);
 	return NeuroSDK_None;
 }
 
-NEUROSDK_EXPORT bool neurosdk_context_connected(neurosdk_context_t *ctx) {
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_set_handler(neurosdk_context_t *ctx,
+                             char const *name,
+                             neurosdk_callback_action_t handler,
+                             void *user_data) {
 	if (!ctx || !(*ctx)) {
-		return false;
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+	if (!name) {
+		LOG_ERROR(context, "set_handler: 'name' is required and is NULL.");
+		return NeuroSDK_InvalidMessage;
+	}
+	if (!context->pool) {
+		LOG_ERROR(context,
+		          "set_handler: the context was created without worker_threads.");
+		return NeuroSDK_Uninitialized;
+	}
+
+	neurosdk_error_e res = NeuroSDK_None;
+	mtx_lock(&context->registry_mtx);
+	action_handler_t *existing = find_handler(context, name);
+	if (existing && !handler) {
+		mem_free(existing->name);
+		*existing = context->handlers[--context->handlers_len];
+	} else if (existing) {
+		existing->fn = handler;
+		existing->user_data = user_data;
+	} else if (handler) {
+		char *copy = mem_strdup(&context->allocator, name);
+		if (!copy || !grow_array(&context->allocator, (void **)&context->handlers,
+		                         &context->handlers_cap, context->handlers_len,
+		                         sizeof(action_handler_t))) {
+			mem_free(copy);
+			res = NeuroSDK_OutOfMemory;
+		} else {
+			context->handlers[context->handlers_len++] = (action_handler_t){
+			    .name = copy,
+			    .name_hash = hash_string(name, 0),
+			    .fn = handler,
+			    .user_data = user_data,
+			};
+		}
+	}
+	mtx_unlock(&context->registry_mtx);
+
+	if (res != NeuroSDK_None) {
+		LOG_ERROR(context, "Out of memory storing the handler of '%s'.", name);
+	}
+	return res;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_context_dump_trace(neurosdk_context_t *ctx, char const *path) {
+	if (!ctx || !(*ctx)) {
+		return NeuroSDK_Uninitialized;
+	}
+	context_t *context = (context_t *)(*ctx);
+	if (!context->tracer) {
+		LOG_ERROR(context,
+		          "dump_trace: the context was created without the Trace flag.");
+		return NeuroSDK_Uninitialized;
+	}
+	if (!path) {
+		LOG_ERROR(context, "dump_trace: 'path' is required and is NULL.");
+		return NeuroSDK_InvalidMessage;
+	}
+	return tracer_dump(context, path);
+}
+
+// Walks a "key.list[2].field" path from the parsed data root.
+static json_value_t *action_data_lookup(json_value_t *value, char const *path) {
+	char const *p = path ? path : "";
+	while (*p && value) {
+		if (*p == '[') {
+			char *end = NULL;
+			unsigned long index = strtoul(p + 1, &end, 10);
+			if (end == p + 1 || *end != ']' || value->type != json_type_array) {
+				return NULL;
+			}
+			json_array_element_t *elem = ((json_array_t *)value->payload)->start;
+			while (elem && index--) {
+				elem = elem->next;
+			}
+			value = elem ? elem->value : NULL;
+			p = end + 1;
+			continue;
+		}
+
+		if (*p == '.') {
+			p++;
+		}
+		size_t key_len = strcspn(p, ".[");
+		if (key_len == 0 || value->type != json_type_object) {
+			return NULL;
+		}
+		json_object_element_t *elem = ((json_object_t *)value->payload)->start;
+		while (elem && (elem->name->string_size != key_len ||
+		                memcmp(elem->name->string, p, key_len))) {
+			elem = elem->next;
+		}
+		value = elem ? elem->value : NULL;
+		p += key_len;
+	}
+	return value;
+}
+
+static neurosdk_error_e
+action_data_value(neurosdk_message_action_t const *action,
+                  char const *path,
+                  OUT json_value_t **value) {
+	if (!action) {
+		return NeuroSDK_Uninitialized;
+	}
+	if (!action->parsed_data) {
+		return NeuroSDK_InvalidJSON;
+	}
+	*value = action_data_lookup((json_value_t *)action->parsed_data, path);
+	return *value ? NeuroSDK_None : NeuroSDK_DataPathNotFound;
+}
+
+// json.h numbers are not NUL-terminated, copy them out before converting.
+static neurosdk_error_e
+action_data_number(neurosdk_message_action_t const *action,
+                   char const *path,
+                   OUT char (*buf)[64]) {
+	json_value_t *value = NULL;
+	neurosdk_error_e err = action_data_value(action, path, &value);
+	if (err) {
+		return err;
+	}
+	if (value->type != json_type_number) {
+		return NeuroSDK_DataTypeMismatch;
 	}
-	return ((context_t *)*ctx)->connected;
+	json_number_t *num = (json_number_t *)value->payload;
+	if (num->number_size >= sizeof(*buf)) {
+		return NeuroSDK_DataTypeMismatch;
+	}
+	memcpy(*buf, num->number, num->number_size);
+	(*buf)[num->number_size] = '\0';
+	return NeuroSDK_None;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_int(neurosdk_message_action_t const *action,
+                             char const *path,
+                             OUT int64_t *value) {
+	char buf[64];
+	neurosdk_error_e err = action_data_number(action, path, &buf);
+	if (err) {
+		return err;
+	}
+	char *end = NULL;
+	errno = 0;
+	long long n = strtoll(buf, &end, 10);
+	if (*end || errno == ERANGE) {
+		return NeuroSDK_DataTypeMismatch;
+	}
+	*value = n;
+	return NeuroSDK_None;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_double(neurosdk_message_action_t const *action,
+                                char const *path,
+                                OUT double *value) {
+	char buf[64];
+	neurosdk_error_e err = action_data_number(action, path, &buf);
+	if (err) {
+		return err;
+	}
+	*value = strtod(buf, NULL);
+	return NeuroSDK_None;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_bool(neurosdk_message_action_t const *action,
+                              char const *path,
+                              OUT bool *value) {
+	json_value_t *v = NULL;
+	neurosdk_error_e err = action_data_value(action, path, &v);
+	if (err) {
+		return err;
+	}
+	if (v->type != json_type_true && v->type != json_type_false) {
+		return NeuroSDK_DataTypeMismatch;
+	}
+	*value = v->type == json_type_true;
+	return NeuroSDK_None;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_str(neurosdk_message_action_t const *action,
+                             char const *path,
+                             OUT char const **value,
+                             OUT size_t *len) {
+	json_value_t *v = NULL;
+	neurosdk_error_e err = action_data_value(action, path, &v);
+	if (err) {
+		return err;
+	}
+	if (v->type != json_type_string) {
+		return NeuroSDK_DataTypeMismatch;
+	}
+	json_string_t *str = (json_string_t *)v->payload;
+	*value = str->string;
+	if (len) {
+		*len = str->string_size;
+	}
+	return NeuroSDK_None;
+}
+
+NEUROSDK_EXPORT neurosdk_error_e
+neurosdk_action_data_get_array(neurosdk_message_action_t const *action,
+                               char const *path,
+                               OUT size_t *len) {
+	json_value_t *v = NULL;
+	neurosdk_error_e err = action_data_value(action, path, &v);
+	if (err) {
+		return err;
+	}
+	if (v->type != json_type_array) {
+		return NeuroSDK_DataTypeMismatch;
+	}
+	*len = ((json_array_t *)v->payload)->length;
+	return NeuroSDK_None;
 }
 
 NEUROSDK_EXPORT neurosdk_error_e
@@ -980,10 +5121,14 @@ neurosdk_message_destroy(neurosdk_message_t *msg) {
 	}
 	if (msg->kind == NeuroSDK_MessageKind_Action) {
 		neurosdk_message_action_t *action = &msg->value.action;
-		free(action->id);
-		free(action->name);
+		mem_free(action->id);
+		mem_free(action->name);
 		if (action->data)
-			free(action->data);
+			mem_free(action->data);
+		if (action->parsed_data)
+			mem_free(action->parsed_data);
+		if (action->validation_error)
+			mem_free(action->validation_error);
 	} else {
 		return NeuroSDK_UnknownCommand;
 	}
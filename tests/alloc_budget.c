@@ -0,0 +1,135 @@
+// Fails when an operation allocates more than its budget, so a change that
+// adds allocations to a hot path has to raise the budget here on purpose.
+
+#include <string.h>
+
+#include "common.h"
+
+// Allocations per call, measured with some headroom. Sends on the polling
+// thread flush right away, so their budgets include the websocket frame.
+#define BUDGET_CREATE 16
+#define BUDGET_STARTUP 3
+#define BUDGET_REGISTER 6
+#define BUDGET_CONTEXT 3
+#define BUDGET_FORCE 6
+#define BUDGET_ACTION_RESULT 3
+#define BUDGET_UNREGISTER 3
+#define BUDGET_POLL_EMPTY 0
+#define BUDGET_POLL_ACTION 12
+#define BUDGET_MESSAGE_DESTROY 0
+
+static counting_allocator_t counter;
+
+static size_t allocations(void) {
+	return counting_allocator_allocations(&counter);
+}
+
+static void check_budget(char const *what, size_t before, size_t budget) {
+	size_t used = allocations() - before;
+	printf("%-16s %zu allocations (budget %zu)\n", what, used, budget);
+	CHECK(used <= budget);
+}
+
+static void send_force(neurosdk_context_t *ctx) {
+	char *names[] = {"move"};
+	neurosdk_message_t msg = {.kind = NeuroSDK_MessageKind_ActionsForce};
+	msg.value.actions_force.query = "Pick a cell";
+	msg.value.actions_force.action_names = names;
+	msg.value.actions_force.action_names_len = 1;
+	CHECK_OK(neurosdk_context_send(ctx, &msg));
+}
+
+int main(void) {
+	counting_allocator_init(&counter);
+	test_server_t *server = test_server_start();
+
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	desc.allocator = counting_allocator_hooks(&counter);
+	neurosdk_context_t ctx;
+	size_t before = allocations();
+	CHECK_OK(neurosdk_context_create(&ctx, &desc));
+	check_budget("create", before, BUDGET_CREATE);
+
+	neurosdk_message_t startup = {.kind = NeuroSDK_MessageKind_Startup};
+	before = allocations();
+	CHECK_OK(neurosdk_context_send(&ctx, &startup));
+	check_budget("startup", before, BUDGET_STARTUP);
+
+	neurosdk_action_t action = {
+	    .name = "move",
+	    .description = "Place a mark",
+	    .json_schema = "{\"type\":\"object\"}",
+	};
+	before = allocations();
+	CHECK_OK(neurosdk_context_register_actions(&ctx, &action, 1));
+	check_budget("register", before, BUDGET_REGISTER);
+
+	// The first frames size mongoose's buffers, so warm them up.
+	char const text[] = "The board is empty.";
+	CHECK_OK(neurosdk_context_send_context(&ctx, text, strlen(text), true));
+	test_wait_frames(&ctx, server, 3, 5000);
+
+	before = allocations();
+	CHECK_OK(neurosdk_context_send_context(&ctx, text, strlen(text), true));
+	check_budget("context", before, BUDGET_CONTEXT);
+	test_wait_frames(&ctx, server, 4, 5000);
+
+	neurosdk_message_t *messages = NULL;
+	int count = 0;
+	before = allocations();
+	CHECK_OK(neurosdk_context_poll(&ctx, &messages, &count));
+	check_budget("poll (empty)", before, BUDGET_POLL_EMPTY);
+	CHECK(count == 0);
+
+	before = allocations();
+	send_force(&ctx);
+	check_budget("force", before, BUDGET_FORCE);
+
+	// The action may take a few polls to arrive, only the one that returns it
+	// is measured.
+	uint64_t deadline = neurosdk_time_us() + 5000000;
+	for (;;) {
+		CHECK(neurosdk_time_us() < deadline);
+		before = allocations();
+		CHECK_OK(neurosdk_context_poll(&ctx, &messages, &count));
+		if (count > 0) {
+			break;
+		}
+	}
+	check_budget("poll (action)", before, BUDGET_POLL_ACTION);
+	CHECK(count == 1);
+	CHECK(messages[0].kind == NeuroSDK_MessageKind_Action);
+	CHECK(strcmp(messages[0].value.action.name, "move") == 0);
+
+	char id[32];
+	snprintf(id, sizeof(id), "%s", messages[0].value.action.id);
+	size_t live = counting_allocator_live(&counter);
+	before = allocations();
+	CHECK_OK(neurosdk_message_destroy(&messages[0]));
+	check_budget("message destroy", before, BUDGET_MESSAGE_DESTROY);
+	CHECK(counting_allocator_live(&counter) < live);
+
+	before = allocations();
+	CHECK_OK(neurosdk_context_send_action_result(&ctx, id, strlen(id), true,
+	                                             NULL, 0));
+	check_budget("action result", before, BUDGET_ACTION_RESULT);
+	test_wait_frames(&ctx, server, 6, 5000);
+
+	char *names[] = {"move"};
+	neurosdk_message_t unregister = {
+	    .kind = NeuroSDK_MessageKind_ActionsUnregister,
+	    .value.actions_unregister = {names, 1},
+	};
+	before = allocations();
+	CHECK_OK(neurosdk_context_send(&ctx, &unregister));
+	check_budget("unregister", before, BUDGET_UNREGISTER);
+	test_wait_frames(&ctx, server, 7, 5000);
+
+	CHECK_OK(neurosdk_context_destroy(&ctx));
+	printf("live after destroy: %zu\n", counting_allocator_live(&counter));
+	CHECK(counting_allocator_live(&counter) == 0);
+
+	test_server_stop(server);
+	counting_allocator_free(&counter);
+	return 0;
+}
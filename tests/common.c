@@ -0,0 +1,336 @@
+#include "common.h"
+
+#include <string.h>
+
+#define MG_ENABLE_CUSTOM_CALLOC 1
+#include <mongoose.h>
+
+/////////////////////////
+// Counting Allocator //
+/////////////////////////
+
+static void *counting_alloc(size_t size, void *user_data) {
+	counting_allocator_t *counter = user_data;
+	void *ptr = malloc(size);
+	if (ptr) {
+		mtx_lock(&counter->mtx);
+		counter->allocations++;
+		counter->live++;
+		counter->bytes += size;
+		if (counter->bytes > counter->peak_bytes) {
+			counter->peak_bytes = counter->bytes;
+		}
+		mtx_unlock(&counter->mtx);
+	}
+	return ptr;
+}
+
+static void *counting_realloc(void *ptr,
+                              size_t old_size,
+                              size_t new_size,
+                              void *user_data) {
+	counting_allocator_t *counter = user_data;
+	void *grown = realloc(ptr, new_size);
+	if (grown) {
+		mtx_lock(&counter->mtx);
+		counter->allocations++;
+		counter->bytes += new_size - old_size;
+		if (counter->bytes > counter->peak_bytes) {
+			counter->peak_bytes = counter->bytes;
+		}
+		mtx_unlock(&counter->mtx);
+	}
+	return grown;
+}
+
+static void counting_free(void *ptr, size_t size, void *user_data) {
+	counting_allocator_t *counter = user_data;
+	if (!ptr) {
+		return;
+	}
+	free(ptr);
+	mtx_lock(&counter->mtx);
+	counter->live--;
+	counter->bytes -= size;
+	mtx_unlock(&counter->mtx);
+}
+
+void counting_allocator_init(counting_allocator_t *counter) {
+	memset(counter, 0, sizeof(*counter));
+	CHECK(mtx_init(&counter->mtx, mtx_plain) == thrd_success);
+}
+
+void counting_allocator_free(counting_allocator_t *counter) {
+	mtx_destroy(&counter->mtx);
+}
+
+neurosdk_allocator_t counting_allocator_hooks(counting_allocator_t *counter) {
+	neurosdk_allocator_t hooks = {
+	    .alloc = counting_alloc,
+	    .realloc = counting_realloc,
+	    .free = counting_free,
+	    .user_data = counter,
+	};
+	return hooks;
+}
+
+size_t counting_allocator_allocations(counting_allocator_t *counter) {
+	mtx_lock(&counter->mtx);
+	size_t allocations = counter->allocations;
+	mtx_unlock(&counter->mtx);
+	return allocations;
+}
+
+size_t counting_allocator_live(counting_allocator_t *counter) {
+	mtx_lock(&counter->mtx);
+	size_t live = counter->live;
+	mtx_unlock(&counter->mtx);
+	return live;
+}
+
+size_t counting_allocator_bytes(counting_allocator_t *counter) {
+	mtx_lock(&counter->mtx);
+	size_t bytes = counter->bytes;
+	mtx_unlock(&counter->mtx);
+	return bytes;
+}
+
+size_t counting_allocator_reset_peak(counting_allocator_t *counter) {
+	mtx_lock(&counter->mtx);
+	size_t peak = counter->peak_bytes;
+	counter->peak_bytes = counter->bytes;
+	mtx_unlock(&counter->mtx);
+	return peak;
+}
+
+/////////////////
+// Test Server //
+/////////////////
+
+struct test_server {
+	struct mg_mgr mgr;
+	thrd_t thread;
+	mtx_t mtx;
+	bool stop;
+	bool drop;
+	size_t frames;
+	size_t bytes;
+	char *last_frame;
+	size_t last_len;
+	unsigned next_id;
+	size_t connections;
+	char (*commands)[32];  // Of every frame, in order
+	size_t commands_cap;
+	struct mg_tls_opts tls_opts;
+	bool tls;
+	char url[64];
+};
+
+static void server_add_command(test_server_t *server, struct mg_str frame) {
+	if (server->frames > server->commands_cap) {
+		size_t cap = server->commands_cap ? server->commands_cap * 2 : 64;
+		server->commands =
+		    realloc(server->commands, cap * sizeof(*server->commands));
+		CHECK(server->commands);
+		server->commands_cap = cap;
+	}
+	char *command = server->commands[server->frames - 1];
+	struct mg_str tok = mg_json_get_tok(frame, "$.command");
+	command[0] = '\0';
+	if (tok.len >= 2 && tok.len - 2 < sizeof(*server->commands)) {
+		memcpy(command, tok.buf + 1, tok.len - 2);  // Without the quotes
+		command[tok.len - 2] = '\0';
+	}
+}
+
+static void server_fn(struct mg_connection *c, int ev, void *ev_data) {
+	test_server_t *server = c->fn_data;
+	if (ev == MG_EV_ACCEPT && server->tls) {
+		mg_tls_init(c, &server->tls_opts);
+	} else if (ev == MG_EV_HTTP_MSG) {
+		mg_ws_upgrade(c, ev_data, NULL);
+	} else if (ev == MG_EV_WS_OPEN) {
+		mtx_lock(&server->mtx);
+		server->connections++;
+		mtx_unlock(&server->mtx);
+	} else if (ev == MG_EV_WS_MSG) {
+		struct mg_ws_message *wm = ev_data;
+		if ((wm->flags & 15) != WEBSOCKET_OP_TEXT) {
+			return;
+		}
+		mtx_lock(&server->mtx);
+		server->frames++;
+		server->bytes += wm->data.len;
+		free(server->last_frame);
+		server->last_frame = malloc(wm->data.len + 1);
+		CHECK(server->last_frame);
+		memcpy(server->last_frame, wm->data.buf, wm->data.len);
+		server->last_frame[wm->data.len] = '\0';
+		server->last_len = wm->data.len;
+		server_add_command(server, wm->data);
+		unsigned id = server->next_id++;
+		mtx_unlock(&server->mtx);
+		if (mg_match(wm->data, mg_str("*\"actions/force\"*"), NULL)) {
+			mg_ws_printf(c, WEBSOCKET_OP_TEXT,
+			             "{\"command\":\"action\",\"data\":{\"id\":\"%u\","
+			             "\"name\":\"move\",\"data\":\"{\\\"cell\\\":3}\"}}",
+			             id);
+		}
+	}
+}
+
+static int server_run(void *arg) {
+	test_server_t *server = arg;
+	for (;;) {
+		mtx_lock(&server->mtx);
+		bool stop = server->stop;
+		bool drop = server->drop;
+		server->drop = false;
+		mtx_unlock(&server->mtx);
+		if (stop) {
+			return 0;
+		}
+		for (struct mg_connection *c = server->mgr.conns; drop && c; c = c->next) {
+			if (c->is_websocket) {
+				c->is_closing = 1;
+			}
+		}
+		mg_mgr_poll(&server->mgr, 10);
+	}
+}
+
+test_server_t *test_server_start(void) {
+	return test_server_start_tls(NULL, NULL);
+}
+
+test_server_t *test_server_start_tls(char const *cert, char const *key) {
+	test_server_t *server = calloc(1, sizeof(*server));
+	CHECK(server);
+	if (cert) {
+		server->tls_opts.cert = mg_str(cert);
+		server->tls_opts.key = mg_str(key);
+		server->tls = true;
+	}
+	CHECK(mtx_init(&server->mtx, mtx_plain) == thrd_success);
+	mg_log_set(MG_LL_NONE);
+	mg_mgr_init(&server->mgr);
+	struct mg_connection *listener =
+	    mg_http_listen(&server->mgr, "http://127.0.0.1:0", server_fn, server);
+	CHECK(listener);
+	snprintf(server->url, sizeof(server->url), "%s://127.0.0.1:%u",
+	         server->tls ? "wss" : "ws", (unsigned)mg_ntohs(listener->loc.port));
+	CHECK(thrd_create(&server->thread, server_run, server) == thrd_success);
+	return server;
+}
+
+void test_server_stop(test_server_t *server) {
+	mtx_lock(&server->mtx);
+	server->stop = true;
+	mtx_unlock(&server->mtx);
+	thrd_join(server->thread, NULL);
+	mg_mgr_free(&server->mgr);
+	mtx_destroy(&server->mtx);
+	free(server->last_frame);
+	free(server->commands);
+	free(server);
+}
+
+char const *test_server_url(test_server_t *server) {
+	return server->url;
+}
+
+size_t test_server_frames(test_server_t *server) {
+	mtx_lock(&server->mtx);
+	size_t frames = server->frames;
+	mtx_unlock(&server->mtx);
+	return frames;
+}
+
+size_t test_server_bytes(test_server_t *server) {
+	mtx_lock(&server->mtx);
+	size_t bytes = server->bytes;
+	mtx_unlock(&server->mtx);
+	return bytes;
+}
+
+size_t test_server_connections(test_server_t *server) {
+	mtx_lock(&server->mtx);
+	size_t connections = server->connections;
+	mtx_unlock(&server->mtx);
+	return connections;
+}
+
+void test_server_drop(test_server_t *server) {
+	mtx_lock(&server->mtx);
+	server->drop = true;
+	mtx_unlock(&server->mtx);
+}
+
+size_t test_server_count(test_server_t *server, char const *command) {
+	size_t count = 0;
+	mtx_lock(&server->mtx);
+	for (size_t i = 0; i < server->frames; i++) {
+		count += !strcmp(server->commands[i], command);
+	}
+	mtx_unlock(&server->mtx);
+	return count;
+}
+
+char *test_server_command(test_server_t *server, size_t n) {
+	mtx_lock(&server->mtx);
+	char *command = NULL;
+	if (n < server->frames) {
+		command = malloc(sizeof(*server->commands));
+		CHECK(command);
+		memcpy(command, server->commands[n], sizeof(*server->commands));
+	}
+	mtx_unlock(&server->mtx);
+	return command;
+}
+
+char *test_server_last_frame(test_server_t *server, size_t *len) {
+	mtx_lock(&server->mtx);
+	char *frame = NULL;
+	*len = server->last_len;
+	if (server->last_frame) {
+		frame = malloc(server->last_len + 1);
+		CHECK(frame);
+		memcpy(frame, server->last_frame, server->last_len + 1);
+	}
+	mtx_unlock(&server->mtx);
+	return frame;
+}
+
+void test_wait_frames(neurosdk_context_t *ctx,
+                      test_server_t *server,
+                      size_t frames,
+                      int timeout_ms) {
+	uint64_t deadline = neurosdk_time_us() + (uint64_t)timeout_ms * 1000;
+	while (test_server_frames(server) < frames) {
+		CHECK(neurosdk_time_us() < deadline);
+		neurosdk_message_t *messages = NULL;
+		int count = 0;
+		CHECK_OK(neurosdk_context_poll(ctx, &messages, &count));
+		for (int i = 0; i < count; i++) {
+			neurosdk_message_destroy(&messages[i]);
+		}
+	}
+}
+
+static void quiet_log(neurosdk_severity_e severity,
+                      char *message,
+                      void *user_data) {
+	(void)severity;
+	(void)message;
+	(void)user_data;
+}
+
+neurosdk_context_create_desc_t test_desc(test_server_t *server) {
+	neurosdk_context_create_desc_t desc = {
+	    .url = test_server_url(server),
+	    .game_name = "Test",
+	    .poll_ms = 5,
+	    .callback_log = quiet_log,
+	};
+	return desc;
+}
@@ -0,0 +1,85 @@
+#ifndef NEURO_SDK_TESTS_COMMON_H
+#define NEURO_SDK_TESTS_COMMON_H
+
+#include <neurosdk.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tinycthread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHECK(cond)                                                      \
+	do {                                                                   \
+		if (!(cond)) {                                                       \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+			        #cond);                                                    \
+			exit(1);                                                           \
+		}                                                                    \
+	} while (0)
+
+#define CHECK_OK(expr) CHECK((expr) == NeuroSDK_None)
+
+// Allocator that counts what a context allocates through it. Safe to share
+// between threads.
+typedef struct counting_allocator {
+	mtx_t mtx;
+	size_t allocations;  // Calls to alloc and realloc
+	size_t live;         // Blocks not yet freed
+	size_t bytes;
+	size_t peak_bytes;
+} counting_allocator_t;
+
+void counting_allocator_init(counting_allocator_t *counter);
+void counting_allocator_free(counting_allocator_t *counter);
+neurosdk_allocator_t counting_allocator_hooks(counting_allocator_t *counter);
+size_t counting_allocator_allocations(counting_allocator_t *counter);
+size_t counting_allocator_live(counting_allocator_t *counter);
+size_t counting_allocator_bytes(counting_allocator_t *counter);
+// Resets the peak to what is allocated now and returns the old peak.
+size_t counting_allocator_reset_peak(counting_allocator_t *counter);
+
+// Websocket server on 127.0.0.1 running on its own thread. It counts the
+// text frames it receives, keeps their commands and answers every
+// actions/force with an action named "move".
+typedef struct test_server test_server_t;
+
+test_server_t *test_server_start(void);
+// Serves wss:// with a PEM certificate and EC key, which must outlive the
+// server.
+test_server_t *test_server_start_tls(char const *cert, char const *key);
+void test_server_stop(test_server_t *server);
+char const *test_server_url(test_server_t *server);
+size_t test_server_frames(test_server_t *server);
+size_t test_server_bytes(test_server_t *server);
+// Websocket connections opened so far.
+size_t test_server_connections(test_server_t *server);
+// Closes every open websocket connection on the server's next poll.
+void test_server_drop(test_server_t *server);
+// Frames received with this "command".
+size_t test_server_count(test_server_t *server, char const *command);
+// Copy of the command of the `n`th frame, from 0, which the caller frees.
+// NULL if there is no such frame.
+char *test_server_command(test_server_t *server, size_t n);
+// Copy of the last frame received, which the caller frees. NULL before the
+// first frame.
+char *test_server_last_frame(test_server_t *server, size_t *len);
+
+// Polls `ctx` until the server has received `frames` frames in total, or
+// fails the test after `timeout_ms`. Polled messages are destroyed.
+void test_wait_frames(neurosdk_context_t *ctx,
+                      test_server_t *server,
+                      size_t frames,
+                      int timeout_ms);
+
+// Creation descriptor for `server` with quiet logs and a short poll.
+neurosdk_context_create_desc_t test_desc(test_server_t *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // NEURO_SDK_TESTS_COMMON_H
@@ -0,0 +1,111 @@
+// Drops the connection from the server side and checks that the context
+// reconnects, sends startup and the registered actions again, and delivers
+// what was sent while it was away. Without reconnecting a drop stays a drop.
+
+#include <string.h>
+
+#include "common.h"
+
+static void poll_once(neurosdk_context_t *ctx) {
+	neurosdk_message_t *messages = NULL;
+	int count = 0;
+	CHECK_OK(neurosdk_context_poll(ctx, &messages, &count));
+	for (int i = 0; i < count; i++) {
+		neurosdk_message_destroy(&messages[i]);
+	}
+}
+
+static void wait_disconnected(neurosdk_context_t *ctx, int timeout_ms) {
+	uint64_t deadline = neurosdk_time_us() + (uint64_t)timeout_ms * 1000;
+	while (neurosdk_context_connected(ctx)) {
+		CHECK(neurosdk_time_us() < deadline);
+		poll_once(ctx);
+	}
+}
+
+static uint64_t reconnects(neurosdk_context_t *ctx) {
+	neurosdk_context_stats_t stats;
+	CHECK_OK(neurosdk_context_stats(ctx, &stats));
+	return stats.reconnects;
+}
+
+static void check_command(test_server_t *server, size_t n, char const *want) {
+	char *command = test_server_command(server, n);
+	CHECK(command && !strcmp(command, want));
+	free(command);
+}
+
+static void check_reconnects(test_server_t *server) {
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	desc.reconnect_min_ms = 20;
+	desc.reconnect_max_ms = 200;
+	neurosdk_context_t ctx = NULL;
+	CHECK_OK(neurosdk_context_create(&ctx, &desc));
+
+	neurosdk_message_t startup = {.kind = NeuroSDK_MessageKind_Startup};
+	CHECK_OK(neurosdk_context_send(&ctx, &startup));
+	neurosdk_action_t actions[] = {
+	    {.name = "move", .description = "Moves a piece."},
+	    {.name = "jump", .description = "Jumps over a piece."},
+	};
+	CHECK_OK(neurosdk_context_register_actions(&ctx, actions, 2));
+	char *names[] = {"jump"};
+	neurosdk_message_t unregister = {
+	    .kind = NeuroSDK_MessageKind_ActionsUnregister,
+	    .value.actions_unregister = {names, 1},
+	};
+	CHECK_OK(neurosdk_context_send(&ctx, &unregister));
+	test_wait_frames(&ctx, server, 3, 5000);
+	CHECK(test_server_connections(server) == 1);
+
+	// The new connection is told startup and the one action left.
+	test_server_drop(server);
+	wait_disconnected(&ctx, 5000);
+	test_wait_frames(&ctx, server, 5, 5000);
+	CHECK(test_server_connections(server) == 2);
+	CHECK(reconnects(&ctx) == 1);
+	check_command(server, 3, "startup");
+	check_command(server, 4, "actions/register");
+	size_t len;
+	char *frame = test_server_last_frame(server, &len);
+	CHECK(frame && strstr(frame, "\"move\"") && !strstr(frame, "\"jump\""));
+	free(frame);
+
+	// Sent while disconnected, the context follows the restored session.
+	test_server_drop(server);
+	wait_disconnected(&ctx, 5000);
+	CHECK_OK(neurosdk_context_send_context(&ctx, "Away", 4, false));
+	test_wait_frames(&ctx, server, 8, 5000);
+	CHECK(reconnects(&ctx) == 2);
+	check_command(server, 5, "startup");
+	check_command(server, 6, "actions/register");
+	check_command(server, 7, "context");
+
+	CHECK_OK(neurosdk_context_shutdown(&ctx, 1000, NULL));
+}
+
+static void check_stays_lost(test_server_t *server) {
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	neurosdk_context_t ctx = NULL;
+	CHECK_OK(neurosdk_context_create(&ctx, &desc));
+	size_t connections = test_server_connections(server);
+
+	test_server_drop(server);
+	wait_disconnected(&ctx, 5000);
+	CHECK(neurosdk_context_send_context(&ctx, "Lost", 4, false) ==
+	      NeuroSDK_ConnectionError);
+	for (int i = 0; i < 20; i++) {
+		poll_once(&ctx);
+	}
+	CHECK(test_server_connections(server) == connections);
+	CHECK(reconnects(&ctx) == 0);
+	CHECK_OK(neurosdk_context_destroy(&ctx));
+}
+
+int main(void) {
+	test_server_t *server = test_server_start();
+	check_reconnects(server);
+	check_stays_lost(server);
+	test_server_stop(server);
+	return 0;
+}
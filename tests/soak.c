@@ -0,0 +1,166 @@
+// Runs many connect, send and poll sessions and checks that every allocation
+// is returned, both when a context is destroyed and between the rounds of a
+// session, where neither the live blocks nor the bytes they hold may grow.
+// Also destroys contexts with messages still queued either way. Set
+// NEUROSDK_SOAK_ITERATIONS and NEUROSDK_SOAK_ROUNDS to run longer; the "long"
+// test does a million round trips.
+
+#include <string.h>
+
+#include "common.h"
+
+#define DEFAULT_ITERATIONS 50
+#define DEFAULT_ROUNDS 100
+
+static void send_force(neurosdk_context_t *ctx) {
+	char *names[] = {"move"};
+	neurosdk_message_t msg = {.kind = NeuroSDK_MessageKind_ActionsForce};
+	msg.value.actions_force.state = "Turn 1";
+	msg.value.actions_force.query = "Pick a cell";
+	msg.value.actions_force.action_names = names;
+	msg.value.actions_force.action_names_len = 1;
+	CHECK_OK(neurosdk_context_send(ctx, &msg));
+}
+
+// Polls until one action arrives, answers it and returns.
+static void answer_action(neurosdk_context_t *ctx) {
+	uint64_t deadline = neurosdk_time_us() + 5000000;
+	for (;;) {
+		CHECK(neurosdk_time_us() < deadline);
+		neurosdk_message_t *messages = NULL;
+		int count = 0;
+		CHECK_OK(neurosdk_context_poll(ctx, &messages, &count));
+		if (!count) {
+			continue;
+		}
+		CHECK(count == 1);
+		CHECK(messages[0].kind == NeuroSDK_MessageKind_Action);
+		char const *id = messages[0].value.action.id;
+		CHECK_OK(neurosdk_context_send_action_result(ctx, id, strlen(id), true,
+		                                             "Placed", 6));
+		CHECK_OK(neurosdk_message_destroy(&messages[0]));
+		return;
+	}
+}
+
+static int env_int(char const *name, int fallback) {
+	char const *env = getenv(name);
+	return env && atoi(env) > 0 ? atoi(env) : fallback;
+}
+
+static void run_session(test_server_t *server,
+                        counting_allocator_t *counter,
+                        int rounds) {
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	desc.allocator = counting_allocator_hooks(counter);
+	neurosdk_context_t ctx;
+	CHECK_OK(neurosdk_context_create(&ctx, &desc));
+
+	neurosdk_action_t action = {
+	    .name = "move",
+	    .description = "Place a mark",
+	    .json_schema = "{\"type\":\"object\"}",
+	};
+	CHECK_OK(neurosdk_context_register_actions(&ctx, &action, 1));
+
+	size_t settled = 0;
+	size_t settled_bytes = 0;
+	for (int round = 0; round < rounds; round++) {
+		char text[64];
+		int len = snprintf(text, sizeof(text), "Round %d started.", round);
+		CHECK_OK(neurosdk_context_send_context(&ctx, text, (size_t)len, true));
+		send_force(&ctx);
+		answer_action(&ctx);
+
+		// Buffers are sized by the first round, after that a round must not
+		// leave anything behind, nor grow a buffer it keeps.
+		size_t live = counting_allocator_live(counter);
+		size_t bytes = counting_allocator_bytes(counter);
+		if (round == 1) {
+			settled = live;
+			settled_bytes = bytes;
+		} else if (round > 1 && (live > settled || bytes > settled_bytes)) {
+			fprintf(stderr,
+			        "round %d: %zu live allocations of %zu bytes, %zu of %zu after "
+			        "round 1\n",
+			        round, live, bytes, settled, settled_bytes);
+			CHECK(live <= settled && bytes <= settled_bytes);
+		}
+	}
+
+	CHECK_OK(neurosdk_context_destroy(&ctx));
+	CHECK(counting_allocator_live(counter) == 0);
+}
+
+// Throttled to one context message per second, so all but the first wait in
+// the outbound queue when the context is destroyed.
+static void destroy_with_outbound(test_server_t *server,
+                                  counting_allocator_t *counter) {
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	desc.allocator = counting_allocator_hooks(counter);
+	desc.rate_limits[NeuroSDK_MessageKind_Context] =
+	    (neurosdk_rate_limit_t){.messages_per_second = 1, .burst = 1};
+	neurosdk_context_t ctx;
+	CHECK_OK(neurosdk_context_create(&ctx, &desc));
+	for (int i = 0; i < 8; i++) {
+		char text[64];
+		int len = snprintf(text, sizeof(text), "Queued %d.", i);
+		CHECK_OK(neurosdk_context_send_context(&ctx, text, (size_t)len, true));
+	}
+	neurosdk_context_stats_t stats;
+	CHECK_OK(neurosdk_context_stats(&ctx, &stats));
+	CHECK(stats.pending_messages > 0);
+	CHECK_OK(neurosdk_context_destroy(&ctx));
+	CHECK(counting_allocator_live(counter) == 0);
+}
+
+// Parses one action at a time and destroys the context while the others are
+// still waiting as received frames.
+static void destroy_with_inbound(test_server_t *server,
+                                 counting_allocator_t *counter) {
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	desc.allocator = counting_allocator_hooks(counter);
+	neurosdk_context_t ctx;
+	CHECK_OK(neurosdk_context_create(&ctx, &desc));
+	size_t frames = test_server_frames(server);
+	for (int i = 0; i < 4; i++) {
+		send_force(&ctx);
+	}
+	uint64_t deadline = neurosdk_time_us() + 5000000;
+	while (test_server_frames(server) < frames + 4) {
+		CHECK(neurosdk_time_us() < deadline);
+		thrd_yield();
+	}
+
+	int count = 0;
+	while (!count) {
+		CHECK(neurosdk_time_us() < deadline);
+		neurosdk_message_t *messages = NULL;
+		CHECK_OK(neurosdk_context_poll_budget(&ctx, 1, 0, &messages, &count));
+		CHECK(count <= 1);
+		if (count) {
+			CHECK_OK(neurosdk_message_destroy(&messages[0]));
+		}
+	}
+	CHECK_OK(neurosdk_context_destroy(&ctx));
+	CHECK(counting_allocator_live(counter) == 0);
+}
+
+int main(void) {
+	int iterations = env_int("NEUROSDK_SOAK_ITERATIONS", DEFAULT_ITERATIONS);
+	int rounds = env_int("NEUROSDK_SOAK_ROUNDS", DEFAULT_ROUNDS);
+
+	counting_allocator_t counter;
+	counting_allocator_init(&counter);
+	test_server_t *server = test_server_start();
+	for (int i = 0; i < iterations; i++) {
+		run_session(server, &counter, rounds);
+	}
+	destroy_with_outbound(server, &counter);
+	destroy_with_inbound(server, &counter);
+	printf("%d sessions of %d round trips, %zu allocations\n", iterations,
+	       rounds, counting_allocator_allocations(&counter));
+	test_server_stop(server);
+	counting_allocator_free(&counter);
+	return 0;
+}
@@ -0,0 +1,162 @@
+// Sends a multi-megabyte actions/force state and context message, which go
+// out as fragmented frames serialized a fragment at a time, and checks what
+// the server and the recording received and how much memory it took.
+
+#include <string.h>
+
+#include "common.h"
+
+#define STATE_LEN (1536 * 1024)
+#define CONTEXT_LEN (600 * 1024)
+#define RECORD_PATH "stream.rec"
+
+// JSON string escape, written independently of the library's.
+static char *escape(char const *str, size_t len, size_t *out_len) {
+	char *out = malloc(len * 6 + 1);
+	CHECK(out);
+	size_t n = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char ch = (unsigned char)str[i];
+		if (ch == '"' || ch == '\\') {
+			out[n++] = '\\';
+			out[n++] = (char)ch;
+		} else if (ch == '\n') {
+			n += (size_t)sprintf(out + n, "\\n");
+		} else if (ch == '\t') {
+			n += (size_t)sprintf(out + n, "\\t");
+		} else if (ch == '\r') {
+			n += (size_t)sprintf(out + n, "\\r");
+		} else if (ch < 32) {
+			n += (size_t)sprintf(out + n, "\\u%04X", ch);
+		} else {
+			out[n++] = (char)ch;
+		}
+	}
+	out[n] = '\0';
+	*out_len = n;
+	return out;
+}
+
+// Text with every kind of escape, and a NUL byte unless `terminated`.
+static char *make_text(size_t len, bool terminated) {
+	static char const pattern[] = "Cell 3 is \"taken\" \\ row\n\t\r\x01 ok ";
+	char *text = malloc(len + 1);
+	CHECK(text);
+	for (size_t i = 0; i < len; i++) {
+		text[i] = pattern[i % (sizeof(pattern) - 1)];
+	}
+	if (!terminated) {
+		text[len / 2] = '\0';
+	}
+	text[len] = '\0';
+	return text;
+}
+
+static bool contains(char const *haystack,
+                     size_t haystack_len,
+                     char const *needle,
+                     size_t needle_len) {
+	for (size_t i = 0; i + needle_len <= haystack_len; i++) {
+		if (!memcmp(haystack + i, needle, needle_len)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Checks that the last frame the server received holds `key` followed by
+// `text` escaped, and returns it.
+static char *check_frame(test_server_t *server,
+                         char const *key,
+                         char const *text,
+                         size_t len,
+                         size_t *frame_len) {
+	size_t escaped_len;
+	char *escaped = escape(text, len, &escaped_len);
+	size_t key_len = strlen(key);
+	char *expected = malloc(key_len + escaped_len + 1);
+	CHECK(expected);
+	memcpy(expected, key, key_len);
+	memcpy(expected + key_len, escaped, escaped_len + 1);
+	free(escaped);
+
+	char *frame = test_server_last_frame(server, frame_len);
+	CHECK(frame);
+	CHECK(contains(frame, *frame_len, expected, key_len + escaped_len));
+	free(expected);
+	return frame;
+}
+
+// Checks that the recording holds an outbound record equal to `frame`.
+static void check_recording(char const *frame, size_t len) {
+	FILE *file = fopen(RECORD_PATH, "rb");
+	CHECK(file);
+	unsigned char header[16];
+	CHECK(fread(header, 1, sizeof(header), file) == sizeof(header));
+	bool found = false;
+	while (!found && fread(header, 1, sizeof(header), file) == sizeof(header)) {
+		size_t record_len = (size_t)header[8] | (size_t)header[9] << 8 |
+		                    (size_t)header[10] << 16 | (size_t)header[11] << 24;
+		size_t padded = (record_len + 7) / 8 * 8;
+		char *record = malloc(padded + 1);
+		CHECK(record);
+		CHECK(fread(record, 1, padded, file) == padded);
+		found = header[12] == 1 && record_len == len && !memcmp(record, frame, len);
+		free(record);
+	}
+	fclose(file);
+	remove(RECORD_PATH);
+	CHECK(found);
+}
+
+int main(void) {
+	counting_allocator_t counter;
+	counting_allocator_init(&counter);
+	test_server_t *server = test_server_start();
+
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	desc.allocator = counting_allocator_hooks(&counter);
+	desc.record_path = RECORD_PATH;
+	neurosdk_context_t ctx;
+	CHECK_OK(neurosdk_context_create(&ctx, &desc));
+
+	char *state = make_text(STATE_LEN, true);
+	char *names[] = {"move"};
+	neurosdk_message_t msg = {.kind = NeuroSDK_MessageKind_ActionsForce};
+	msg.value.actions_force.state = state;
+	msg.value.actions_force.query = "Pick a cell";
+	msg.value.actions_force.action_names = names;
+	msg.value.actions_force.action_names_len = 1;
+
+	// The state is held once, unescaped, next to a window of frames.
+	size_t before = counting_allocator_bytes(&counter);
+	counting_allocator_reset_peak(&counter);
+	CHECK_OK(neurosdk_context_send(&ctx, &msg));
+	test_wait_frames(&ctx, server, 1, 10000);
+	size_t peak = counting_allocator_reset_peak(&counter) - before;
+	printf("state of %d bytes sent with a peak of %zu bytes\n", STATE_LEN, peak);
+	CHECK(peak < STATE_LEN + 1024 * 1024);
+
+	size_t force_len;
+	char *force = check_frame(server, "\"state\":\"", state, STATE_LEN,
+	                          &force_len);
+	free(state);
+
+	char *text = make_text(CONTEXT_LEN, false);
+	CHECK_OK(neurosdk_context_send_context(&ctx, text, CONTEXT_LEN, false));
+	test_wait_frames(&ctx, server, 2, 10000);
+	size_t context_len;
+	char *context = check_frame(server, "\"message\":\"", text, CONTEXT_LEN,
+	                            &context_len);
+	free(text);
+
+	CHECK_OK(neurosdk_context_destroy(&ctx));
+	CHECK(counting_allocator_live(&counter) == 0);
+	check_recording(force, force_len);
+	free(force);
+	free(context);
+
+	test_server_stop(server);
+	counting_allocator_free(&counter);
+	return 0;
+}
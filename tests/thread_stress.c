@@ -0,0 +1,104 @@
+// Sends from several threads while others read the statistics and the
+// heartbeat is running, and checks that every message arrives. Build with
+// NEURO_SANITIZE=thread to have races reported as failures.
+
+#include <string.h>
+
+#include "common.h"
+
+#define SENDERS 4
+#define READERS 2
+#define MESSAGES_PER_SENDER 500
+
+typedef struct shared {
+	neurosdk_context_t ctx;
+	mtx_t mtx;
+	bool done;
+} shared_t;
+
+static bool is_done(shared_t *shared) {
+	mtx_lock(&shared->mtx);
+	bool done = shared->done;
+	mtx_unlock(&shared->mtx);
+	return done;
+}
+
+static int send_messages(void *arg) {
+	shared_t *shared = arg;
+	for (int i = 0; i < MESSAGES_PER_SENDER; i++) {
+		char text[64];
+		int len = snprintf(text, sizeof(text), "Message %d.", i);
+		neurosdk_error_e err;
+		// The polling thread drains the queue, wait for it when it is full.
+		while ((err = neurosdk_context_send_context(&shared->ctx, text,
+		                                            (size_t)len, true)) ==
+		       NeuroSDK_MessageQueueFull) {
+			thrd_yield();
+		}
+		CHECK_OK(err);
+	}
+	return 0;
+}
+
+static int read_stats(void *arg) {
+	shared_t *shared = arg;
+	while (!is_done(shared)) {
+		neurosdk_context_stats_t stats;
+		CHECK_OK(neurosdk_context_stats(&shared->ctx, &stats));
+		neurosdk_rtt_stats_t rtt;
+		CHECK_OK(neurosdk_context_rtt(&shared->ctx, &rtt));
+		CHECK(rtt.pongs_received <= rtt.pings_sent);
+		neurosdk_context_connected(&shared->ctx);
+		thrd_yield();
+	}
+	return 0;
+}
+
+int main(void) {
+	counting_allocator_t counter;
+	counting_allocator_init(&counter);
+	test_server_t *server = test_server_start();
+
+	shared_t shared = {0};
+	CHECK(mtx_init(&shared.mtx, mtx_plain) == thrd_success);
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	desc.allocator = counting_allocator_hooks(&counter);
+	desc.heartbeat_interval_ms = 1;
+	desc.heartbeat_max_missed = 1000;
+	CHECK_OK(neurosdk_context_create(&shared.ctx, &desc));
+
+	thrd_t senders[SENDERS];
+	thrd_t readers[READERS];
+	for (int i = 0; i < SENDERS; i++) {
+		CHECK(thrd_create(&senders[i], send_messages, &shared) == thrd_success);
+	}
+	for (int i = 0; i < READERS; i++) {
+		CHECK(thrd_create(&readers[i], read_stats, &shared) == thrd_success);
+	}
+
+	test_wait_frames(&shared.ctx, server, SENDERS * MESSAGES_PER_SENDER,
+	                 30000);
+	for (int i = 0; i < SENDERS; i++) {
+		thrd_join(senders[i], NULL);
+	}
+	mtx_lock(&shared.mtx);
+	shared.done = true;
+	mtx_unlock(&shared.mtx);
+	for (int i = 0; i < READERS; i++) {
+		thrd_join(readers[i], NULL);
+	}
+
+	neurosdk_rtt_stats_t rtt;
+	CHECK_OK(neurosdk_context_rtt(&shared.ctx, &rtt));
+	printf("%d messages, %llu pings, %llu pongs\n",
+	       SENDERS * MESSAGES_PER_SENDER, (unsigned long long)rtt.pings_sent,
+	       (unsigned long long)rtt.pongs_received);
+	CHECK(test_server_frames(server) == SENDERS * MESSAGES_PER_SENDER);
+
+	CHECK_OK(neurosdk_context_destroy(&shared.ctx));
+	CHECK(counting_allocator_live(&counter) == 0);
+	mtx_destroy(&shared.mtx);
+	test_server_stop(server);
+	counting_allocator_free(&counter);
+	return 0;
+}
@@ -0,0 +1,175 @@
+// Builds the C++ wrapper and checks its templates: the compile-time schema,
+// decode(), the data accessors on a polled MessageBatch, and a Task awaiting
+// a force on an Executor, answered with a result.
+
+#include <neurosdk.hpp>
+
+#include <string>
+#include <string_view>
+
+#include "common.h"
+
+struct Move {
+	int cell;
+
+	static constexpr char name[] = "move";
+	static constexpr char description[] = "Place your mark on a cell.";
+	static constexpr auto fields() {
+		return std::tuple{
+		    neurosdk::field<&Move::cell>("cell", neurosdk::range(0, 8))};
+	}
+};
+
+struct Say {
+	std::string text;
+	std::string_view mood;
+	int8_t volume;
+	double pitch;
+	bool loud;
+
+	static constexpr char name[] = "say";
+	static constexpr char description[] = "Say something.";
+	static constexpr auto fields() {
+		return std::tuple{
+		    neurosdk::field<&Say::text>("text"),
+		    neurosdk::field<&Say::mood>("mood", neurosdk::one_of("calm", "angry")),
+		    neurosdk::field<&Say::volume>("volume"),
+		    neurosdk::field<&Say::pitch>("pitch", neurosdk::range(0, 2)),
+		    neurosdk::field<&Say::loud>("loud"),
+		};
+	}
+};
+
+static_assert(neurosdk::ActionSchema<Move>::json ==
+              "{\"type\":\"object\",\"properties\":{\"cell\":{\"type\":"
+              "\"integer\",\"minimum\":0,\"maximum\":8}},\"required\":"
+              "[\"cell\"]}");
+static_assert(neurosdk::ActionSchema<Say>::json ==
+              "{\"type\":\"object\",\"properties\":{"
+              "\"text\":{\"type\":\"string\"},"
+              "\"mood\":{\"type\":\"string\",\"enum\":[\"calm\",\"angry\"]},"
+              "\"volume\":{\"type\":\"integer\"},"
+              "\"pitch\":{\"type\":\"number\",\"minimum\":0,\"maximum\":2},"
+              "\"loud\":{\"type\":\"boolean\"}},"
+              "\"required\":"
+              "[\"text\",\"mood\",\"volume\",\"pitch\",\"loud\"]}");
+
+static void check_decode() {
+	std::optional<Move> move = neurosdk::decode<Move>(" { \"cell\" : 3 } ");
+	CHECK(move && move->cell == 3);
+	CHECK(!neurosdk::decode<Move>("{\"cell\":9}"));
+	CHECK(!neurosdk::decode<Move>("{\"cell\":\"3\"}"));
+	CHECK(!neurosdk::decode<Move>("{}"));
+	CHECK(!neurosdk::decode<Move>("{\"cell\":3"));
+	CHECK(!neurosdk::decode<Move>("{\"cell\":3} x"));
+	move = neurosdk::decode<Move>(
+	    "{\"hint\":{\"why\":[1,\"two\",null]},\"cell\":0}");
+	CHECK(move && move->cell == 0);
+
+	std::optional<Say> say = neurosdk::decode<Say>(
+	    "{\"text\":\"a\\\"b\\u00e9\",\"mood\":\"calm\",\"volume\":-128,"
+	    "\"pitch\":1.5,\"loud\":true}");
+	CHECK(say);
+	CHECK(say->text == "a\"b\xc3\xa9");
+	CHECK(say->mood == "calm");
+	CHECK(say->volume == -128);
+	CHECK(say->pitch == 1.5);
+	CHECK(say->loud);
+	// Out of the enum, of int8_t, of the range, and a string_view that would
+	// need unescaping.
+	CHECK(!neurosdk::decode<Say>("{\"text\":\"\",\"mood\":\"sad\",\"volume\":0,"
+	                             "\"pitch\":1,\"loud\":false}"));
+	CHECK(!neurosdk::decode<Say>("{\"text\":\"\",\"mood\":\"calm\","
+	                             "\"volume\":128,\"pitch\":1,\"loud\":false}"));
+	CHECK(!neurosdk::decode<Say>("{\"text\":\"\",\"mood\":\"calm\",\"volume\":0,"
+	                             "\"pitch\":2.5,\"loud\":false}"));
+	CHECK(!neurosdk::decode<Say>("{\"text\":\"\",\"mood\":\"c\\u0061lm\","
+	                             "\"volume\":0,\"pitch\":1,\"loud\":false}"));
+}
+
+static void send_force(neurosdk::Context &ctx) {
+	char name[] = "move";
+	char *names[] = {name};
+	neurosdk_message_t msg{};
+	msg.kind = NeuroSDK_MessageKind_ActionsForce;
+	msg.value.actions_force.query = const_cast<char *>("Pick a cell");
+	msg.value.actions_force.action_names = names;
+	msg.value.actions_force.action_names_len = 1;
+	ctx.send(msg);
+}
+
+static void check_batch(test_server_t *server) {
+	neurosdk_context_create_desc_t desc = test_desc(server);
+	desc.flags = NeuroSDK_ContextCreateFlags_ParseActionData;
+	neurosdk::Context ctx(desc);
+	send_force(ctx);
+
+	uint64_t deadline = neurosdk_time_us() + 5000000;
+	neurosdk::MessageBatch batch;
+	while (batch.empty()) {
+		CHECK(neurosdk_time_us() < deadline);
+		batch = ctx.poll();
+	}
+	CHECK(batch.size() == 1);
+	size_t seen = 0;
+	for (neurosdk::ActionView action : batch) {
+		CHECK(action.name() == "move");
+		CHECK(action.data() == "{\"cell\":3}");
+		CHECK(action.data_int("cell") == 3);
+		CHECK(action.data_double("cell") == 3.0);
+		CHECK(!action.data_string("cell"));
+		CHECK(!action.data_bool("cell"));
+		CHECK(!action.data_array_size("cell"));
+		CHECK(!action.validation_error());
+		CHECK(action.sequence() > 0);
+		ctx.result(action.id(), true);
+		seen++;
+	}
+	CHECK(seen == 1);
+	// Messages must be destroyed before the context they came from.
+	batch = neurosdk::MessageBatch();
+	ctx.shutdown(std::chrono::milliseconds(1000));
+}
+
+static neurosdk::Task<int> force_move(neurosdk::Context &ctx) {
+	neurosdk::Force force;
+	force.query = "Pick a cell";
+	force.action_names = {"move"};
+	neurosdk::Action action = co_await ctx.force(std::move(force));
+	CHECK(action.name == "move" && action.data);
+	std::optional<Move> move = neurosdk::decode<Move>(*action.data);
+	CHECK(move);
+	ctx.result(action.id, true, "Placed");
+	co_return move->cell;
+}
+
+static neurosdk::Task<void> play(neurosdk::Context &ctx, int &cell) {
+	ctx.startup();
+	ctx.register_actions<Move, Say>();
+	cell = co_await force_move(ctx);
+}
+
+static void check_executor(test_server_t *server) {
+	neurosdk::Context ctx(test_desc(server));
+	size_t frames = test_server_frames(server);
+	int cell = -1;
+	neurosdk::Executor executor;
+	executor.spawn(ctx, play(ctx, cell));
+	executor.run();
+	CHECK(cell == 3);
+	CHECK(ctx.take_unhandled().empty());
+
+	// Startup, register, force and the result.
+	neurosdk_context_t handle = ctx.handle();
+	test_wait_frames(&handle, server, frames + 4, 5000);
+	CHECK(test_server_count(server, "action:result") == 2);
+}
+
+int main() {
+	check_decode();
+	test_server_t *server = test_server_start();
+	check_batch(server);
+	check_executor(server);
+	test_server_stop(server);
+	return 0;
+}